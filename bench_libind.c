@@ -0,0 +1,138 @@
+/* ind/bench_libind.c - microbenchmarks for libind
+ *
+ * (BSD license without advertising clause below)
+ *
+ * Copyright (c) 2019 Thomas Habets <thomas@habets.se>. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+/*
+ * Usage: bench_libind [ -s <MiB> ]
+ *
+ * Feeds generated line-based text through ind_stream_feed() in 4 KiB
+ * chunks, with a few common prefix/postfix combinations, and reports
+ * throughput. Output iovecs are only summed, not written. Each is run
+ * with the kernel picked for the templates, and with the generic one.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include "libind.h"
+
+static double
+now_s(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+bench(const char *name, const char *prefix, const char *postfix,
+      const char *data, size_t len, size_t lines, int generic)
+{
+  struct ind_stream *s;
+  size_t out = 0;
+  size_t off;
+  double t0, t;
+  struct iovec *iov;
+  int iovcnt;
+  int c;
+
+  if (!(s = ind_stream_new(prefix, postfix))) {
+    fprintf(stderr, "bench_libind: ind_stream_new() failed\n");
+    exit(1);
+  }
+  if (generic) {
+    ind_stream_generic(s);
+  }
+  t0 = now_s();
+  for (off = 0; off < len;) {
+    size_t chunk = len - off > 4096 ? 4096 : len - off;
+    while (chunk) {
+      size_t n = ind_stream_feed(s, data + off, chunk, &iov, &iovcnt);
+      for (c = 0; c < iovcnt; c++) {
+        out += iov[c].iov_len;
+      }
+      off += n;
+      chunk -= n;
+    }
+  }
+  ind_stream_flush(s, &iov, &iovcnt);
+  t = now_s() - t0;
+
+  printf("%-24s %-15s %8.1f MiB/s in %8.1f MiB/s out %6.1f ns/line\n",
+         name, ind_stream_kernel(s),
+         len / t / 1048576, out / t / 1048576, t * 1e9 / lines);
+  ind_stream_free(s);
+}
+
+int
+main(int argc, char **argv)
+{
+  size_t len = 64 << 20;
+  size_t lines = 0;
+  size_t off;
+  char *data;
+  int c;
+
+  while (-1 != (c = getopt(argc, argv, "s:"))) {
+    switch (c) {
+    case 's':
+      len = (size_t)atoi(optarg) << 20;
+      break;
+    default:
+      fprintf(stderr, "usage: %s [ -s <MiB> ]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  if (!(data = malloc(len))) {
+    fprintf(stderr, "bench_libind: malloc() failed\n");
+    return 1;
+  }
+  srand(0);
+  for (off = 0; off < len;) {
+    size_t ll = 1 + rand() % 120;
+    for (; ll && off < len - 1; ll--) {
+      data[off++] = 'a' + rand() % 26;
+    }
+    data[off++] = '\n';
+    lines++;
+  }
+
+  for (c = 0; c < 2; c++) {
+    bench("no prefix", "", "", data, len, lines, c);
+    bench("constant prefix", "  ", "", data, len, lines, c);
+    bench("constant prefix+postfix", ">> ", " <<", data, len, lines, c);
+    bench("time prefix", "%F %T ", "", data, len, lines, c);
+    bench("host stream seq prefix", "%{host} %{stream} %{seq} ", "",
+          data, len, lines, c);
+  }
+  free(data);
+  return 0;
+}
@@ -0,0 +1,189 @@
+/* ind/bench_startup.c - measure startup latency of ind
+ *
+ * (BSD license without advertising clause below)
+ *
+ * Copyright (c) 2019 Thomas Habets <thomas@habets.se>. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+/*
+ * Usage: bench_startup [ -n <runs> ] <path to ind>
+ *
+ * Measures, for every run:
+ *   time-to-exec: from starting "ind bench_startup --stamp <fd>" until that
+ *                 grandchild has been exec()ed and reports the time.
+ *   time-to-exit: from starting "ind true" until it has been reaped.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+static double
+now_us(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int
+cmp_double(const void *a, const void *b)
+{
+  double x = *(const double*)a;
+  double y = *(const double*)b;
+  return (x > y) - (x < y);
+}
+
+/**
+ * Start ind with argv, with stdin from /dev/null and stdout/stderr to
+ * /dev/null. Returns pid.
+ */
+static pid_t
+start(char **argv)
+{
+  pid_t pid;
+  int fd;
+
+  switch ((pid = fork())) {
+  case 0:
+    if (0 <= (fd = open("/dev/null", O_RDWR))) {
+      dup2(fd, 0);
+      dup2(fd, 1);
+      dup2(fd, 2);
+    }
+    execv(argv[0], argv);
+    _exit(127);
+  case -1:
+    fprintf(stderr, "bench_startup: fork(): %s\n", strerror(errno));
+    exit(1);
+  }
+  return pid;
+}
+
+static void
+report(const char *name, double *v, int n)
+{
+  double sum = 0;
+  int c;
+
+  qsort(v, n, sizeof(double), cmp_double);
+  for (c = 0; c < n; c++) {
+    sum += v[c];
+  }
+  printf("%-13s min %8.1fus  median %8.1fus  mean %8.1fus  p99 %8.1fus\n",
+         name, v[0], v[n / 2], sum / n, v[(n * 99) / 100]);
+}
+
+int
+main(int argc, char **argv)
+{
+  char self[4096];
+  char *ind;
+  ssize_t len;
+  double *exec_us, *exit_us;
+  int runs = 1000;
+  int c;
+
+  /* grandchild mode: report exec time through the inherited fd */
+  if (argc == 3 && !strcmp(argv[1], "--stamp")) {
+    double t = now_us();
+    write(atoi(argv[2]), &t, sizeof(t));
+    return 0;
+  }
+
+  while (-1 != (c = getopt(argc, argv, "n:"))) {
+    switch (c) {
+    case 'n':
+      runs = atoi(optarg);
+      break;
+    default:
+      fprintf(stderr, "usage: %s [ -n <runs> ] <path to ind>\n", argv[0]);
+      return 1;
+    }
+  }
+  if (optind + 1 != argc || runs < 1) {
+    fprintf(stderr, "usage: %s [ -n <runs> ] <path to ind>\n", argv[0]);
+    return 1;
+  }
+  ind = argv[optind];
+  if (0 < (len = readlink("/proc/self/exe", self, sizeof(self) - 1))) {
+    self[len] = 0;
+  } else {
+    snprintf(self, sizeof(self), "%s", argv[0]);
+  }
+  if (!(exec_us = malloc(runs * sizeof(double)))
+      || !(exit_us = malloc(runs * sizeof(double)))) {
+    fprintf(stderr, "bench_startup: malloc() failed\n");
+    return 1;
+  }
+
+  for (c = 0; c < runs; c++) {
+    char fdstr[16];
+    char *cargv[5];
+    int p[2];
+    double t0, t;
+    pid_t pid;
+    int status;
+
+    /* time-to-exec */
+    if (pipe(p)) {
+      fprintf(stderr, "bench_startup: pipe(): %s\n", strerror(errno));
+      return 1;
+    }
+    snprintf(fdstr, sizeof(fdstr), "%d", p[1]);
+    cargv[0] = ind;
+    cargv[1] = self;
+    cargv[2] = "--stamp";
+    cargv[3] = fdstr;
+    cargv[4] = NULL;
+    t0 = now_us();
+    pid = start(cargv);
+    close(p[1]);
+    if (sizeof(t) != read(p[0], &t, sizeof(t))) {
+      fprintf(stderr, "bench_startup: grandchild did not report\n");
+      return 1;
+    }
+    exec_us[c] = t - t0;
+    close(p[0]);
+    waitpid(pid, &status, 0);
+
+    /* time-to-exit */
+    cargv[1] = "true";
+    cargv[2] = NULL;
+    t0 = now_us();
+    pid = start(cargv);
+    waitpid(pid, &status, 0);
+    exit_us[c] = now_us() - t0;
+  }
+
+  printf("%d runs of %s\n", runs, ind);
+  report("time-to-exec", exec_us, runs);
+  report("time-to-exit", exit_us, runs);
+  return 0;
+}
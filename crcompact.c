@@ -0,0 +1,291 @@
+/* ind/crcompact.c - compact carriage return progress output
+ *
+ * (BSD license without advertising clause below)
+ *
+ * Copyright (c) 2019 Thomas Habets <thomas@habets.se>. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+/*
+ * Progress bars redraw a line by writing "\r" and the new state, over and
+ * over. Once a line has had a "\r" the rest of it is taken as such
+ * redraws: only the latest complete one is kept, and it's shown at most
+ * once per interval. When the line ends with "\n" only its final state is
+ * shown. An interval of 0 means only the final state.
+ *
+ * Output up to and including the first "\r" of a line is passed through
+ * as it comes, so lines without redraws are not delayed or copied.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libind.h"
+#include "crcompact.h"
+
+/* longer redraws are passed through */
+#define CRCOMPACT_SEG_MAX 4096
+
+struct crcompact {
+  long long interval_ms;
+  int redraws;                  /* line has had a \r */
+  long long last_ms;            /* when a redraw was last shown */
+
+  /* redraw being read */
+  char seg[CRCOMPACT_SEG_MAX];
+  size_t seglen;
+
+  /* latest complete redraw, not shown yet */
+  char latest[CRCOMPACT_SEG_MAX];
+  size_t latestlen;
+  int pending;
+
+  /* output that's contiguous in the caller's buffer, not written yet */
+  const char *pend;
+  size_t pendlen;
+};
+
+/**
+ *
+ */
+struct crcompact *
+crcompact_new(long long interval_ms)
+{
+  struct crcompact *c;
+
+  if (!(c = calloc(1, sizeof(struct crcompact)))) {
+    return NULL;
+  }
+  c->interval_ms = interval_ms;
+  return c;
+}
+
+/**
+ *
+ */
+void
+crcompact_free(struct crcompact *c)
+{
+  free(c);
+}
+
+/**
+ * Write out what's pending
+ */
+static int
+crcompact_out_flush(struct crcompact *c, crcompact_out_t out, void *arg)
+{
+  int ret = 0;
+  if (c->pendlen) {
+    ret = out(c->pend, c->pendlen, arg);
+  }
+  c->pend = NULL;
+  c->pendlen = 0;
+  return ret;
+}
+
+/**
+ * Output some data. Data from the caller's buffer is collected while
+ * contiguous, so it's written in as few calls as possible.
+ */
+static int
+crcompact_emit(struct crcompact *c, const char *p, size_t len, int inbuf,
+               crcompact_out_t out, void *arg)
+{
+  if (!len) {
+    return 0;
+  }
+  if (inbuf && c->pendlen && c->pend + c->pendlen == p) {
+    c->pendlen += len;
+    return 0;
+  }
+  if (crcompact_out_flush(c, out, arg)) {
+    return -1;
+  }
+  if (inbuf) {
+    c->pend = p;
+    c->pendlen = len;
+    return 0;
+  }
+  return out(p, len, arg);
+}
+
+/**
+ * Show the latest complete redraw
+ */
+static int
+crcompact_show_latest(struct crcompact *c, long long now,
+                      crcompact_out_t out, void *arg)
+{
+  c->pending = 0;
+  c->last_ms = now;
+  return crcompact_emit(c, c->latest, c->latestlen, 0, out, arg)
+    || crcompact_emit(c, "\r", 1, 0, out, arg);
+}
+
+/**
+ * Feed data from the child, and output what's not compacted away.
+ *
+ * @param   c:     state
+ * @param   buf:   data
+ * @param   len:   length of data
+ * @param   now:   current time in ms
+ * @param   out:   called with output
+ * @param   arg:   passed to out
+ *
+ * @return  0 on success, nonzero if out() failed
+ */
+int
+crcompact_feed(struct crcompact *c, const char *buf, size_t len,
+               long long now, crcompact_out_t out, void *arg)
+{
+  const char *p = buf;
+  const char *end = buf + len;
+
+  while (p < end) {
+    const char *q = ind_mempbrk(p, "\r\n", end - p);
+    size_t n = (q ? q : end) - p;
+
+    if (!c->redraws) {
+      if (crcompact_emit(c, p, q ? n + 1 : n, 1, out, arg)) {
+        return -1;
+      }
+      if (q && *q == '\r') {
+        c->redraws = 1;
+        c->seglen = 0;
+        c->pending = 0;
+        c->last_ms = now;
+      }
+      p = q ? q + 1 : end;
+      continue;
+    }
+
+    if (c->seglen + n > sizeof(c->seg)) {
+      /* not a progress bar. Show it all. */
+      if (crcompact_emit(c, c->seg, c->seglen, 0, out, arg)) {
+        return -1;
+      }
+      c->redraws = 0;
+      c->pending = 0;
+      c->seglen = 0;
+      continue;
+    }
+    memcpy(c->seg + c->seglen, p, n);
+    c->seglen += n;
+    if (!q) {
+      break;
+    }
+    p = q + 1;
+
+    if (*q == '\r') {
+      /* a redraw is complete. Keep it, and show it if it's time. */
+      memcpy(c->latest, c->seg, c->seglen);
+      c->latestlen = c->seglen;
+      c->pending = 1;
+      c->seglen = 0;
+      if (c->interval_ms > 0 && now - c->last_ms >= c->interval_ms) {
+        if (crcompact_show_latest(c, now, out, arg)) {
+          return -1;
+        }
+      }
+      continue;
+    }
+
+    /* end of line. Show its final state. */
+    if (c->seglen) {
+      if (crcompact_emit(c, c->seg, c->seglen, 0, out, arg)) {
+        return -1;
+      }
+    } else if (c->pending) {
+      if (crcompact_show_latest(c, now, out, arg)) {
+        return -1;
+      }
+    }
+    if (crcompact_emit(c, q, 1, 1, out, arg)) {
+      return -1;
+    }
+    c->redraws = 0;
+    c->pending = 0;
+    c->seglen = 0;
+  }
+  return crcompact_out_flush(c, out, arg);
+}
+
+/**
+ * When crcompact_tick() has something to do, in ms. -1 if never.
+ */
+long long
+crcompact_deadline(const struct crcompact *c)
+{
+  if (c->pending && c->interval_ms > 0) {
+    return c->last_ms + c->interval_ms;
+  }
+  return -1;
+}
+
+/**
+ * Show the latest redraw, if it's been held for an interval
+ *
+ * @return  0 on success, nonzero if out() failed
+ */
+int
+crcompact_tick(struct crcompact *c, long long now,
+               crcompact_out_t out, void *arg)
+{
+  if (c->pending && c->interval_ms > 0
+      && now >= c->last_ms + c->interval_ms) {
+    if (crcompact_show_latest(c, now, out, arg)) {
+      return -1;
+    }
+  }
+  return crcompact_out_flush(c, out, arg);
+}
+
+/**
+ * End of stream. Show the final state of an unfinished line.
+ *
+ * @return  0 on success, nonzero if out() failed
+ */
+int
+crcompact_flush(struct crcompact *c, crcompact_out_t out, void *arg)
+{
+  if (c->redraws) {
+    if (c->seglen) {
+      if (crcompact_emit(c, c->seg, c->seglen, 0, out, arg)) {
+        return -1;
+      }
+    } else if (c->pending) {
+      if (crcompact_show_latest(c, 0, out, arg)) {
+        return -1;
+      }
+    }
+  }
+  c->redraws = 0;
+  c->pending = 0;
+  c->seglen = 0;
+  return crcompact_out_flush(c, out, arg);
+}
@@ -0,0 +1,48 @@
+/* ind/crcompact.h - compact carriage return progress output
+ *
+ * (BSD license without advertising clause below)
+ *
+ * Copyright (c) 2019 Thomas Habets <thomas@habets.se>. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef __INCLUDE_CRCOMPACT_H__
+#define __INCLUDE_CRCOMPACT_H__
+
+#include <stddef.h>
+
+struct crcompact;
+
+/* where output goes. Returns nonzero on error, which is passed on. */
+typedef int (*crcompact_out_t)(const char *buf, size_t len, void *arg);
+
+struct crcompact *crcompact_new(long long interval_ms);
+void crcompact_free(struct crcompact *c);
+int crcompact_feed(struct crcompact *c, const char *buf, size_t len,
+                   long long now, crcompact_out_t out, void *arg);
+long long crcompact_deadline(const struct crcompact *c);
+int crcompact_tick(struct crcompact *c, long long now,
+                   crcompact_out_t out, void *arg);
+int crcompact_flush(struct crcompact *c, crcompact_out_t out, void *arg);
+
+#endif
@@ -0,0 +1,471 @@
+/* ind/dedup.c - collapse repeated lines
+ *
+ * (BSD license without advertising clause below)
+ *
+ * Copyright (c) 2019 Thomas Habets <thomas@habets.se>. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+/*
+ * A line that is the same as the one before it is not shown. When a
+ * different line shows up, or when a run of repeats has gone on for a
+ * while, a "[last line repeated N times]" line is shown instead.
+ *
+ * The start of every line is compared to the previous line as it comes
+ * in. Only bytes that still match are held back, so a line that's not a
+ * repeat goes out as soon as it differs, and in the same large chunks as
+ * without dedup. A line that stops before it's known either way (such as
+ * a progress line without a newline) is let go after DEDUP_HOLD_MS.
+ * Memory use is fixed: lines longer than DEDUP_LINE_MAX are never
+ * collapsed.
+ *
+ * Optionally a leading time stamp (digits and punctuation, with at least
+ * one ':') is not compared, so that "12:00:01 retrying" and
+ * "12:00:02 retrying" count as the same.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dedup.h"
+
+#define DEDUP_LINE_MAX 4096
+
+/* longest an unfinished line is held back, in ms */
+#define DEDUP_HOLD_MS 50
+
+/* longest time stamp that's skipped */
+#define DEDUP_STAMP_MAX 64
+
+enum {
+  DEDUP_START,          /* at start of line */
+  DEDUP_STAMP,          /* maybe in time stamp, holding */
+  DEDUP_MATCH,          /* same as previous line so far, holding */
+  DEDUP_PASS,           /* not a repeat, passing through */
+};
+
+struct dedup {
+  long long window_ms;
+  int skip_time;
+  int state;
+
+  /* previous line, without time stamp. Points into the caller's buffer
+   * until the end of the chunk, when it's copied to store[prevstore]. */
+  const char *prev;
+  size_t prevlen;
+  int prevok;
+  int previnbuf;
+  char store[2][DEDUP_LINE_MAX];
+  int prevstore;
+
+  /* line being passed through, to be the next prev. Starts at curp in
+   * caller's buffer, or if curp is NULL is in store[!prevstore]. */
+  const char *curp;
+  size_t curlen;
+  int curok;
+
+  /* held back part of current line from earlier chunks. The part from
+   * the current chunk is still in the caller's buffer. */
+  char held[DEDUP_STAMP_MAX + DEDUP_LINE_MAX];
+  size_t heldlen;
+  long long held_ms;
+  size_t stamp;         /* held bytes that are time stamp */
+  size_t matched;
+  int colon;
+
+  /* suppressed repeats */
+  unsigned long count;
+  long long first_ms;
+
+  /* output that's contiguous in the caller's buffer, not written yet */
+  const char *pend;
+  size_t pendlen;
+};
+
+/**
+ *
+ */
+struct dedup *
+dedup_new(long long window_ms, int skip_time)
+{
+  struct dedup *d;
+
+  if (!(d = calloc(1, sizeof(struct dedup)))) {
+    return NULL;
+  }
+  d->window_ms = window_ms;
+  d->skip_time = skip_time;
+  d->state = DEDUP_START;
+  return d;
+}
+
+/**
+ *
+ */
+void
+dedup_free(struct dedup *d)
+{
+  free(d);
+}
+
+/**
+ * Write out what's pending
+ */
+static int
+dedup_out_flush(struct dedup *d, dedup_out_t out, void *arg)
+{
+  int ret = 0;
+  if (d->pendlen) {
+    ret = out(d->pend, d->pendlen, arg);
+  }
+  d->pend = NULL;
+  d->pendlen = 0;
+  return ret;
+}
+
+/**
+ * Output some data. Data from the caller's buffer is collected while
+ * contiguous, so it's written in as few calls as possible.
+ */
+static int
+dedup_emit(struct dedup *d, const char *p, size_t len, int inbuf,
+           dedup_out_t out, void *arg)
+{
+  if (!len) {
+    return 0;
+  }
+  if (inbuf && d->pendlen && d->pend + d->pendlen == p) {
+    d->pendlen += len;
+    return 0;
+  }
+  if (dedup_out_flush(d, out, arg)) {
+    return -1;
+  }
+  if (inbuf) {
+    d->pend = p;
+    d->pendlen = len;
+    return 0;
+  }
+  return out(p, len, arg);
+}
+
+/**
+ * Output and reset the repeat count
+ */
+static int
+dedup_marker(struct dedup *d, dedup_out_t out, void *arg)
+{
+  char buf[64];
+  int n;
+
+  if (!d->count) {
+    return 0;
+  }
+  n = snprintf(buf, sizeof(buf), "[last line repeated %lu time%s]\n",
+               d->count, (d->count == 1) ? "" : "s");
+  d->count = 0;
+  return dedup_emit(d, buf, n, 0, out, arg);
+}
+
+/**
+ * Current line is not a repeat. Output marker and the held back bytes, and
+ * start passing through.
+ *
+ * @param   hstart:  held bytes in caller's buffer start here (may be NULL)
+ * @param   hlen:    number of held bytes in caller's buffer
+ */
+static int
+dedup_diverge(struct dedup *d, const char *hstart, size_t hlen,
+              dedup_out_t out, void *arg)
+{
+  if (dedup_marker(d, out, arg)
+      || dedup_emit(d, d->held, d->heldlen, 0, out, arg)
+      || dedup_emit(d, hstart, hlen, 1, out, arg)) {
+    return -1;
+  }
+  /* what was held, minus time stamp, is the start of the next prev */
+  d->curok = 1;
+  d->curlen = 0;
+  if (d->stamp >= d->heldlen && hstart) {
+    /* all in caller's buffer, so no copying */
+    d->curp = hstart + (d->stamp - d->heldlen);
+  } else {
+    char *cur = d->store[!d->prevstore];
+    d->curp = NULL;
+    if (d->stamp < d->heldlen) {
+      d->curlen = d->heldlen - d->stamp;
+      memcpy(cur, d->held + d->stamp, d->curlen);
+    }
+    if (d->curlen + hlen <= DEDUP_LINE_MAX) {
+      memcpy(cur + d->curlen, hstart, hlen);
+      d->curlen += hlen;
+    } else {
+      d->curok = 0;
+    }
+  }
+  d->heldlen = 0;
+  d->state = DEDUP_PASS;
+  return 0;
+}
+
+/**
+ * Is byte part of what a time stamp can look like
+ */
+static int
+dedup_stampchar(char ch)
+{
+  return (ch >= '0' && ch <= '9') || strchr("-:./T+Z[](), ", ch);
+}
+
+/**
+ * Compare held back bytes, from both places, to start of prev
+ */
+static int
+dedup_held_matches(const struct dedup *d, const char *hstart, size_t hlen)
+{
+  return d->prevok
+    && d->heldlen + hlen <= d->prevlen
+    && !memcmp(d->prev, d->held, d->heldlen)
+    && !memcmp(d->prev + d->heldlen, hstart, hlen);
+}
+
+/**
+ * Feed data from the child, and output what's not suppressed.
+ *
+ * @param   d:     dedup state
+ * @param   buf:   data
+ * @param   len:   length of data
+ * @param   now:   current time in ms
+ * @param   out:   called with output
+ * @param   arg:   passed to out
+ *
+ * @return  0 on success, nonzero if out() failed
+ */
+int
+dedup_feed(struct dedup *d, const char *buf, size_t len, long long now,
+           dedup_out_t out, void *arg)
+{
+  const char *p = buf;
+  const char *end = buf + len;
+  const char *hstart = buf;   /* held bytes of this chunk start here */
+
+  while (p < end) {
+    switch (d->state) {
+    case DEDUP_START:
+      d->heldlen = 0;
+      d->matched = 0;
+      d->stamp = 0;
+      d->colon = 0;
+      d->held_ms = now;
+      hstart = p;
+      d->state = d->skip_time ? DEDUP_STAMP : DEDUP_MATCH;
+      break;
+
+    case DEDUP_STAMP:
+      if (d->heldlen + (p - hstart) < DEDUP_STAMP_MAX
+          && dedup_stampchar(*p)) {
+        d->colon |= (*p == ':');
+        p++;
+        break;
+      }
+      if (d->colon) {
+        /* time stamp ends here. Hold it, but don't compare it. */
+        d->stamp = d->heldlen + (p - hstart);
+        d->state = DEDUP_MATCH;
+        break;
+      }
+      /* not a time stamp after all, so it has to match too */
+      if (!dedup_held_matches(d, hstart, p - hstart)) {
+        if (dedup_diverge(d, hstart, p - hstart, out, arg)) {
+          return -1;
+        }
+        break;
+      }
+      d->matched = d->heldlen + (p - hstart);
+      d->state = DEDUP_MATCH;
+      break;
+
+    case DEDUP_MATCH: {
+      size_t n = 0;
+      size_t max = end - p;
+      if (d->prevok) {
+        if (max > d->prevlen - d->matched) {
+          max = d->prevlen - d->matched;
+        }
+        while (n < max && p[n] == d->prev[d->matched + n]) {
+          n++;
+        }
+      }
+      p += n;
+      d->matched += n;
+      if (p == end) {
+        break;
+      }
+      if (*p == '\n' && d->prevok && d->matched == d->prevlen) {
+        /* a repeat. Drop it. */
+        if (!d->count++) {
+          d->first_ms = now;
+        }
+        d->state = DEDUP_START;
+        p++;
+        break;
+      }
+      if (dedup_diverge(d, hstart, p - hstart, out, arg)) {
+        return -1;
+      }
+      break;
+    }
+
+    case DEDUP_PASS: {
+      const char *nl = memchr(p, '\n', end - p);
+      const char *stop = nl ? nl + 1 : end;
+
+      if (dedup_emit(d, p, stop - p, 1, out, arg)) {
+        return -1;
+      }
+      if (nl) {
+        if (d->curp) {
+          d->prev = d->curp;
+          d->prevlen = nl - d->curp;
+          d->prevok = d->prevlen <= DEDUP_LINE_MAX;
+          d->previnbuf = 1;
+        } else {
+          size_t n = nl - p;
+          if (d->curok && d->curlen + n <= DEDUP_LINE_MAX) {
+            memcpy(d->store[!d->prevstore] + d->curlen, p, n);
+            d->curlen += n;
+          } else {
+            d->curok = 0;
+          }
+          d->prevstore = !d->prevstore;
+          d->prev = d->store[d->prevstore];
+          d->prevlen = d->curlen;
+          d->prevok = d->curok;
+          d->previnbuf = 0;
+        }
+        d->state = DEDUP_START;
+      } else if (!d->curp) {
+        size_t n = end - p;
+        if (d->curok && d->curlen + n <= DEDUP_LINE_MAX) {
+          memcpy(d->store[!d->prevstore] + d->curlen, p, n);
+          d->curlen += n;
+        } else {
+          d->curok = 0;
+        }
+      }
+      p = stop;
+      break;
+    }
+    }
+  }
+
+  /* the caller's buffer goes away, so copy what still points into it */
+  if (d->previnbuf) {
+    if (d->prevok) {
+      memcpy(d->store[d->prevstore], d->prev, d->prevlen);
+    }
+    d->prev = d->store[d->prevstore];
+    d->previnbuf = 0;
+  }
+  if (d->state == DEDUP_PASS && d->curp) {
+    size_t n = end - d->curp;
+    if (n <= DEDUP_LINE_MAX) {
+      memcpy(d->store[!d->prevstore], d->curp, n);
+      d->curlen = n;
+    } else {
+      d->curok = 0;
+    }
+    d->curp = NULL;
+  }
+  if (d->state == DEDUP_STAMP || d->state == DEDUP_MATCH) {
+    memcpy(d->held + d->heldlen, hstart, end - hstart);
+    d->heldlen += end - hstart;
+  }
+  return dedup_out_flush(d, out, arg);
+}
+
+/**
+ * When dedup_tick() has something to do, in ms. -1 if never.
+ */
+long long
+dedup_deadline(const struct dedup *d)
+{
+  long long ret = -1;
+
+  if (d->count) {
+    ret = d->first_ms + d->window_ms;
+  }
+  if (d->heldlen
+      && (d->state == DEDUP_STAMP || d->state == DEDUP_MATCH)
+      && (ret < 0 || d->held_ms + DEDUP_HOLD_MS < ret)) {
+    ret = d->held_ms + DEDUP_HOLD_MS;
+  }
+  return ret;
+}
+
+/**
+ * Show the repeat count if the run of repeats has gone on for a window,
+ * and let go of an unfinished line that has been held for DEDUP_HOLD_MS.
+ *
+ * @return  0 on success, nonzero if out() failed
+ */
+int
+dedup_tick(struct dedup *d, long long now, dedup_out_t out, void *arg)
+{
+  if (d->heldlen
+      && (d->state == DEDUP_STAMP || d->state == DEDUP_MATCH)
+      && now >= d->held_ms + DEDUP_HOLD_MS) {
+    if (dedup_diverge(d, NULL, 0, out, arg)) {
+      return -1;
+    }
+  }
+  if (d->count && now >= d->first_ms + d->window_ms) {
+    if (dedup_marker(d, out, arg)) {
+      return -1;
+    }
+  }
+  return dedup_out_flush(d, out, arg);
+}
+
+/**
+ * End of stream. Output repeat count and anything held back.
+ *
+ * @return  0 on success, nonzero if out() failed
+ */
+int
+dedup_flush(struct dedup *d, dedup_out_t out, void *arg)
+{
+  if (d->state == DEDUP_STAMP || d->state == DEDUP_MATCH) {
+    if (dedup_diverge(d, NULL, 0, out, arg)) {
+      return -1;
+    }
+  }
+  if (dedup_marker(d, out, arg)) {
+    return -1;
+  }
+  return dedup_out_flush(d, out, arg);
+}
@@ -0,0 +1,203 @@
+/* ind/fair.c - weighted-fair reading of child streams
+ *
+ * (BSD license without advertising clause below)
+ *
+ * Copyright (c) 2019 Thomas Habets <thomas@habets.se>. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+/*
+ * Deficit round robin over the streams select() found readable. Every
+ * round each stream may read its weight times FAIR_QUANTUM bytes, and
+ * what it leaves unused carries over. Streams that read little in this
+ * wakeup go first, so a stream with a line now and then is not stuck
+ * behind a flood. A stream that read a lot is probably not drained yet,
+ * and is read again in the next round if poll() agrees, without going
+ * back to select(). Rounds end when all streams are drained, after
+ * FAIR_BUDGET bytes so that timers and writes get their turn, or as soon
+ * as there's input from the user.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+#include <time.h>
+#include <poll.h>
+
+#if HAVE_ALLOCA_H
+#include <alloca.h>
+#endif
+
+#include "fair.h"
+
+#define FAIR_QUANTUM 16384
+#define FAIR_READ_MAX 65536
+#define FAIR_BUDGET 262144
+#define FAIR_MORE 1024
+#define FAIR_URGENT_MAX 2
+
+/**
+ * Monotonic time in nanoseconds
+ */
+long long
+fair_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * Set up a stream that was found readable at ready_ns
+ */
+void
+fair_src_init(struct fair_src *src, int fd, int weight,
+               struct fair_lat *lat, void *data, long long ready_ns)
+{
+  memset(src, 0, sizeof(*src));
+  src->fd = fd;
+  src->weight = weight;
+  src->lat = lat;
+  src->data = data;
+  src->ready_ns = ready_ns;
+}
+
+/**
+ *
+ */
+static void
+lat_add(struct fair_lat *lat, long long ns)
+{
+  double s = ns / 1e9;
+  lat->count++;
+  lat->total += s;
+  if (s > lat->max) {
+    lat->max = s;
+  }
+}
+
+/**
+ * Serve readable streams until they're drained or the budget is used up.
+ * Streams that are done are marked so, for the caller to clean up.
+ *
+ * @param   srcs     readable streams
+ * @param   urgent   fds (e.g. user input) that end the rounds when
+ *                   readable, -1 for none
+ * @param   fn       reads from one stream
+ *
+ * @return  bytes read
+ */
+size_t
+fair_run(struct fair_src *srcs, int nsrcs,
+          const int *urgent, int nurgent,
+          fair_read_fn fn, void *arg)
+{
+  struct fair_src **active;
+  struct pollfd *pfd;
+  size_t total = 0;
+  int nactive = 0;
+  int c, i;
+
+  active = alloca((nsrcs + 1) * sizeof(*active));
+  pfd = alloca((nsrcs + FAIR_URGENT_MAX) * sizeof(*pfd));
+  for (c = 0; c < nsrcs; c++) {
+    active[nactive++] = &srcs[c];
+  }
+
+  while (nactive) {
+    int keep = 0;
+    int npfd;
+    long long now;
+
+    /* least served first */
+    for (c = 1; c < nactive; c++) {
+      struct fair_src *s = active[c];
+      for (i = c; i > 0 && active[i - 1]->got > s->got; i--) {
+        active[i] = active[i - 1];
+      }
+      active[i] = s;
+    }
+
+    for (c = 0; c < nactive; c++) {
+      struct fair_src *s = active[c];
+      size_t max;
+      ssize_t n;
+
+      s->deficit += (size_t)s->weight * FAIR_QUANTUM;
+      max = s->deficit < FAIR_READ_MAX ? s->deficit : FAIR_READ_MAX;
+      if (s->ready_ns) {
+        lat_add(s->lat, fair_now() - s->ready_ns);
+        s->ready_ns = 0;
+      }
+      n = fn(s, max, arg);
+      if (0 > n) {
+        s->done = 1;
+        continue;
+      }
+      s->deficit -= n;
+      s->got += n;
+      total += n;
+      if ((size_t)n >= FAIR_MORE) {
+        active[keep++] = s;
+      }
+    }
+    nactive = keep;
+    if (!nactive || total >= FAIR_BUDGET) {
+      break;
+    }
+
+    /* still more, or is the user waiting? */
+    npfd = 0;
+    for (c = 0; c < nactive; c++) {
+      pfd[npfd].fd = active[c]->fd;
+      pfd[npfd].events = POLLIN;
+      npfd++;
+    }
+    for (c = 0; c < nurgent && c < FAIR_URGENT_MAX; c++) {
+      pfd[npfd].fd = urgent[c];
+      pfd[npfd].events = POLLIN;
+      npfd++;
+    }
+    if (0 >= poll(pfd, npfd, 0)) {
+      break;
+    }
+    for (c = nactive; c < npfd; c++) {
+      if (pfd[c].revents) {
+        return total;
+      }
+    }
+    now = fair_now();
+    keep = 0;
+    for (c = 0; c < nactive; c++) {
+      if (pfd[c].revents) {
+        active[c]->ready_ns = now;
+        active[keep++] = active[c];
+      } else {
+        active[c]->deficit = 0;
+      }
+    }
+    nactive = keep;
+  }
+  return total;
+}
@@ -0,0 +1,71 @@
+/* ind/fair.h - weighted-fair reading of child streams
+ *
+ * (BSD license without advertising clause below)
+ *
+ * Copyright (c) 2019 Thomas Habets <thomas@habets.se>. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef __INCLUDE_FAIR_H__
+#define __INCLUDE_FAIR_H__
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/* how long streams waited to be read, from select() or poll() finding
+ * them readable to being read. Not from when data arrived. */
+struct fair_lat {
+  unsigned long count;
+  double total;
+  double max;
+};
+
+/* a readable stream, for one wakeup */
+struct fair_src {
+  int fd;
+  int weight;
+  struct fair_lat *lat;
+  void *data;           /* the caller's */
+  size_t deficit;
+  size_t got;
+  long long ready_ns;
+  int done;
+};
+
+/**
+ * Read at most max bytes from src and pass them on.
+ *
+ * @return  bytes read, 0 if there's nothing to read now, -1 if the stream
+ *          is done
+ */
+typedef ssize_t (*fair_read_fn)(struct fair_src *src, size_t max,
+                                 void *arg);
+
+long long fair_now(void);
+void fair_src_init(struct fair_src *src, int fd, int weight,
+                    struct fair_lat *lat, void *data, long long ready_ns);
+size_t fair_run(struct fair_src *srcs, int nsrcs,
+                 const int *urgent, int nurgent,
+                 fair_read_fn fn, void *arg);
+
+#endif
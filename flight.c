@@ -0,0 +1,422 @@
+/* ind/flight.c - flight recorder of recent output
+ *
+ * (BSD license without advertising clause below)
+ *
+ * Copyright (c) 2019 Thomas Habets <thomas@habets.se>. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+/*
+ * Flight recorder file format (native byte order):
+ *
+ *   { "INDFLT01", u64 size, { u64 head, u64 tail } ring[2] }   header
+ *   <size bytes>                                             stdout ring
+ *   <size bytes>                                             stderr ring
+ *
+ * A ring holds records { u64 ns, u32 len, u32 pad } + <len bytes> of
+ * decorated output, where ns is CLOCK_REALTIME. Records wrap around the
+ * end of the ring. head and tail are byte counts since the start, so the
+ * ring offset is head % size. tail is the oldest whole record.
+ *
+ * The file is a shared mapping, so what was written is in the page cache
+ * even if ind gets killed, and can be read with flight_read().
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+#include "flight.h"
+
+static const char flight_magic[8] = { 'I','N','D','F','L','T','0','1' };
+
+struct flight_ring {
+  uint64_t head;
+  uint64_t tail;
+};
+
+struct flight_hdr {
+  char magic[8];
+  uint64_t size;
+  struct flight_ring ring[2];
+};
+
+struct flight_rec {
+  uint64_t ns;
+  uint32_t len;
+  uint32_t pad;
+};
+
+static struct flight_hdr *flight_map;
+static size_t flight_maplen;
+static char *flight_fn;
+
+/**
+ * Start of ring data
+ */
+static char *
+flight_data(struct flight_hdr *h, int ring)
+{
+  return (char*)h + sizeof(struct flight_hdr) + ring * h->size;
+}
+
+/**
+ * Copy into ring at absolute offset off, wrapping as needed
+ */
+static void
+flight_put(struct flight_hdr *h, int ring, uint64_t off,
+           const void *src, size_t len)
+{
+  char *data = flight_data(h, ring);
+  size_t pos = off % h->size;
+  size_t first = h->size - pos;
+
+  if (first > len) {
+    first = len;
+  }
+  memcpy(data + pos, src, first);
+  memcpy(data, (const char*)src + first, len - first);
+}
+
+/**
+ * Copy out of ring from absolute offset off, wrapping as needed
+ */
+static void
+flight_get(struct flight_hdr *h, int ring, uint64_t off,
+           void *dst, size_t len)
+{
+  const char *data = flight_data(h, ring);
+  size_t pos = off % h->size;
+  size_t first = h->size - pos;
+
+  if (first > len) {
+    first = len;
+  }
+  memcpy(dst, data + pos, first);
+  memcpy((char*)dst + first, data, len - first);
+}
+
+/**
+ * Create the backing file and map it.
+ *
+ * @param   fn:    file name. NULL means a temporary file that's removed by
+ *                 flight_close()
+ * @param   size:  bytes of ring per stream
+ *
+ * @return  0 on success, -1 on error (errno set)
+ */
+int
+flight_open(const char *fn, size_t size)
+{
+  char *tmp = NULL;
+  void *map;
+  int fd;
+
+  if (size < 2 * sizeof(struct flight_rec)) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (fn) {
+    fd = open(fn, O_RDWR | O_CREAT | O_TRUNC, 0600);
+  } else {
+    const char *dir = getenv("TMPDIR");
+    if (!dir || !*dir) {
+      dir = "/tmp";
+    }
+    if (!(tmp = malloc(strlen(dir) + 32))) {
+      return -1;
+    }
+    sprintf(tmp, "%s/ind-flight.XXXXXX", dir);
+    fd = mkstemp(tmp);
+    fn = tmp;
+  }
+  if (0 > fd) {
+    free(tmp);
+    return -1;
+  }
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+  flight_maplen = sizeof(struct flight_hdr) + 2 * size;
+  if (ftruncate(fd, flight_maplen)
+      || MAP_FAILED == (map = mmap(NULL, flight_maplen,
+                                   PROT_READ | PROT_WRITE, MAP_SHARED,
+                                   fd, 0))) {
+    int save = errno;
+    close(fd);
+    unlink(fn);
+    free(tmp);
+    errno = save;
+    return -1;
+  }
+  close(fd);
+
+  flight_map = map;
+  memcpy(flight_map->magic, flight_magic, sizeof(flight_magic));
+  flight_map->size = size;
+  flight_fn = tmp;
+  return 0;
+}
+
+/**
+ * Append decorated output to a stream's ring, dropping the oldest
+ * records to make room. Only the tail end is kept of output larger than
+ * the ring.
+ *
+ * @param   err:     nonzero for stderr
+ * @param   iov:     decorated output
+ * @param   iovcnt:  length of iov
+ */
+void
+flight_iov(int err, const struct iovec *iov, int iovcnt)
+{
+  struct flight_hdr *h = flight_map;
+  struct flight_ring *r;
+  struct flight_rec rec;
+  struct timespec ts;
+  uint64_t off;
+  size_t len = 0;
+  size_t skip;
+  int c;
+
+  if (!h) {
+    return;
+  }
+  r = &h->ring[!!err];
+  for (c = 0; c < iovcnt; c++) {
+    len += iov[c].iov_len;
+  }
+  if (!len) {
+    return;
+  }
+  skip = 0;
+  if (len > h->size - sizeof(rec)) {
+    skip = len - (h->size - sizeof(rec));
+    len -= skip;
+  }
+
+  /* evict whole records until there's room */
+  while (r->head + sizeof(rec) + len - r->tail > h->size) {
+    struct flight_rec old;
+    flight_get(h, !!err, r->tail, &old, sizeof(old));
+    r->tail += sizeof(old) + old.len;
+  }
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  memset(&rec, 0, sizeof(rec));
+  rec.ns = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+  rec.len = len;
+  off = r->head;
+  flight_put(h, !!err, off, &rec, sizeof(rec));
+  off += sizeof(rec);
+  for (c = 0; c < iovcnt; c++) {
+    const char *p = iov[c].iov_base;
+    size_t n = iov[c].iov_len;
+    if (skip >= n) {
+      skip -= n;
+      continue;
+    }
+    p += skip;
+    n -= skip;
+    skip = 0;
+    flight_put(h, !!err, off, p, n);
+    off += n;
+  }
+  /* only now is the record visible */
+  r->head = off;
+}
+
+/**
+ * Write ring contents, oldest first and both streams merged by time. Every
+ * line gets the time its first byte was written.
+ */
+static void
+flight_print(struct flight_hdr *h, FILE *f)
+{
+  uint64_t off[2];
+  int bol[2] = { 1, 1 };
+  char *buf = NULL;
+  size_t bufsize = 0;
+
+  off[0] = h->ring[0].tail;
+  off[1] = h->ring[1].tail;
+  for (;;) {
+    struct flight_rec rec[2];
+    int ring = -1;
+    int c;
+    size_t i;
+
+    for (c = 0; c < 2; c++) {
+      if (off[c] + sizeof(rec[c]) > h->ring[c].head) {
+        continue;
+      }
+      flight_get(h, c, off[c], &rec[c], sizeof(rec[c]));
+      if (ring < 0 || rec[c].ns < rec[ring].ns) {
+        ring = c;
+      }
+    }
+    if (ring < 0) {
+      break;
+    }
+    if (rec[ring].len > h->size) {
+      fprintf(f, "ind: flight recorder is corrupt\n");
+      break;
+    }
+    if (rec[ring].len > bufsize) {
+      free(buf);
+      if (!(buf = malloc(bufsize = rec[ring].len))) {
+        break;
+      }
+    }
+    flight_get(h, ring, off[ring] + sizeof(rec[ring]), buf, rec[ring].len);
+    off[ring] += sizeof(rec[ring]) + rec[ring].len;
+
+    for (i = 0; i < rec[ring].len; i++) {
+      if (bol[ring]) {
+        time_t t = rec[ring].ns / 1000000000ULL;
+        struct tm tm;
+        char ts[32];
+        if (!localtime_r(&t, &tm)
+            || !strftime(ts, sizeof(ts), "%F %T", &tm)) {
+          strcpy(ts, "?");
+        }
+        fprintf(f, "%s.%03u ", ts,
+                (unsigned)((rec[ring].ns / 1000000ULL) % 1000));
+        bol[ring] = 0;
+      }
+      putc(buf[i], f);
+      if (buf[i] == '\n') {
+        bol[ring] = 1;
+      }
+    }
+  }
+  if (!bol[0] || !bol[1]) {
+    putc('\n', f);
+  }
+  free(buf);
+}
+
+/**
+ * Dump what's in the rings, to a file (appended to) or stderr
+ *
+ * @param   fn:   file name, or NULL for stderr
+ * @param   why:  shown in the header line
+ */
+void
+flight_dump(const char *fn, const char *why)
+{
+  FILE *f = stderr;
+
+  if (!flight_map) {
+    return;
+  }
+  if (fn && !(f = fopen(fn, "a"))) {
+    fprintf(stderr, "ind: can't open %s for flight recorder dump: %s\n",
+            fn, strerror(errno));
+    f = stderr;
+  }
+  fprintf(f, "ind: ---- flight recorder: %s ----\n", why);
+  flight_print(flight_map, f);
+  fprintf(f, "ind: ---- end of flight recorder ----\n");
+  if (f != stderr) {
+    fclose(f);
+  } else {
+    fflush(f);
+  }
+}
+
+/**
+ * Print a flight recorder file left behind, e.g. by an ind that was killed
+ *
+ * @return  0 on success, -1 on error (message already printed)
+ */
+int
+flight_read(const char *fn)
+{
+  struct flight_hdr *h;
+  struct stat st;
+  void *map;
+  int fd;
+
+  if (0 > (fd = open(fn, O_RDONLY))) {
+    fprintf(stderr, "ind: can't open %s: %s\n", fn, strerror(errno));
+    return -1;
+  }
+  if (fstat(fd, &st)) {
+    fprintf(stderr, "ind: fstat(%s): %s\n", fn, strerror(errno));
+    close(fd);
+    return -1;
+  }
+  if ((size_t)st.st_size < sizeof(struct flight_hdr)) {
+    fprintf(stderr, "ind: %s is not a flight recorder file\n", fn);
+    close(fd);
+    return -1;
+  }
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (MAP_FAILED == map) {
+    fprintf(stderr, "ind: mmap(%s): %s\n", fn, strerror(errno));
+    return -1;
+  }
+  h = map;
+  if (memcmp(h->magic, flight_magic, sizeof(flight_magic))
+      || !h->size
+      || (size_t)st.st_size != sizeof(struct flight_hdr) + 2 * h->size) {
+    fprintf(stderr, "ind: %s is not a flight recorder file\n", fn);
+    munmap(map, st.st_size);
+    return -1;
+  }
+  flight_print(h, stdout);
+  fflush(stdout);
+  munmap(map, st.st_size);
+  return 0;
+}
+
+/**
+ * Unmap, and remove the file if it was a temporary one
+ */
+void
+flight_close(void)
+{
+  if (!flight_map) {
+    return;
+  }
+  munmap(flight_map, flight_maplen);
+  flight_map = NULL;
+  if (flight_fn) {
+    unlink(flight_fn);
+    free(flight_fn);
+    flight_fn = NULL;
+  }
+}
@@ -0,0 +1,371 @@
+/* ind/gaps.c - where the output of the child goes quiet
+ *
+ * (BSD license without advertising clause below)
+ *
+ * Copyright (c) 2019 Thomas Habets <thomas@habets.se>. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+/*
+ * For --gaps: how long a stream went without a line, for finding the slow
+ * step of a long build. A line is taken to arrive when its newline is
+ * read, so all but the first line of a read have no gap before them and
+ * only need counting. Only the first and last line of a read are copied,
+ * to have the lines around a silence at hand.
+ *
+ * Gaps of GAPS_QUIET_NS or more count as quiet time, and end a burst.
+ * The time before the first line and after the last count too.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+
+#include "gaps.h"
+
+/* how much of the lines around a gap is kept */
+#define GAPS_LINE_MAX 80
+
+#define GAPS_QUIET_NS 1000000000LL
+
+/* histogram buckets, by upper bound */
+#define GAPS_BUCKETS 8
+static const long long gaps_bound[GAPS_BUCKETS - 1] = {
+  1000000LL,            /* 1ms */
+  10000000LL,
+  100000000LL,
+  1000000000LL,         /* 1s */
+  10000000000LL,
+  60000000000LL,        /* 1min */
+  600000000000LL,
+};
+static const char *gaps_label[GAPS_BUCKETS] = {
+  "<1ms", "1-10ms", "10-100ms", "0.1-1s", "1-10s", "10-60s", "1-10min",
+  ">10min",
+};
+
+struct gap {
+  long long ns;
+  long long at_ns;      /* when it started, since start */
+  unsigned long line;   /* number of the line before it */
+  int end;              /* no line after it */
+  char before[GAPS_LINE_MAX + 1];
+  char after[GAPS_LINE_MAX + 1];
+};
+
+struct gaps {
+  const char *name;
+  long long start_ns;
+  long long last_ns;    /* when the last line came, or start_ns */
+  long long end_ns;     /* when the stream was closed, or -1 */
+  unsigned long lines;
+  unsigned long bursts;
+  long long quiet_ns;
+  unsigned long hist[GAPS_BUCKETS];
+
+  /* the line before the gap, and the one being read */
+  char prev[GAPS_LINE_MAX + 1];
+  char cur[GAPS_LINE_MAX + 1];
+  size_t curlen;
+
+  /* longest gaps, longest first */
+  int top;
+  int ntop;
+  struct gap *tops;
+};
+
+/**
+ * Create state for one stream.
+ *
+ * @param   name:     stream name for the report. Not copied.
+ * @param   top:      how many of the longest gaps to show
+ * @param   start_ns: when the command was started
+ */
+struct gaps *
+gaps_new(const char *name, int top, long long start_ns)
+{
+  struct gaps *g;
+
+  if (!(g = calloc(1, sizeof(*g)))) {
+    return NULL;
+  }
+  if (!(g->tops = calloc(top, sizeof(*g->tops)))) {
+    free(g);
+    return NULL;
+  }
+  g->name = name;
+  g->top = top;
+  g->start_ns = g->last_ns = start_ns;
+  g->end_ns = -1;
+  return g;
+}
+
+/**
+ *
+ */
+void
+gaps_free(struct gaps *g)
+{
+  if (g) {
+    free(g->tops);
+    free(g);
+  }
+}
+
+/**
+ * Copy a line, without its CR if it came through a pty, and with other
+ * control characters (such as color codes) made harmless for the report
+ */
+static void
+gaps_copy(char *dst, const char *src, size_t len)
+{
+  size_t c;
+
+  if (len && src[len - 1] == '\r') {
+    len--;
+  }
+  if (len > GAPS_LINE_MAX) {
+    len = GAPS_LINE_MAX;
+  }
+  for (c = 0; c < len; c++) {
+    dst[c] = ((unsigned char)src[c] < ' ' && src[c] != '\t') ? '?' : src[c];
+  }
+  dst[len] = 0;
+}
+
+/**
+ * Add to the line being read, as much as fits
+ */
+static void
+gaps_cur_add(struct gaps *g, const char *buf, size_t len)
+{
+  if (g->curlen + len > GAPS_LINE_MAX + 1) {
+    len = GAPS_LINE_MAX + 1 - g->curlen;
+  }
+  memcpy(g->cur + g->curlen, buf, len);
+  g->curlen += len;
+}
+
+/**
+ * Count a gap of ns before the line now done (after, or NULL at the end)
+ */
+static void
+gaps_add(struct gaps *g, long long ns, const char *after, size_t afterlen)
+{
+  int c;
+
+  for (c = 0; c < GAPS_BUCKETS - 1 && ns >= gaps_bound[c]; c++) {
+  }
+  g->hist[c]++;
+  if (ns >= GAPS_QUIET_NS) {
+    g->quiet_ns += ns;
+    if (g->lines && after) {
+      g->bursts++;
+    }
+  }
+
+  /* the usual case: not one of the longest */
+  if (g->ntop == g->top && ns <= g->tops[g->ntop - 1].ns) {
+    return;
+  }
+  if (g->ntop < g->top) {
+    g->ntop++;
+  }
+  for (c = g->ntop - 1; c > 0 && g->tops[c - 1].ns < ns; c--) {
+    g->tops[c] = g->tops[c - 1];
+  }
+  g->tops[c].ns = ns;
+  g->tops[c].at_ns = g->last_ns - g->start_ns;
+  g->tops[c].line = g->lines;
+  strcpy(g->tops[c].before, g->prev);
+  g->tops[c].end = !after;
+  if (after) {
+    gaps_copy(g->tops[c].after, after, afterlen);
+  }
+}
+
+/**
+ * Number of newlines. Eight bytes at a time, instead of a memchr() call
+ * per line: a byte of w is zero where there's a newline, and then gets
+ * its top bit set in z.
+ */
+static unsigned long
+gaps_count(const char *p, size_t len)
+{
+  const uint64_t lo7 = 0x7f7f7f7f7f7f7f7fULL;
+  unsigned long n = 0;
+
+  for (; len >= 8; p += 8, len -= 8) {
+    uint64_t w, z;
+    memcpy(&w, p, 8);
+    w ^= 0x0a0a0a0a0a0a0a0aULL;
+    z = ~(((w & lo7) + lo7) | w | lo7);
+    n += ((z >> 7) * 0x0101010101010101ULL) >> 56;
+  }
+  for (; len; p++, len--) {
+    n += (*p == '\n');
+  }
+  return n;
+}
+
+/**
+ * Take note of output read at now_ns
+ */
+void
+gaps_feed(struct gaps *g, const char *buf, size_t len, long long now_ns)
+{
+  const char *end = buf + len;
+  const char *nl;
+  const char *last;
+  const char *p;
+  unsigned long n;
+
+  if (!(nl = memchr(buf, '\n', len))) {
+    gaps_cur_add(g, buf, len);
+    return;
+  }
+
+  /* the first line done in this read ends the gap */
+  gaps_cur_add(g, buf, nl - buf);
+  gaps_add(g, now_ns - g->last_ns, g->cur, g->curlen);
+  g->lines++;
+  g->last_ns = now_ns;
+  if (!g->bursts) {
+    g->bursts = 1;
+  }
+
+  /* the rest of them only need counting */
+  last = nl;
+  n = gaps_count(nl + 1, end - nl - 1);
+  if (n) {
+    while (*--end != '\n') {
+    }
+    last = end;
+    end = buf + len;
+  }
+  g->lines += n;
+  g->hist[0] += n;
+
+  /* keep the last line done, and start on the next */
+  if (last == nl) {
+    gaps_copy(g->prev, g->cur, g->curlen);
+  } else {
+    for (p = last; p > buf && p[-1] != '\n'; p--) {
+    }
+    gaps_copy(g->prev, p, last - p);
+  }
+  g->curlen = 0;
+  gaps_cur_add(g, last + 1, end - last - 1);
+}
+
+/**
+ * The stream is closed. The time since the last line is a gap too.
+ */
+void
+gaps_end(struct gaps *g, long long now_ns)
+{
+  if (g && 0 > g->end_ns) {
+    g->end_ns = now_ns;
+    gaps_add(g, now_ns - g->last_ns, NULL, 0);
+  }
+}
+
+/**
+ * Format a time span
+ */
+static const char *
+gaps_fmt(char *buf, size_t size, long long ns)
+{
+  if (ns < 1000000000LL) {
+    snprintf(buf, size, "%.1fms", ns / 1e6);
+  } else {
+    snprintf(buf, size, "%.3fs", ns / 1e9);
+  }
+  return buf;
+}
+
+/**
+ * Write the report, if there was any output
+ *
+ * @param   fn:  file to append to, or NULL for stderr
+ */
+void
+gaps_report(const struct gaps *g, const char *fn)
+{
+  char b1[32], b2[32], b3[32];
+  unsigned long most = 0;
+  long long total;
+  FILE *f = stderr;
+  int c;
+
+  if (!g || !g->lines) {
+    return;
+  }
+  if (fn && !(f = fopen(fn, "a"))) {
+    fprintf(stderr, "ind: can't open %s for gaps: %s\n",
+            fn, strerror(errno));
+    f = stderr;
+  }
+
+  total = g->end_ns - g->start_ns;
+  fprintf(f, "ind: %s: %lu lines in %lu bursts, %s with output, "
+          "%s quiet (gaps of %s or more)\n",
+          g->name, g->lines, g->bursts,
+          gaps_fmt(b1, sizeof(b1), total - g->quiet_ns),
+          gaps_fmt(b2, sizeof(b2), g->quiet_ns),
+          gaps_fmt(b3, sizeof(b3), GAPS_QUIET_NS));
+
+  for (c = 0; c < GAPS_BUCKETS; c++) {
+    if (g->hist[c] > most) {
+      most = g->hist[c];
+    }
+  }
+  for (c = 0; c < GAPS_BUCKETS; c++) {
+    int bar = (g->hist[c] * 40 + most - 1) / most;
+    fprintf(f, "ind: %s: %9s %10lu%s%.*s\n", g->name, gaps_label[c],
+            g->hist[c], bar ? " " : "", bar,
+            "########################################");
+  }
+
+  for (c = 0; c < g->ntop; c++) {
+    const struct gap *t = &g->tops[c];
+    fprintf(f, "ind: %s: %s silent from +%s, after line %lu\n", g->name,
+            gaps_fmt(b1, sizeof(b1), t->ns),
+            gaps_fmt(b2, sizeof(b2), t->at_ns), t->line);
+    fprintf(f, "ind: %s:   before: %s\n", g->name,
+            t->line ? t->before : "(start)");
+    fprintf(f, "ind: %s:   after:  %s\n", g->name,
+            t->end ? "(end)" : t->after);
+  }
+
+  if (f != stderr) {
+    fclose(f);
+  } else {
+    fflush(f);
+  }
+}
@@ -0,0 +1,340 @@
+/* ind/group.c - fold continuation lines into records
+ *
+ * (BSD license without advertising clause below)
+ *
+ * Copyright (c) 2019 Thomas Habets <thomas@habets.se>. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+/*
+ * A record is a line plus the continuation lines after it, such as the
+ * frames of a stack trace. A line continues the record if it starts with
+ * whitespace or, if a start pattern is given, if it doesn't match it.
+ *
+ * Lines are held until the next line that starts a record, and the record
+ * is then written with one call, either as it is (a block) or as one JSON
+ * object per record:
+ *
+ *   {"lines":["Traceback (most recent call last):","  File \"x.py\"..."]}
+ *
+ * At most max bytes are held; a full record is written as it is. Nothing
+ * is held for longer than the timeout, counted from when the first byte
+ * of the record came in. The rest of a line written in pieces that way
+ * starts a record like any line, unless it's only the line end.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <regex.h>
+
+#include "group.h"
+
+struct group {
+  int format;
+  const regex_t *start;         /* or NULL for "no leading whitespace" */
+  size_t max;
+  long long timeout_ms;
+
+  /* the record is rec[0 .. reclen), and the line being read follows */
+  char *rec;
+  size_t reclen;
+  size_t linelen;
+  int split;                    /* start of the line has been written */
+  long long since;              /* when the first byte held came in */
+  long long linesince;          /* when the line's first byte came in */
+
+  /* JSON encoding of a record */
+  char *json;
+  size_t jsonsize;
+};
+
+/**
+ * @param   format:      GROUP_BLOCK or GROUP_JSON
+ * @param   start:       lines matching this start a record. NULL means
+ *                       lines that don't start with space or tab.
+ * @param   max:         bytes to hold at most
+ * @param   timeout_ms:  hold nothing longer than this. 0 means no limit.
+ */
+struct group *
+group_new(int format, const regex_t *start, size_t max, long long timeout_ms)
+{
+  struct group *g;
+
+  if (!(g = calloc(1, sizeof(struct group)))) {
+    return NULL;
+  }
+  if (!(g->rec = malloc(max))) {
+    free(g);
+    return NULL;
+  }
+  g->format = format;
+  g->start = start;
+  g->max = max;
+  g->timeout_ms = timeout_ms;
+  return g;
+}
+
+/**
+ *
+ */
+void
+group_free(struct group *g)
+{
+  if (g) {
+    free(g->rec);
+    free(g->json);
+    free(g);
+  }
+}
+
+/**
+ * Make room for n more bytes of JSON
+ *
+ * @return  0 on success, -1 if out of memory
+ */
+static int
+json_reserve(struct group *g, size_t used, size_t n)
+{
+  if (used + n > g->jsonsize) {
+    size_t newsize = g->jsonsize ? g->jsonsize : 4096;
+    char *p;
+    while (newsize < used + n) {
+      newsize *= 2;
+    }
+    if (!(p = realloc(g->json, newsize))) {
+      return -1;
+    }
+    g->json = p;
+    g->jsonsize = newsize;
+  }
+  return 0;
+}
+
+/**
+ * Write a record: the lines in buf, the last possibly unterminated
+ *
+ * @return  0 on success, nonzero if out() failed
+ */
+static int
+group_emit(struct group *g, const char *buf, size_t len,
+           group_out_t out, void *arg)
+{
+  const char *p = buf;
+  const char *end = buf + len;
+  size_t used = 0;
+  int first = 1;
+
+  if (!len) {
+    return 0;
+  }
+  if (g->format != GROUP_JSON) {
+    return out(buf, len, arg);
+  }
+
+  /* escaping makes at most 6 bytes of one */
+  if (json_reserve(g, 0, len * 6 + 64)) {
+    return -1;
+  }
+  used += sprintf(g->json, "{\"lines\":[");
+  while (p < end) {
+    const char *nl = memchr(p, '\n', end - p);
+    const char *eol = nl ? nl : end;
+
+    if (eol > p && eol[-1] == '\r') {
+      eol--;
+    }
+    if (!first) {
+      g->json[used++] = ',';
+    }
+    first = 0;
+    g->json[used++] = '"';
+    for (; p < eol; p++) {
+      unsigned char ch = *p;
+      if (ch == '"' || ch == '\\') {
+        g->json[used++] = '\\';
+        g->json[used++] = ch;
+      } else if (ch == '\t') {
+        g->json[used++] = '\\';
+        g->json[used++] = 't';
+      } else if (ch < 0x20) {
+        used += sprintf(g->json + used, "\\u%04x", ch);
+      } else {
+        g->json[used++] = ch;
+      }
+    }
+    g->json[used++] = '"';
+    p = nl ? nl + 1 : end;
+  }
+  used += sprintf(g->json + used, "]}\n");
+  return out(g->json, used, arg);
+}
+
+/**
+ * Does the complete line following the record continue it?
+ */
+static int
+group_continues(struct group *g)
+{
+  char *line = g->rec + g->reclen;
+  int ret;
+
+  if (!g->start) {
+    return line[0] == ' ' || line[0] == '\t';
+  }
+  /* match without the \n */
+  line[g->linelen - 1] = 0;
+  ret = regexec(g->start, line, 0, NULL, 0);
+  line[g->linelen - 1] = '\n';
+  return ret != 0;
+}
+
+/**
+ * Write the record held, and make the line after it the new one
+ */
+static int
+group_next(struct group *g, group_out_t out, void *arg)
+{
+  if (group_emit(g, g->rec, g->reclen, out, arg)) {
+    return -1;
+  }
+  memmove(g->rec, g->rec + g->reclen, g->linelen);
+  g->reclen = 0;
+  g->since = g->linesince;
+  return 0;
+}
+
+/**
+ * Feed data
+ *
+ * @return  0 on success, nonzero if out() failed
+ */
+int
+group_feed(struct group *g, const char *buf, size_t len, long long now,
+           group_out_t out, void *arg)
+{
+  while (len) {
+    const char *nl = memchr(buf, '\n', len);
+    size_t n = nl ? (size_t)(nl - buf) + 1 : len;
+    size_t room = g->max - g->reclen - g->linelen;
+
+    if (n > room) {
+      n = room;
+      nl = NULL;
+    }
+    if (!g->linelen) {
+      g->linesince = now;
+      if (!g->reclen) {
+        g->since = now;
+      }
+    }
+    memcpy(g->rec + g->reclen + g->linelen, buf, n);
+    g->linelen += n;
+    buf += n;
+    len -= n;
+
+    if (nl) {
+      /* a complete line */
+      if (g->split && g->linelen <= 2
+          && (g->linelen == 1 || g->rec[g->reclen] == '\r')) {
+        /* only the end of a line written in pieces. In JSON the pieces
+         * are records of their own already. */
+        g->split = 0;
+        if (g->format != GROUP_JSON
+            && out(g->rec + g->reclen, g->linelen, arg)) {
+          return -1;
+        }
+        g->linelen = 0;
+        continue;
+      }
+      g->split = 0;
+      if (g->reclen && group_continues(g)) {
+        g->reclen += g->linelen;
+        g->linelen = 0;
+      } else {
+        if (group_next(g, out, arg)) {
+          return -1;
+        }
+        g->reclen = g->linelen;
+        g->linelen = 0;
+      }
+    } else if (g->reclen + g->linelen == g->max) {
+      /* full. If the line alone fills it, it's written in pieces */
+      if (!g->reclen) {
+        g->reclen = g->linelen;
+        g->linelen = 0;
+        g->split = 1;
+      }
+      if (group_next(g, out, arg)) {
+        return -1;
+      }
+    }
+  }
+  return 0;
+}
+
+/**
+ * When the record held must be written, or -1 if not needed
+ */
+long long
+group_deadline(const struct group *g)
+{
+  if (g->timeout_ms > 0 && (g->reclen || g->linelen)) {
+    return g->since + g->timeout_ms;
+  }
+  return -1;
+}
+
+/**
+ * Write the record held, if it's been held long enough
+ *
+ * @return  0 on success, nonzero if out() failed
+ */
+int
+group_tick(struct group *g, long long now, group_out_t out, void *arg)
+{
+  long long t = group_deadline(g);
+
+  if (0 <= t && now >= t) {
+    return group_flush(g, out, arg);
+  }
+  return 0;
+}
+
+/**
+ * Write everything held, including a line not yet terminated
+ *
+ * @return  0 on success, nonzero if out() failed
+ */
+int
+group_flush(struct group *g, group_out_t out, void *arg)
+{
+  size_t len = g->reclen + g->linelen;
+
+  g->split = g->linelen != 0;
+  g->reclen = g->linelen = 0;
+  return group_emit(g, g->rec, len, out, arg);
+}
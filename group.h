@@ -0,0 +1,52 @@
+/* ind/group.h - fold continuation lines into records
+ *
+ * (BSD license without advertising clause below)
+ *
+ * Copyright (c) 2019 Thomas Habets <thomas@habets.se>. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef __INCLUDE_GROUP_H__
+#define __INCLUDE_GROUP_H__
+
+#include <stddef.h>
+#include <regex.h>
+
+#define GROUP_BLOCK 1
+#define GROUP_JSON  2
+
+struct group;
+
+/* where output goes. Returns nonzero on error, which is passed on. */
+typedef int (*group_out_t)(const char *buf, size_t len, void *arg);
+
+struct group *group_new(int format, const regex_t *start, size_t max,
+                        long long timeout_ms);
+void group_free(struct group *g);
+int group_feed(struct group *g, const char *buf, size_t len, long long now,
+               group_out_t out, void *arg);
+long long group_deadline(const struct group *g);
+int group_tick(struct group *g, long long now, group_out_t out, void *arg);
+int group_flush(struct group *g, group_out_t out, void *arg);
+
+#endif
@@ -50,7 +50,14 @@
 #include <sys/ioctl.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <fcntl.h>
 #include <signal.h>
+#include <getopt.h>
+#include <regex.h>
 
 #ifdef HAVE_UTIL_H
 #include <util.h>
@@ -68,7 +75,38 @@
 #include <alloca.h>
 #endif
 
+#ifdef HAVE_SPAWN_H
+#include <spawn.h>
+#endif
+
+#ifdef HAVE_ELF_H
+#include <elf.h>
+#endif
+
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#endif
+
+#if defined(HAVE_POSIX_SPAWNP) && defined(POSIX_SPAWN_SETSID)
+#define USE_POSIX_SPAWN 1
+#endif
+
 #include "pty_solaris.h"
+#include "record.h"
+#include "logsink.h"
+#include "flight.h"
+#include "profile.h"
+#include "dedup.h"
+#include "crcompact.h"
+#include "nest.h"
+#include "sink.h"
+#include "group.h"
+#include "trace.h"
+#include "fair.h"
+#include "spool.h"
+#include "index.h"
+#include "gaps.h"
+#include "libind.h"
 
 /* Needed for IRIX */
 #ifndef STDIN_FILENO
@@ -81,13 +119,50 @@
 #define STDERR_FILENO   2
 #endif
 
-/* arbitrary maxlength for prefixes and postfixes. Should be enough */
-static const size_t max_indstr_length = 1048576;
-
 static const char *argv0;
 static const char *version = PACKAGE_VERSION;
 static int verbose = 0;
+extern char **environ;
 static int sig_winch_counter = 0;
+static volatile sig_atomic_t sig_usr1_counter = 0;
+
+/* non-blocking stdout and stderr, the same one if they go to one place */
+static struct sink *sinks[STDERR_FILENO + 1];
+
+/* --index: index of the file stdout (and maybe stderr) goes to */
+static struct index *indexes[STDERR_FILENO + 1];
+
+/* --fd: more fds of the child, captured like its stdout */
+struct extra_fd {
+  int num;                /* fd number in the child */
+  char name[16];          /* "fd3", for %{stream} and --profile */
+  const char *prefix;
+  const char *postfix;
+  const char *to;         /* "stdout", "stderr" or a file */
+  int dest;               /* fd written to */
+  int fd;                 /* our end, -1 once closed */
+  int child_fd;           /* the child's end, -1 once it's started */
+  struct ind_vars vars;
+  struct outstream *o;
+  struct fair_lat lat;
+};
+static struct extra_fd *extras = NULL;
+static int nextras = 0;
+
+/* --gaps: how many of the longest silences to show, or 0 */
+static int gaps_top = 0;
+static long long gaps_start;
+
+/* output stage settings, also used for streams handed over later */
+static int dedup = 0;
+static int dedup_time = 0;
+static long long dedup_window_ms = 10000;
+static long long cr_compact_ms = -1;
+static int group_format = 0;
+static regex_t group_start;
+static int group_start_set = 0;
+static size_t group_max = 65536;
+static long long group_timeout_ms = 100;
 
 /**
  * EINTR-safe close()
@@ -243,6 +318,44 @@ print_ttyname(const char *fdname, int fdm, int fds)
   }
 }
 
+/**
+ * In the child: put the --fd pipes on the fd numbers asked for. All are
+ * first moved above the highest of those numbers, so that none is
+ * overwritten before it's been put in place.
+ */
+static void
+extras_child(void)
+{
+  int top = 0;
+  int c;
+
+  for (c = 0; c < nextras; c++) {
+    if (extras[c].num >= top) {
+      top = extras[c].num + 1;
+    }
+  }
+  for (c = 0; c < nextras; c++) {
+    if (0 > extras[c].child_fd) {
+      continue;
+    }
+    if (0 > (extras[c].child_fd = fcntl(extras[c].child_fd, F_DUPFD, top))) {
+      fprintf(stderr, "%s: fcntl(F_DUPFD): %s\n", argv0, strerror(errno));
+      exit(1);
+    }
+  }
+  for (c = 0; c < nextras; c++) {
+    if (0 > extras[c].child_fd) {
+      continue;
+    }
+    if (-1 == dup2(extras[c].child_fd, extras[c].num)) {
+      fprintf(stderr, "%s: dup2(%d, %d): %s\n", argv0,
+              extras[c].child_fd, extras[c].num, strerror(errno));
+      exit(1);
+    }
+    close(extras[c].child_fd);
+  }
+}
+
 /**
  * Set up stdout/stderr and exec subprocess
  *
@@ -298,11 +411,201 @@ child(int fdi, int fdo, int fde, char **argv)
   }
 
   do_close3(fdi, fdo, fde);
+  extras_child();
   execvp(argv[0], argv);
   fprintf(stderr, "%s: %s: %s\n", argv0, argv[0], strerror(errno));
   exit(1);
 }
 
+/**
+ * Are both fds the same file, pipe or terminal?
+ */
+static int
+same_file(int fd1, int fd2)
+{
+  struct stat st1, st2;
+  return !fstat(fd1, &st1) && !fstat(fd2, &st2)
+    && st1.st_dev == st2.st_dev && st1.st_ino == st2.st_ino;
+}
+
+/**
+ * Are both fds the same terminal? Cheaper than comparing ttyname()s.
+ */
+static int
+same_tty(int fd1, int fd2)
+{
+  struct stat st1, st2;
+  if (fstat(fd1, &st1) || fstat(fd2, &st2)) {
+    return 0;
+  }
+  return st1.st_rdev == st2.st_rdev;
+}
+
+#ifdef USE_POSIX_SPAWN
+/**
+ * posix_spawn() version of fork()+child(). The login_tty() is expressed
+ * as POSIX_SPAWN_SETSID plus opening the terminal, which makes it the
+ * controlling terminal.
+ *
+ * @return  child pid, or -1 if this path can't be used (errno set), in which
+ *          case the caller should fall back to fork()
+ */
+static pid_t
+spawn_child_fast(int fdi, int fdo, int fde,
+                 int ind_in, int ind_out, int ind_err,
+                 char **argv)
+{
+  posix_spawn_file_actions_t fa;
+  posix_spawnattr_t attr;
+  const char *tty = NULL;
+  int fdt;
+  int fds[6];
+  int c;
+  int err;
+  pid_t pid;
+
+  fds[0] = fdi; fds[1] = fdo; fds[2] = fde;
+  fds[3] = ind_in; fds[4] = ind_out; fds[5] = ind_err;
+  for (c = 0; c < 6; c++) {
+    if (fds[c] >= 0 && fds[c] <= STDERR_FILENO) {
+      /* dup2() ordering gets hairy, let child() sort it out */
+      errno = EINVAL;
+      return -1;
+    }
+  }
+  for (c = 0; c < nextras; c++) {
+    if (extras[c].child_fd >= 0) {
+      /* same for --fd */
+      errno = EINVAL;
+      return -1;
+    }
+  }
+
+  /* same choice of terminal as child() */
+  fdt = fdo;
+  if (!isatty(fdt) && isatty(fdi)) {
+    fdt = fdi;
+  }
+  if (!isatty(fdt) && isatty(fde)) {
+    fdt = fde;
+  }
+  if (isatty(fdt) && !(tty = ttyname(fdt))) {
+    return -1;
+  }
+
+  for (c = 0; c < 6; c++) {
+    if (fds[c] >= 0) {
+      fcntl(fds[c], F_SETFD, FD_CLOEXEC);
+    }
+  }
+
+  posix_spawn_file_actions_init(&fa);
+  posix_spawnattr_init(&attr);
+  if (tty) {
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSID);
+    posix_spawn_file_actions_addopen(&fa, fdt, tty, O_RDWR, 0);
+  }
+  posix_spawn_file_actions_adddup2(&fa, fdi, STDIN_FILENO);
+  posix_spawn_file_actions_adddup2(&fa, fdo, STDOUT_FILENO);
+  posix_spawn_file_actions_adddup2(&fa, fde, STDERR_FILENO);
+  if (tty) {
+    /* the terminal opened above is only needed as 0-2 */
+    posix_spawn_file_actions_addclose(&fa, fdt);
+  }
+
+  err = posix_spawnp(&pid, argv[0], &fa, &attr, argv, environ);
+  posix_spawn_file_actions_destroy(&fa);
+  posix_spawnattr_destroy(&attr);
+  if (err) {
+    fprintf(stderr, "%s: %s: %s\n", argv0, argv[0], strerror(err));
+    exit(1);
+  }
+  return pid;
+}
+#endif
+
+/**
+ * Make stdout and stderr non-blocking, each with its own queue. If they
+ * are the same file they share one, to keep the order of what's written.
+ */
+static void
+sinks_open(void)
+{
+  if (!(sinks[STDOUT_FILENO] = sink_new(STDOUT_FILENO))) {
+    fprintf(stderr, "%s: Out of memory setting up output\n", argv0);
+    exit(1);
+  }
+  if (same_file(STDOUT_FILENO, STDERR_FILENO)) {
+    sinks[STDERR_FILENO] = sinks[STDOUT_FILENO];
+  } else if (!(sinks[STDERR_FILENO] = sink_new(STDERR_FILENO))) {
+    fprintf(stderr, "%s: Out of memory setting up output\n", argv0);
+    exit(1);
+  }
+}
+
+/**
+ * Write out what's queued, blocking, and report stalls
+ */
+static void
+sinks_close(void)
+{
+  static const char *names[] = { NULL, "stdout", "stderr" };
+  int shared = sinks[STDOUT_FILENO] == sinks[STDERR_FILENO];
+  int fd;
+
+  for (fd = STDOUT_FILENO; fd <= STDERR_FILENO; fd++) {
+    struct sink *k = sinks[fd];
+    unsigned long count;
+    double total, max;
+
+    if (!k || (fd == STDERR_FILENO && shared)) {
+      continue;
+    }
+    sink_finish(k);
+    sink_stalls(k, &count, &total, &max);
+    profile_stall(shared ? "stdout+stderr" : names[fd], count, total, max);
+    if (verbose) {
+      fprintf(stderr, "%s: %s stalled %lu times, %.3fs (max %.3fs)\n",
+              argv0, shared ? "stdout+stderr" : names[fd],
+              count, total, max);
+    }
+  }
+}
+
+/**
+ * Start the child with the given fds as stdin/stdout/stderr
+ *
+ * @return  child pid. Exits on error.
+ */
+static pid_t
+spawn_child(int fdi, int fdo, int fde,
+            int ind_in, int ind_out, int ind_err,
+            char **argv)
+{
+  pid_t pid;
+
+#ifdef USE_POSIX_SPAWN
+  if (0 < (pid = spawn_child_fast(fdi, fdo, fde,
+                                  ind_in, ind_out, ind_err, argv))) {
+    return pid;
+  }
+  if (verbose) {
+    fprintf(stderr, "%s: posix_spawn() path not usable, using fork()\n",
+            argv0);
+  }
+#endif
+
+  switch ((pid = fork())) {
+  case 0:
+    do_close3(ind_in, ind_out, ind_err);
+    child(fdi, fdo, fde, argv);
+  case -1:
+    fprintf(stderr, "%s: fork() failed: %s\n", argv0, strerror(errno));
+    exit(1);
+  }
+  return pid;
+}
+
 /**
  * 
  *
@@ -338,21 +641,124 @@ usage(int err)
   printf("ind %s, by Thomas Habets <thomas@habets.se>\n"
 	 "usage: %s [ -h ] [ -p <fmt> ] [ -a <fmt> ] [ -P <fmt> ] "
 	 "[ -A <fmt> ]  \n"
-	 "          <command> <args> ...\n"
+	 "          [ -r <file> ] [ -t ] <command> <args> ...\n"
+	 "       %s [ options ] --replay <file> [ --speed <n> ]\n"
+	 "       %s [ options ] --follow <file> ...\n"
 	 "\t-a          Postfix stdout (default: \"\")\n"
 	 "\t-A          Postfix stderr (default: \"\")\n"
+	 "\t--batch <file>\n"
+	 "\t            Run the shell commands in file (- for stdin), one per\n"
+	 "\t            line, one after another, or --parallel at a time\n"
 	 "\t--copying   Show 3-clause BSD license\n"
 	 "\t-h, --help  Show this help text\n"
+	 "\t--cr-compact <ms>\n"
+	 "\t            Show progress bar redraws (\\r) at most every <ms>,\n"
+	 "\t            or if 0 only the final state when not on a terminal\n"
+	 "\t--decode-trace <file>\n"
+	 "\t            Show event trace written by --trace\n"
+	 "\t--dedup     Collapse repeated lines\n"
+	 "\t--dedup-time\n"
+	 "\t            Ignore leading time stamps when comparing lines\n"
+	 "\t--dedup-window <seconds>\n"
+	 "\t            Show repeat count at least this often (default: 10)\n"
+	 "\t--fd <n>[:<fmt>]\n"
+	 "\t            Also decorate what the command writes to fd n (3 and\n"
+	 "\t            up), with this prefix (default: \"%%{stream}: \")\n"
+	 "\t--fd-postfix <n>:<fmt>\n"
+	 "\t            Postfix for fd n (default: \"\")\n"
+	 "\t--fd-to <n>:<stdout|stderr|file>\n"
+	 "\t            Where output of fd n goes (default: stdout)\n"
+	 "\t--flight <size>\n"
+	 "\t            Keep the last <size> bytes (e.g. 4M) of each stream, and\n"
+	 "\t            show them if the command fails or on SIGUSR1\n"
+	 "\t--flight-dump <file>\n"
+	 "\t            Append flight recorder dumps to file instead of stderr\n"
+	 "\t--flight-file <file>\n"
+	 "\t            Keep flight recorder in this file (default: temporary)\n"
+	 "\t--flight-read <file>\n"
+	 "\t            Show flight recorder file left by a killed ind\n"
+	 "\t--follow    Decorate what is written to the files given instead of\n"
+	 "\t            running a command, following rotation (default -p:\n"
+	 "\t            \"%%{file}: \")\n"
+	 "\t--gaps <n> Show where output went quiet when the command is done:\n"
+	 "\t            gap histogram and the n longest silences\n"
+	 "\t--gaps-file <file>\n"
+	 "\t            Append --gaps report to file instead of stderr\n"
+	 "\t--group <block|json>\n"
+	 "\t            Keep continuation lines (e.g. stack traces) together\n"
+	 "\t            with the line before, and write them out at once\n"
+	 "\t--group-max <size>\n"
+	 "\t            Hold at most this much of a record (default: 64k)\n"
+	 "\t--group-start <regex>\n"
+	 "\t            Lines matching start a record (default: lines not\n"
+	 "\t            starting with whitespace)\n"
+	 "\t--group-timeout <ms>\n"
+	 "\t            Hold a record at most this long, 0 for no limit\n"
+	 "\t            (default: 100)\n"
+	 "\t--index     Keep an index of where lines start, by number and time,\n"
+	 "\t            in <stdout's file>.idx, for --seek\n"
+	 "\t--index-every <lines>,<size>\n"
+	 "\t            Index a line at least this often (default: 1000,64k)\n"
+	 "\t--index-file <file>\n"
+	 "\t            Name of the index, for --index and --seek\n"
+	 "\t--inprocess Decorate inside the child using LD_PRELOAD, if it is\n"
+	 "\t            dynamically linked\n"
+	 "\t--log <journal|syslog>\n"
+	 "\t            Also send output lines to journald or syslog\n"
+	 "\t--log-priority <stdout>,<stderr>\n"
+	 "\t            Log priorities (default: info,err)\n"
+	 "\t--log-socket <path>\n"
+	 "\t            Log to this datagram socket instead of the default\n"
+	 "\t--null      Commands in the --batch file are separated by NUL\n"
+	 "\t--nest      Let inds run by the command hand their output over to\n"
+	 "\t            this one, which decorates it in one go. It's then not\n"
+	 "\t            kept in order with the command's own output\n"
+	 "\t--no-nest   Don't hand output over to an outer ind run with --nest\n"
+	 "\t--onlcr <on|off|auto>\n"
+	 "\t            Whether the child's pty turns NL into CRNL. auto is\n"
+	 "\t            off if the terminal does it anyway (default: auto)\n"
+	 "\t--parallel <n>\n"
+	 "\t            Run each argument as a shell command, n at a time, and\n"
+	 "\t            write the output of each in one piece when it's done\n"
+	 "\t--parallel-mem <size>\n"
+	 "\t            Memory for each command's output before it goes to a\n"
+	 "\t            temporary file (default: 1M)\n"
+	 "\t--parallel-order <done|input>\n"
+	 "\t            Output as commands finish, or in the order given\n"
+	 "\t            (default: done, for --batch: input)\n"
 	 "\t-p          Prefix stdout (default: \"  \")\n"
 	 "\t-P          Prefix stderr (default: \">>\") \n"
+	 "\t--profile <text|json>\n"
+	 "\t            Report resource usage of the command when it exits\n"
+	 "\t--profile-file <file>\n"
+	 "\t            Append profile report to file instead of stderr\n"
+	 "\t--profile-sample <ms>\n"
+	 "\t            Sample peak threads and fds from /proc this often\n"
+	 "\t-r, --record <file>\n"
+	 "\t            Append raw child output with timing to trace file\n"
+	 "\t            (default: $IND_RECORD)\n"
+	 "\t--replay <file>\n"
+	 "\t            Replay trace file instead of running a command\n"
+	 "\t--seek <line|time> <file>\n"
+	 "\t            Show file from a line number or time, using its index\n"
+	 "\t--speed <n> Replay speed factor, 0 means as fast as possible\n"
+	 "\t            (default: 1)\n"
+	 "\t-t, --pty   Give the child a pty even if stdout is not a terminal\n"
+	 "\t--trace <file>\n"
+	 "\t            Keep a binary trace of recent internal events in file\n"
+	 "\t--trace-size <size>\n"
+	 "\t            Size of event trace (default: 1M)\n"
 	 "\t-v          Verbose (repeat -v to increase verbosity)\n"
 	 "\t--version   Show version\n"
-	 "Format is strftime()-formatted text. Examples:\n"
+	 "\t--winsize <rows>x<cols>\n"
+	 "\t            Window size of the pty created by -t (default: 24x80)\n"
+	 "Format is strftime()-formatted text, plus %%{seq} (line number),\n"
+	 "%%{stream}, %%{pid}, %%{host}, %%{cmd} and %%{file}. Examples:\n"
          "\t%s -p 'Hello world | '  echo foo\n"
          "\t => Hello world | foo\n"
          "\t%s -p '%%F %%T %%Z | '  echo foo\n"
          "\t => 2011-08-01 16:08:36 BST | foo\n"
-	 , version, argv0, argv0, argv0);
+	 , version, argv0, argv0, argv0, argv0, argv0);
   exit(err);
 }
 
@@ -422,32 +828,6 @@ printLicense()
   exit(0);
 }
 
-/**
- * just like strpbrk(), but haystack is not null-terminated
- *
- * @param  p:       string to search in
- * @param  chars:   characters to look for
- * @param  len:     length of string to search in
- *
- * @return   Pointer to first occurance of any of the characters, or NULL
- *           if not found.
- */
-static char *
-mempbrk(const char *p, const char *chars, size_t len)
-{
-  int c;
-  char *ret = NULL;
-  char *tmp;
-
-  for(c = strlen(chars); c; c--) {
-    tmp = memchr(p, chars[c-1], len);
-    if (tmp && (!ret || tmp < ret)) {
-      ret = tmp;
-    }
-  }
-  return ret;
-}
-
 /**
  * In-place remove of all trailing newlines (be they CR or LF)
  *
@@ -467,274 +847,2179 @@ chomp(char *str)
 }
 
 /**
- * return malloc()ed and created string, caller calls free()
- * exit(1)s on failure (malloc() failed)
+ * Like safe_write(), but for an iovec list. The list is modified.
  *
- * @param   fmt:     format string, as specified in the manpage (%c is ctime
- *                   for example)
- * @param   bail:    Bail if format string is broken
- * @param   output:  place to store the output string pointer at
+ * @return  0 on success, -1 on error (errno set)
  */
-static void
-format(const char *infmt, char **output, int bail)
+static int
+safe_writev(int fd, struct iovec *iov, int iovcnt)
 {
-  if (!*infmt) {
-    *output = malloc(1);
-    assert(*output);
-    **output = 0;
-    return;
-  }
-
-  /* We need to inject a space as the first character in order to differentiate
-   * %p expanding to an empty string and an error, since strftime() sucks at
-   * error handling */
-  char fmt[strlen(infmt) + 2];
-  fmt[0] = ' ';
-  strcpy(&fmt[1], infmt);
-
-  char *buf = 0;
-  size_t bufn = 2;
-  for (;;) {
-    time_t t;
-    char *newbuf;
-    size_t n;
+  ssize_t ret;
 
-    if (!(newbuf = realloc(buf, bufn))) {
-      fprintf(stderr, "ind: Memory alloc of %zd bytes failed!\n", bufn);
-      exit(1);
+  while (iovcnt > 0) {
+    size_t want = 0;
+    int c;
+    for (c = 0; c < iovcnt; c++) {
+      want += iov[c].iov_len;
     }
-    buf = newbuf;
-
-    struct tm tm;
-    time(&t);
-    memcpy(&tm, localtime(&t), sizeof(tm));
-    if ((n = strftime(buf, bufn, fmt, &tm))) {
-      break;
+    do {
+      ret = writev(fd, iov, iovcnt);
+      TRACE(write, fd, want, ret);
+    } while ((-1 == ret) && (errno == EINTR));
+    if (ret < 0) {
+      return -1;
     }
-
-    bufn *= 2;
-    if (bufn > max_indstr_length) {
-      /* Format expanded to too long a string, or is incorrectly formatted.
-       * in either case it's a user error or madness. */
-      if (bail) {
-        fprintf(stderr, "ind: Format string '%s' is broken.\n", fmt);
-        exit(1);
-      }
-
-      free(buf);
-      buf = strdup("ind fmt error");
-      if (!buf) {
-        fprintf(stderr, "ind: Memory alloc of a <20 bytes failed!\n");
-        exit(1);
-      }
-      break;
+    if ((size_t)ret < want) {
+      TRACE(partial, fd, want, ret);
+    }
+    if (!ret) {
+      errno = EIO;
+      return -1;
+    }
+    while (iovcnt > 0 && (size_t)ret >= iov->iov_len) {
+      ret -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = (char*)iov->iov_base + ret;
+      iov->iov_len -= ret;
     }
   }
-  memmove(buf, buf + 1, strlen(buf) + 1);
-  *output = buf;
+  return 0;
 }
 
 /**
- * Main functionality function.
- * Read from fdin, if crossing a newline add magic.
- *
- * emptyline must point to 1 on first call, since the line is empty
- * before anything is written to it (makes sense).
+ * Write data to fdout, adding prefix and postfix when crossing newlines.
  *
- * @param   fdin       source fd
  * @param   fdout      destination fd
- * @param   pre        prefix string
- * @param   prelen     prefix length (sent for efficiency)
- * @param   post       postfix string
- * @param   postlen    postfix length (sent for efficiency)
- * @param   emptyline  last this function was called, was it an empty line?
+ * @param   s          decoration state of the stream
+ * @param   buf        data read from the child
+ * @param   n          length of data
  *
- * @return        0 on success, !0 on "no more data will be readable ever"
+ * @return        0 on success, !0 if fdout could not be written to
  */
 static int
-process(int fdin,int fdout,
-	const char *prefix,
-	const char *postfix, int *emptyline)
+decorate(int fdout, struct ind_stream *s, const char *buf, size_t n)
 {
-  int n;
-  char buf[128];
-
-  char *pre = 0;
-  char *post = 0;
-
-  n = read(fdin, buf, sizeof(buf)-1);
-  if (verbose > 1) {
-    fprintf(stderr, "%s: read(%d): %d (errno=%s)\n", argv0, fdin, n,
-	    strerror(errno));
-  }
-  if (!n) {
-    goto errout;
-  }
-
-  if (0 > n) {
-    switch(errno) {
-      /* non-fatal errors */
-    case EAGAIN:
-    case EINTR:
-      goto okout;
-      
-      /* these mean internal error */
-    case EFAULT:
-    case EINVAL:
-    case EBADF:
-    case EISDIR:
-      fprintf(stderr, "%s: Internal error: read() got errno %d (%s)\n",
-	      argv0, errno, strerror(errno));
-      exit(1);
-
-      /* these errors mean we may as well close the whole fd */
-    case EIO:
-    default:
-	goto errout;
-    }
-  } else {
-    char *p = buf;
-    char *q;
-
-    format(prefix, &pre, 0);
-    format(postfix, &post, 0);
+  struct iovec *iov;
+  int iovcnt;
+  size_t used;
+  size_t bytes;
+  int c;
 
-    while ((q = mempbrk(p,"\r\n",n))) {
-      if (*emptyline) {
-	if (0 > safe_write(fdout,pre,strlen(pre))) {
-	  goto errout;
-	}
-	*emptyline = 0;
-      }
-      if (0 > safe_write(fdout,p,q-p)) {
-	goto errout;
-      }
-      if (0 > safe_write(fdout,post,strlen(post))) {
-	goto errout;
-      }
-      if (0 > safe_write(fdout,q,1)) {
-	goto errout;
-      }
-      *emptyline = 1;
-      n-=(q-p+1);
-      p=q+1;
+  while (n) {
+    used = ind_stream_feed(s, buf, n, &iov, &iovcnt);
+    TRACE(scan, fdout, n, used);
+    for (c = 0, bytes = 0; c < iovcnt; c++) {
+      bytes += iov[c].iov_len;
     }
-    if (n) {
-      if (*emptyline) {
-	if (0 > safe_write(fdout,pre,strlen(pre))) {
-	goto errout;
-	}
-	*emptyline = 0;
+    TRACE(format, fdout, iovcnt, bytes);
+    flight_iov(fdout == STDERR_FILENO, iov, iovcnt);
+    if (fdout <= STDERR_FILENO && sinks[fdout]) {
+      if (indexes[fdout] && index_note(indexes[fdout], iov, iovcnt,
+                                       sink_queued(sinks[fdout]))) {
+        fprintf(stderr, "%s: index: %s, no longer indexing\n",
+                argv0, strerror(errno));
+        index_close(indexes[fdout]);
+        indexes[STDOUT_FILENO] = indexes[STDERR_FILENO] = NULL;
       }
-      if (0 > safe_write(fdout,p,n)) {
-	goto errout;
+      if (sink_writev(sinks[fdout], iov, iovcnt)) {
+        return 1;
       }
+    } else if (0 > safe_writev(fdout, iov, iovcnt)) {
+      return 1;
     }
+    buf += used;
+    n -= used;
   }
-
- okout:
-  free(pre);
-  free(post);
   return 0;
-
- errout:
-  free(pre);
-  free(post);
-  return 1;
 }
 
 /**
- * adjust width according to length of prefix
+ * Monotonic time in milliseconds
  */
-static void
-fixup_wsp(struct winsize *wsp, const char *prefix, const char *postfix)
+static long long
+mono_ms(void)
 {
-  int sub = 0;
-  char *tmp;
-  
-  format(prefix, &tmp, 0);
-  sub += strlen(tmp);
-  free(tmp);
-  
-  format(postfix, &tmp, 0);
-  sub += strlen(tmp);
-  free(tmp);
-  
-  if (sub >= wsp->ws_col) {
-    wsp = 0;
-  } else {
-    wsp->ws_col -= sub;
-  }
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
 
+/* where one stream of output goes, and the stages on the way there */
+struct outstream {
+  int fd;
+  struct ind_stream *s;
+  struct crcompact *cc;
+  struct dedup *dd;
+  struct group *gr;
+  struct spool *sp;     /* hold output here instead of writing it */
+  struct gaps *gp;      /* --gaps */
+};
+
 /**
+ * Set up output to fd, with the stages asked for on the command line
  *
+ * @return  0 on success, -1 if out of memory
  */
-static void
-setup_pty(const char *prefix, const char *postfix,
-	  int realttyfd, 
-	  int *s01m, int *s01s)
+static int
+outstream_init(struct outstream *o, int fd, struct ind_stream *s)
 {
-  /* set up winsize */
-  struct winsize *wsp;
-  struct termios *tiop;
-  
-  wsp = alloca(sizeof(struct winsize));
-  if (0 > ioctl(realttyfd, TIOCGWINSZ, wsp)) {
-    /* if parent terminal (if even a terminal at all) won't give up info
-     * on terminal, neither will we.
-     */
-    wsp = 0;
-  }
-    
-  if (wsp) {
-    fixup_wsp(wsp, prefix, postfix);
+  memset(o, 0, sizeof(*o));
+  o->fd = fd;
+  o->s = s;
+  if (0 <= cr_compact_ms) {
+    /* terminals still get live updates, just not as many */
+    long long ms = cr_compact_ms;
+    if (!ms && isatty(fd)) {
+      ms = 100;
+    }
+    if (!(o->cc = crcompact_new(ms))) {
+      return -1;
+    }
   }
-
-  /* set up termios */
-  tiop = alloca(sizeof(struct termios));
-  if (0 > tcgetattr(realttyfd, tiop)) {
-    /* if parent terminal (if even a terminal at all) won't give up info
-     * on terminal, neither will we.
-     */
-    tiop = 0;
+  if (dedup && !(o->dd = dedup_new(dedup_window_ms, dedup_time))) {
+    return -1;
   }
-    
-  if (-1 == openpty(s01m, s01s, NULL, tiop, wsp)) {
-    fprintf(stderr, "%s: openpty() failed: %s\n", argv0, strerror(errno));
-    exit(1);
+  if (group_format
+      && !(o->gr = group_new(group_format,
+                             group_start_set ? &group_start : NULL,
+                             group_max, group_timeout_ms))) {
+    return -1;
   }
+  return 0;
 }
 
 /**
- *
+ * Free the stages and the decoration state
  */
 static void
-sig_window_resize(int unused)
+outstream_free(struct outstream *o)
 {
-  unused = unused; /* hide warning */
-  sig_winch_counter++;
+  crcompact_free(o->cc);
+  dedup_free(o->dd);
+  group_free(o->gr);
+  gaps_free(o->gp);
+  ind_stream_free(o->s);
+  memset(o, 0, sizeof(*o));
 }
 
 /**
- *
+ * True if the destination has so much queued that the source should not
+ * be read for now
  */
-static void
-update_window_size(int dst, int src, const char *prefix, const char *postfix)
+static int
+output_blocked(const struct outstream *o)
 {
-  struct winsize *wsp;
-  wsp = alloca(sizeof(struct winsize));
-  if (0 > ioctl(src, TIOCGWINSZ, wsp)) {
-    /* maybe it's not a terminal. Either way, don't go there */
-    return;
+  return o->fd <= STDERR_FILENO && sinks[o->fd] && sink_full(sinks[o->fd]);
+}
+
+/**
+ * Last stage: decorate and write
+ */
+static int
+output_decorate(const char *buf, size_t len, void *arg)
+{
+  struct outstream *o = arg;
+
+  if (o->sp) {
+    while (len) {
+      struct iovec *iov;
+      int iovcnt;
+      size_t used = ind_stream_feed(o->s, buf, len, &iov, &iovcnt);
+      if (spool_writev(o->sp, iov, iovcnt)) {
+        fprintf(stderr, "%s: can't hold output: %s\n",
+                argv0, strerror(errno));
+        return 1;
+      }
+      buf += used;
+      len -= used;
+    }
+    return 0;
+  }
+  return decorate(o->fd, o->s, buf, len);
+}
+
+/**
+ * Stage: fold continuation lines into records, if asked to
+ */
+static int
+output_group(const char *buf, size_t len, void *arg)
+{
+  struct outstream *o = arg;
+  if (o->gr) {
+    return group_feed(o->gr, buf, len, mono_ms(), output_decorate, o);
+  }
+  return output_decorate(buf, len, arg);
+}
+
+/**
+ * Stage: collapse repeated lines, if asked to
+ */
+static int
+output_dedup(const char *buf, size_t len, void *arg)
+{
+  struct outstream *o = arg;
+  if (o->dd) {
+    return dedup_feed(o->dd, buf, len, mono_ms(), output_group, o);
+  }
+  return output_group(buf, len, arg);
+}
+
+/**
+ * First stage: compact progress bars, if asked to
+ */
+static int
+output_feed(struct outstream *o, const char *buf, size_t len)
+{
+  if (o->cc) {
+    return crcompact_feed(o->cc, buf, len, mono_ms(), output_dedup, o);
+  }
+  return output_dedup(buf, len, o);
+}
+
+/**
+ * Stream has ended. Show what the stages have held back.
+ */
+static void
+output_finish(struct outstream *o)
+{
+  if (o->cc) {
+    crcompact_flush(o->cc, output_dedup, o);
+  }
+  if (o->dd) {
+    dedup_flush(o->dd, output_group, o);
+  }
+  if (o->gr) {
+    group_flush(o->gr, output_decorate, o);
+  }
+}
+
+/**
+ * Do timed work of the stages
+ *
+ * @return  when to be called next (mono_ms() time), or -1 if not needed
+ */
+static long long
+output_tick(struct outstream *o, long long now)
+{
+  long long ret = -1;
+  long long t;
+
+  if (o->cc) {
+    t = crcompact_deadline(o->cc);
+    if (0 <= t && t <= now) {
+      crcompact_tick(o->cc, now, output_dedup, o);
+      t = crcompact_deadline(o->cc);
+    }
+    ret = t;
+  }
+  if (o->dd) {
+    t = dedup_deadline(o->dd);
+    if (0 <= t && t <= now) {
+      dedup_tick(o->dd, now, output_group, o);
+      t = dedup_deadline(o->dd);
+    }
+    if (0 <= t && (ret < 0 || t < ret)) {
+      ret = t;
+    }
+  }
+  if (o->gr) {
+    t = group_deadline(o->gr);
+    if (0 <= t && t <= now) {
+      group_tick(o->gr, now, output_decorate, o);
+      t = group_deadline(o->gr);
+    }
+    if (0 <= t && (ret < 0 || t < ret)) {
+      ret = t;
+    }
+  }
+  return ret;
+}
+
+/**
+ * Main functionality function.
+ * Read from fdin, if crossing a newline add magic.
+ *
+ * @param   fdin       source fd
+ * @param   stream     stream id used when recording (RECORD_*)
+ * @param   o          where the output goes
+ * @param   max        read at most this much (up to 64k)
+ *
+ * @return        bytes read, or -1 on "no more data will be readable ever"
+ */
+static ssize_t
+process(int fdin, int stream, struct outstream *o, size_t max)
+{
+  static char buf[65536];
+  ssize_t n;
+
+  if (max > sizeof(buf)) {
+    max = sizeof(buf);
+  }
+  n = read(fdin, buf, max);
+  TRACE(read, fdin, n, 0 > n ? errno : 0);
+  if (!n) {
+    output_finish(o);
+    if (stream != RECORD_ECHO) {
+      gaps_end(o->gp, fair_now());
+    }
+    return -1;
+  }
+
+  if (0 > n) {
+    switch(errno) {
+      /* non-fatal errors */
+    case EAGAIN:
+    case EINTR:
+      return 0;
+      
+      /* these mean internal error */
+    case EFAULT:
+    case EINVAL:
+    case EBADF:
+    case EISDIR:
+      fprintf(stderr, "%s: Internal error: read() got errno %d (%s)\n",
+	      argv0, errno, strerror(errno));
+      exit(1);
+
+      /* these errors mean we may as well close the whole fd */
+    case EIO:
+    default:
+      output_finish(o);
+      if (stream != RECORD_ECHO) {
+        gaps_end(o->gp, fair_now());
+      }
+      return -1;
+    }
+  }
+  record_chunk(stream, buf, n);
+  if (stream != RECORD_ECHO) {
+    logsink_chunk(stream == RECORD_STDERR, buf, n);
+    if (o->gp) {
+      gaps_feed(o->gp, buf, n, fair_now());
+    }
+  }
+  if (output_feed(o, buf, n)) {
+    return -1;
+  }
+  return n;
+}
+
+/* how long child streams waited to be read once ind was awake, for
+ * --profile */
+static struct fair_lat lat_stdout, lat_stderr, lat_nested;
+
+/* share of reading under flood. stderr tends to be the rarer and more
+ * urgent */
+#define FAIR_WEIGHT_STDOUT 1
+#define FAIR_WEIGHT_STDERR 2
+
+/**
+ * Scheduler callback: read from a child stream, unless where it goes is
+ * full
+ */
+static ssize_t
+source_read(struct fair_src *src, size_t max, void *unused)
+{
+  struct outstream *o = src->data;
+
+  (void)unused;
+  if (output_blocked(o)) {
+    return 0;
+  }
+  return process(src->fd,
+                 (o->fd == STDERR_FILENO) ? RECORD_STDERR : RECORD_STDOUT,
+                 o, max);
+}
+
+/**
+ * The --fd entry for the "N[:...]" given, added if it's new. *rest is set
+ * to what follows the colon, or NULL if there is none. Bails on bad N.
+ */
+static struct extra_fd *
+extra_get(const char *arg, const char **rest)
+{
+  struct extra_fd *x;
+  char *end;
+  long num;
+  int c;
+
+  num = strtol(arg, &end, 10);
+  if (end == arg || (*end && *end != ':')
+      || num <= STDERR_FILENO || num > 1023) {
+    fprintf(stderr, "%s: Invalid fd (3 and up): %s\n", argv0, arg);
+    exit(1);
+  }
+  *rest = *end ? end + 1 : NULL;
+  for (c = 0; c < nextras; c++) {
+    if (extras[c].num == num) {
+      return &extras[c];
+    }
+  }
+  if (!(x = realloc(extras, (nextras + 1) * sizeof(*extras)))) {
+    fprintf(stderr, "%s: Out of memory\n", argv0);
+    exit(1);
+  }
+  extras = x;
+  x = &extras[nextras++];
+  memset(x, 0, sizeof(*x));
+  x->num = num;
+  snprintf(x->name, sizeof(x->name), "fd%d", x->num);
+  x->prefix = "%{stream}: ";
+  x->postfix = "";
+  x->to = "stdout";
+  x->dest = x->fd = x->child_fd = -1;
+  return x;
+}
+
+/**
+ * Before the child is started: the pipes for --fd, and where they go
+ */
+static void
+extras_setup(void)
+{
+  int c;
+
+  for (c = 0; c < nextras; c++) {
+    struct extra_fd *x = &extras[c];
+    int p[2];
+
+    if (!strcmp(x->to, "stdout")) {
+      x->dest = STDOUT_FILENO;
+    } else if (!strcmp(x->to, "stderr")) {
+      x->dest = STDERR_FILENO;
+    } else if (0 > (x->dest = open(x->to, O_WRONLY | O_CREAT | O_APPEND,
+                                   0666))) {
+      fprintf(stderr, "%s: %s: %s\n", argv0, x->to, strerror(errno));
+      exit(1);
+    } else {
+      fcntl(x->dest, F_SETFD, FD_CLOEXEC);
+    }
+    if (-1 == pipe(p)) {
+      fprintf(stderr, "%s: pipe() failed: %s\n", argv0, strerror(errno));
+      exit(1);
+    }
+    fcntl(p[0], F_SETFD, FD_CLOEXEC);
+    fcntl(p[1], F_SETFD, FD_CLOEXEC);
+    x->fd = p[0];
+    x->child_fd = p[1];
+  }
+}
+
+/**
+ * Once the child is started: close its ends, and set up the decoration.
+ * vars are those of stdout, with the stream name changed.
+ */
+static void
+extras_start(const struct ind_vars *vars)
+{
+  int c;
+
+  for (c = 0; c < nextras; c++) {
+    struct extra_fd *x = &extras[c];
+    struct ind_stream *s;
+
+    do_close(x->child_fd);
+    x->child_fd = -1;
+    x->vars = *vars;
+    x->vars.stream = x->name;
+    if (!(x->o = malloc(sizeof(*x->o)))
+        || !(s = ind_stream_new_vars(x->prefix, x->postfix, &x->vars))
+        || outstream_init(x->o, x->dest, s)
+        || (gaps_top
+            && !(x->o->gp = gaps_new(x->name, gaps_top, gaps_start)))) {
+      fprintf(stderr, "%s: Out of memory setting up streams\n", argv0);
+      exit(1);
+    }
+  }
+}
+
+/**
+ * Number of --fd pipes still open
+ */
+static int
+extras_open(void)
+{
+  int ret = 0;
+  int c;
+
+  for (c = 0; c < nextras; c++) {
+    ret += (0 <= extras[c].fd);
+  }
+  return ret;
+}
+
+/**
+ * After the child is done: free the streams, and close files written to.
+ * The names stay, --profile refers to them.
+ */
+static void
+extras_close(void)
+{
+  int c;
+
+  for (c = 0; c < nextras; c++) {
+    struct extra_fd *x = &extras[c];
+    if (x->o) {
+      outstream_free(x->o);
+      free(x->o);
+    }
+    if (x->dest > STDERR_FILENO) {
+      do_close(x->dest);
+    }
+    x->o = NULL;
+    x->dest = -1;
+  }
+}
+
+/* Streams that are ours to decorate, found by what the process writing to
+ * them has as its stdout or stderr: our own child's, followed by those that
+ * nested inds have handed over. */
+struct nested {
+  struct nest_id id;
+  char *prefix;         /* resolved templates, outermost ind's first */
+  char *postfix;
+  int stream;           /* RECORD_STDOUT or RECORD_STDERR */
+  int fd;               /* read end, or -1 for our own child's */
+  struct outstream o;   /* for our own child's, only o.fd is used */
+};
+static struct nested *nested = NULL;
+static int nnested = 0;
+static int nested_fds = 0;
+
+/**
+ * malloc()ed a followed by b, or NULL
+ */
+static char *
+str_concat(const char *a, const char *b)
+{
+  char *ret;
+
+  if ((ret = malloc(strlen(a) + strlen(b) + 1))) {
+    strcpy(ret, a);
+    strcat(ret, b);
+  }
+  return ret;
+}
+
+/**
+ * Free everything of an entry, and close its fd
+ */
+static void
+nested_clear(struct nested *n)
+{
+  free(n->prefix);
+  free(n->postfix);
+  if (0 <= n->fd) {
+    do_close(n->fd);
+    nested_fds--;
+  }
+  outstream_free(&n->o);
+}
+
+/**
+ * Find the entry of what a nested ind has as stdout or stderr
+ *
+ * @return  index, or -1 if it's not ours
+ */
+static int
+nested_find(const struct nest_id *id)
+{
+  int c;
+
+  for (c = 0; c < nnested; c++) {
+    if (nest_id_eq(&nested[c].id, id)) {
+      return c;
+    }
+  }
+  return -1;
+}
+
+/**
+ * Add one of our own child's streams, that nested inds can be found under
+ *
+ * @return  0 on success, -1 if out of memory or templates broken
+ */
+static int
+nested_add_root(const struct nest_id *id, const char *prefix,
+                const char *postfix, const struct ind_vars *vars,
+                int stream, int fd)
+{
+  struct nested *n;
+
+  if (!(n = realloc(nested, (nnested + 1) * sizeof(*nested)))) {
+    return -1;
+  }
+  nested = n;
+  n = &nested[nnested];
+  memset(n, 0, sizeof(*n));
+  n->id = *id;
+  n->stream = stream;
+  n->fd = -1;
+  n->o.fd = fd;
+  if (!(n->prefix = ind_format_resolve(prefix, vars))
+      || !(n->postfix = ind_format_resolve(postfix, vars))) {
+    nested_clear(n);
+    return -1;
+  }
+  nnested++;
+  return 0;
+}
+
+/**
+ * Can output written to entry c be handed over? Not if its lines are
+ * numbered, since the numbers must count all lines of that stream.
+ */
+static int
+nested_can_take(int c)
+{
+  return 0 <= c
+    && !strstr(nested[c].prefix, "%{seq}")
+    && !strstr(nested[c].postfix, "%{seq}");
+}
+
+/**
+ * Take over the output of nested inds that ask for it. The templates of
+ * each stream are those of every ind it passed through, combined.
+ */
+static void
+nested_accept(int ctl)
+{
+  struct nest_reg r;
+
+  while (nest_receive(ctl, &r)) {
+    struct nested *n;
+    int parent[2];
+    int c;
+
+    parent[0] = nested_find(&r.parent[0]);
+    parent[1] = nested_find(&r.parent[1]);
+    if (!nested_can_take(parent[0]) || !nested_can_take(parent[1])
+        || !(n = realloc(nested, (nnested + 2) * sizeof(*nested)))) {
+      if (verbose) {
+        fprintf(stderr, "%s: not taking over output of nested ind\n",
+                argv0);
+      }
+      nest_reg_free(&r);
+      continue;
+    }
+    nested = n;
+
+    for (c = 0; c < 2; c++) {
+      const struct nested *p = &nested[parent[c]];
+      struct ind_stream *s;
+
+      n = &nested[nnested + c];
+      memset(n, 0, sizeof(*n));
+      n->id = r.child[c];
+      n->stream = p->stream;
+      n->fd = -1;
+      if (!(n->prefix = str_concat(p->prefix, r.tmpl[c * 2]))
+          || !(n->postfix = str_concat(r.tmpl[c * 2 + 1], p->postfix))
+          || !(s = ind_stream_new(n->prefix, n->postfix))) {
+        break;
+      }
+      if (outstream_init(&n->o, p->o.fd, s)) {
+        n->o.s = s;
+        break;
+      }
+    }
+    if (c < 2) {
+      /* out of memory, or too many %{seq} */
+      for (; c >= 0; c--) {
+        nested_clear(&nested[nnested + c]);
+      }
+      nest_reg_free(&r);
+      continue;
+    }
+
+    for (c = 0; c < 2; c++) {
+      nested[nnested + c].fd = r.fd[c];
+      r.fd[c] = -1;
+      nested_fds++;
+    }
+    nnested += 2;
+    nest_reply(&r, 1);
+    nest_reg_free(&r);
+    if (verbose) {
+      fprintf(stderr, "%s: took over output of nested ind (fds %d, %d)\n",
+              argv0, nested[nnested - 2].fd, nested[nnested - 1].fd);
+    }
+  }
+}
+
+/**
+ * Hand the output of our child over to the outer ind.
+ *
+ * @return  0 if taken, -1 if we have to decorate it ourselves
+ */
+static int
+nested_handover(int ctl, int fdout, int fderr,
+                const struct nest_id *child_id,
+                const char *prefix, const char *postfix,
+                const char *eprefix, const char *epostfix,
+                const struct ind_vars *outvars,
+                const struct ind_vars *errvars)
+{
+  struct nest_reg r;
+  int ret = -1;
+  int c;
+
+  memset(&r, 0, sizeof(r));
+  r.fd[0] = fdout;
+  r.fd[1] = fderr;
+  r.reply = -1;
+  r.child[0] = child_id[0];
+  r.child[1] = child_id[1];
+  if (!nest_id_get(STDOUT_FILENO, &r.parent[0])
+      && !nest_id_get(STDERR_FILENO, &r.parent[1])
+      && (r.tmpl[0] = ind_format_resolve(prefix, outvars))
+      && (r.tmpl[1] = ind_format_resolve(postfix, outvars))
+      && (r.tmpl[2] = ind_format_resolve(eprefix, errvars))
+      && (r.tmpl[3] = ind_format_resolve(epostfix, errvars))) {
+    ret = nest_register(ctl, &r);
+  }
+  for (c = 0; c < 4; c++) {
+    free(r.tmpl[c]);
+  }
+  if (verbose) {
+    fprintf(stderr, "%s: output %s outer ind\n", argv0,
+            ret ? "not taken by" : "handed over to");
+  }
+  return ret;
+}
+
+/**
+ * adjust width according to length of prefix
+ */
+static void
+fixup_wsp(struct winsize *wsp, struct ind_stream *s)
+{
+  size_t sub = ind_stream_width(s);
+
+  if (sub >= wsp->ws_col) {
+    wsp = 0;
+  } else {
+    wsp->ws_col -= sub;
+  }
+}
+
+/**
+ * Set up a pty for the child, like the terminal realttyfd.
+ *
+ * @param   onlcr:  if 0, the pty does not translate NL to CRNL, so that
+ *                  lines arrive the same as through a pipe
+ */
+static void
+setup_pty(struct ind_stream *s,
+	  int realttyfd, int onlcr,
+	  int *s01m, int *s01s)
+{
+  /* set up winsize */
+  struct winsize *wsp;
+  struct termios *tiop;
+  
+  wsp = alloca(sizeof(struct winsize));
+  if (0 > ioctl(realttyfd, TIOCGWINSZ, wsp)) {
+    /* if parent terminal (if even a terminal at all) won't give up info
+     * on terminal, neither will we.
+     */
+    wsp = 0;
+  }
+    
+  if (wsp) {
+    fixup_wsp(wsp, s);
+  }
+
+  /* set up termios */
+  tiop = alloca(sizeof(struct termios));
+  if (0 > tcgetattr(realttyfd, tiop)) {
+    /* if parent terminal (if even a terminal at all) won't give up info
+     * on terminal, neither will we.
+     */
+    tiop = 0;
+  }
+  if (tiop && !onlcr) {
+    tiop->c_oflag &= ~ONLCR;
+  }
+    
+  if (-1 == openpty(s01m, s01s, NULL, tiop, wsp)) {
+    fprintf(stderr, "%s: openpty() failed: %s\n", argv0, strerror(errno));
+    exit(1);
+  }
+  if (!tiop && !onlcr) {
+    struct termios tio;
+    if (!tcgetattr(*s01s, &tio)) {
+      tio.c_oflag &= ~ONLCR;
+      tcsetattr(*s01s, TCSANOW, &tio);
+    }
+  }
+}
+
+/**
+ * Set up a pty for a child whose output does not go to a terminal.
+ *
+ * The size is given instead of copied, and the output is made clean for
+ * non-terminal consumers: no NL->CRNL translation, and no echo.
+ */
+static void
+setup_forced_pty(struct ind_stream *s,
+                 int rows, int cols,
+                 int *s01m, int *s01s)
+{
+  struct winsize ws;
+  struct termios tio;
+
+  memset(&ws, 0, sizeof(ws));
+  ws.ws_row = rows;
+  ws.ws_col = cols;
+  fixup_wsp(&ws, s);
+
+  if (-1 == openpty(s01m, s01s, NULL, NULL, &ws)) {
+    fprintf(stderr, "%s: openpty() failed: %s\n", argv0, strerror(errno));
+    exit(1);
+  }
+  if (0 > tcgetattr(*s01s, &tio)) {
+    fprintf(stderr, "%s: tcgetattr(forced pty) failed: %s\n",
+            argv0, strerror(errno));
+    return;
+  }
+  tio.c_oflag &= ~ONLCR;
+  tio.c_lflag &= ~(ECHO|ECHONL);
+  if (0 > tcsetattr(*s01s, TCSANOW, &tio)) {
+    fprintf(stderr, "%s: tcsetattr(forced pty) failed: %s\n",
+            argv0, strerror(errno));
+  }
+}
+
+/**
+ *
+ */
+static void
+sig_window_resize(int unused)
+{
+  unused = unused; /* hide warning */
+  sig_winch_counter++;
+}
+
+/**
+ *
+ */
+static void
+sig_flight_dump(int unused)
+{
+  unused = unused; /* hide warning */
+  sig_usr1_counter++;
+}
+
+/**
+ *
+ */
+static void
+update_window_size(int dst, int src, struct ind_stream *s)
+{
+  struct winsize *wsp;
+  wsp = alloca(sizeof(struct winsize));
+  if (0 > ioctl(src, TIOCGWINSZ, wsp)) {
+    /* maybe it's not a terminal. Either way, don't go there */
+    return;
+  }
+  fixup_wsp(wsp, s);
+  TRACE(winch, dst, wsp->ws_row, wsp->ws_col);
+  if (0 > ioctl(dst, TIOCSWINSZ, wsp)) {
+    fprintf(stderr, "%s: ioctl(%d (copy from %d)): %s\n", argv0, dst, src,
+            strerror(errno));
+    return;
+  }
+}
+
+/**
+ * Wait for the child while an outer ind reads its output, keeping the size
+ * of its terminal (if any) right. The child is left for the caller to reap.
+ */
+static void
+nested_wait(pid_t pid, int ptym, struct ind_stream *s)
+{
+  struct sigaction sa;
+  siginfo_t si;
+  int last = sig_winch_counter;
+
+  /* no SA_RESTART, so that the wait is interrupted */
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = sig_window_resize;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGWINCH, &sa, NULL);
+  sigaction(SIGCONT, &sa, NULL);
+
+  for (;;) {
+    if (0 <= ptym && last != sig_winch_counter) {
+      last = sig_winch_counter;
+      update_window_size(ptym, STDOUT_FILENO, s);
+    }
+    if (!waitid(P_PID, pid, &si, WEXITED | WNOWAIT) || errno != EINTR) {
+      break;
+    }
+  }
+}
+
+/**
+ * Join command and arguments with spaces, for %{cmd}.
+ *
+ * @return  malloc()ed string. exit(1)s on failure.
+ */
+static char *
+join_args(char **args)
+{
+  size_t len = 1;
+  char *ret;
+  int c;
+
+  for (c = 0; args[c]; c++) {
+    len += strlen(args[c]) + 1;
+  }
+  if (!(ret = malloc(len))) {
+    fprintf(stderr, "%s: Out of memory joining arguments\n", argv0);
+    exit(1);
+  }
+  ret[0] = 0;
+  for (c = 0; args[c]; c++) {
+    if (c) {
+      strcat(ret, " ");
+    }
+    strcat(ret, args[c]);
+  }
+  return ret;
+}
+
+/**
+ * Find command in $PATH, like execvp() would.
+ *
+ * @return  malloc()ed path, or NULL if not found
+ */
+static char *
+find_in_path(const char *cmd)
+{
+  const char *path;
+  const char *p;
+  char *ret;
+
+  if (strchr(cmd, '/')) {
+    return strdup(cmd);
+  }
+  if (!(path = getenv("PATH"))) {
+    path = "/bin:/usr/bin";
+  }
+  for (p = path;;) {
+    const char *e = strchr(p, ':');
+    size_t dl = e ? (size_t)(e - p) : strlen(p);
+
+    if (!(ret = malloc(dl + strlen(cmd) + 3))) {
+      return NULL;
+    }
+    if (dl) {
+      memcpy(ret, p, dl);
+    } else {
+      ret[dl++] = '.';
+    }
+    ret[dl] = '/';
+    strcpy(ret + dl + 1, cmd);
+    if (!access(ret, X_OK)) {
+      return ret;
+    }
+    free(ret);
+    if (!e) {
+      return NULL;
+    }
+    p = e + 1;
+  }
+}
+
+/**
+ * Is the file a dynamically linked executable, that an LD_PRELOAD
+ * library can be loaded into? Scripts count, since their interpreter
+ * almost certainly is.
+ */
+static int
+is_dynamic(const char *fn)
+{
+  int ret = 0;
+#ifdef HAVE_ELF_H
+  unsigned char ident[EI_NIDENT];
+  FILE *f;
+
+  if (!(f = fopen(fn, "r"))) {
+    return 0;
+  }
+  if (1 != fread(ident, sizeof(ident), 1, f)) {
+    goto out;
+  }
+  if (ident[0] == '#' && ident[1] == '!') {
+    ret = 1;
+    goto out;
+  }
+  if (memcmp(ident, ELFMAG, SELFMAG)) {
+    goto out;
+  }
+  rewind(f);
+  if (ident[EI_CLASS] == ELFCLASS64) {
+    Elf64_Ehdr eh;
+    Elf64_Phdr ph;
+    int c;
+    if (1 != fread(&eh, sizeof(eh), 1, f)) {
+      goto out;
+    }
+    for (c = 0; c < eh.e_phnum; c++) {
+      if (fseek(f, eh.e_phoff + c * eh.e_phentsize, SEEK_SET)
+          || 1 != fread(&ph, sizeof(ph), 1, f)) {
+        goto out;
+      }
+      if (ph.p_type == PT_INTERP) {
+        ret = 1;
+        goto out;
+      }
+    }
+  } else if (ident[EI_CLASS] == ELFCLASS32) {
+    Elf32_Ehdr eh;
+    Elf32_Phdr ph;
+    int c;
+    if (1 != fread(&eh, sizeof(eh), 1, f)) {
+      goto out;
+    }
+    for (c = 0; c < eh.e_phnum; c++) {
+      if (fseek(f, eh.e_phoff + c * eh.e_phentsize, SEEK_SET)
+          || 1 != fread(&ph, sizeof(ph), 1, f)) {
+        goto out;
+      }
+      if (ph.p_type == PT_INTERP) {
+        ret = 1;
+        goto out;
+      }
+    }
+  }
+ out:
+  fclose(f);
+#endif
+  return ret;
+}
+
+/**
+ * Run command with the decoration preload library loaded into it,
+ * replacing ind.
+ *
+ * Returns only if that is not possible (static binary, or no library),
+ * in which case the caller should go the pty/pipe way.
+ */
+static void
+inprocess_exec(char **argv, const char *cmdline,
+               const char *prefix, const char *postfix,
+               const char *eprefix, const char *epostfix)
+{
+  const char *lib = getenv("IND_PRELOAD_LIB");
+  const char *old = getenv("LD_PRELOAD");
+  char *path;
+  char *preload;
+
+  if (!lib) {
+    lib = PKGLIBEXECDIR "/ind_preload.so";
+  }
+  if (access(lib, R_OK)) {
+    if (verbose) {
+      fprintf(stderr, "%s: %s: %s, not running in-process\n",
+              argv0, lib, strerror(errno));
+    }
+    return;
+  }
+  if (!(path = find_in_path(argv[0]))) {
+    /* let the normal path report the error */
+    return;
+  }
+  if (!is_dynamic(path)) {
+    if (verbose) {
+      fprintf(stderr, "%s: %s is not dynamically linked, "
+              "not running in-process\n", argv0, path);
+    }
+    free(path);
+    return;
+  }
+  free(path);
+
+  if (!(preload = malloc(strlen(lib) + (old ? strlen(old) : 0) + 2))) {
+    fprintf(stderr, "%s: malloc() failed\n", argv0);
+    exit(1);
+  }
+  strcpy(preload, lib);
+  if (old && *old) {
+    strcat(preload, ":");
+    strcat(preload, old);
+  }
+  if (setenv("LD_PRELOAD", preload, 1)
+      || setenv("IND_PRELOAD_PREFIX", prefix, 1)
+      || setenv("IND_PRELOAD_POSTFIX", postfix, 1)
+      || setenv("IND_PRELOAD_EPREFIX", eprefix, 1)
+      || setenv("IND_PRELOAD_EPOSTFIX", epostfix, 1)
+      || setenv("IND_PRELOAD_CMD", cmdline, 1)) {
+    fprintf(stderr, "%s: setenv(): %s\n", argv0, strerror(errno));
+    exit(1);
+  }
+  free(preload);
+
+  /* tell the library what to decorate */
+  {
+    const char *names[3] = { NULL, "IND_PRELOAD_STDOUT", "IND_PRELOAD_STDERR" };
+    struct stat st;
+    char id[64];
+    int fd;
+    for (fd = STDOUT_FILENO; fd <= STDERR_FILENO; fd++) {
+      if (fstat(fd, &st)) {
+        unsetenv(names[fd]);
+        continue;
+      }
+      snprintf(id, sizeof(id), "%llu:%llu",
+               (unsigned long long)st.st_dev, (unsigned long long)st.st_ino);
+      if (setenv(names[fd], id, 1)) {
+        fprintf(stderr, "%s: setenv(): %s\n", argv0, strerror(errno));
+        exit(1);
+      }
+    }
+  }
+  execvp(argv[0], argv);
+  fprintf(stderr, "%s: %s: %s\n", argv0, argv[0], strerror(errno));
+  exit(1);
+}
+
+/* long-only options */
+enum {
+  OPT_REPLAY = 256,
+  OPT_SPEED,
+  OPT_WINSIZE,
+  OPT_INPROCESS,
+  OPT_LOG,
+  OPT_LOG_SOCKET,
+  OPT_LOG_PRIORITY,
+  OPT_FLIGHT,
+  OPT_FLIGHT_FILE,
+  OPT_FLIGHT_DUMP,
+  OPT_FLIGHT_READ,
+  OPT_PROFILE,
+  OPT_PROFILE_FILE,
+  OPT_PROFILE_SAMPLE,
+  OPT_DEDUP,
+  OPT_DEDUP_WINDOW,
+  OPT_DEDUP_TIME,
+  OPT_CR_COMPACT,
+  OPT_NEST,
+  OPT_NO_NEST,
+  OPT_ONLCR,
+  OPT_GROUP,
+  OPT_GROUP_START,
+  OPT_GROUP_MAX,
+  OPT_GROUP_TIMEOUT,
+  OPT_TRACE,
+  OPT_TRACE_SIZE,
+  OPT_DECODE_TRACE,
+  OPT_PARALLEL,
+  OPT_PARALLEL_ORDER,
+  OPT_PARALLEL_MEM,
+  OPT_BATCH,
+  OPT_NULL,
+  OPT_INDEX,
+  OPT_INDEX_FILE,
+  OPT_INDEX_EVERY,
+  OPT_SEEK,
+  OPT_FOLLOW,
+  OPT_FD,
+  OPT_FD_POSTFIX,
+  OPT_FD_TO,
+  OPT_GAPS,
+  OPT_GAPS_FILE,
+};
+
+
+/**
+ * Parse a size like "4096", "64k" or "4M"
+ *
+ * @return  size in bytes, or 0 if invalid
+ */
+static size_t
+parse_size(const char *s)
+{
+  char *end;
+  unsigned long long n = strtoull(s, &end, 10);
+
+  if (end == s) {
+    return 0;
+  }
+  switch (*end) {
+  case 'k': case 'K': n <<= 10; end++; break;
+  case 'm': case 'M': n <<= 20; end++; break;
+  case 'g': case 'G': n <<= 30; end++; break;
+  }
+  if (*end || n != (size_t)n) {
+    return 0;
+  }
+  return n;
+}
+
+struct replay_state {
+  struct ind_stream *out;
+  struct ind_stream *err;
+};
+
+/**
+ * Decorate one recorded chunk, the same way process() would have
+ */
+static void
+replay_chunk(int stream, const char *buf, size_t len, void *arg)
+{
+  struct replay_state *rs = arg;
+
+  switch (stream) {
+  case RECORD_STDOUT:
+  case RECORD_ECHO:
+    decorate(STDOUT_FILENO, rs->out, buf, len);
+    break;
+  case RECORD_STDERR:
+    decorate(STDERR_FILENO, rs->err, buf, len);
+    break;
+  }
+}
+
+/* --parallel and --batch */
+static int parallel = 0;
+static int parallel_input_order = -1;    /* -1: depends on the mode */
+static size_t parallel_mem = 1048576;
+
+/* --batch, and the separator of the commands in it */
+static const char *batch_file = NULL;
+static int batch_delim = '\n';
+
+/* where the commands come from: the arguments, or a --batch file */
+struct cmd_source {
+  char **argv;
+  FILE *f;
+  int delim;
+  char *line;
+  size_t size;
+};
+
+/* a pty that runs one command after another */
+struct pty_slot {
+  int m;                /* -1 until opened */
+  int s;
+  struct termios tio;   /* as set up, to go back to between commands */
+  int busy;
+};
+
+/* ptys for --parallel and --batch, one per command that can run at once.
+ * pool_mode is 0 for pipes, 1 to copy stdout's terminal, 2 for -t. */
+static struct pty_slot *pool;
+static int pool_mode;
+static int pool_rows, pool_cols, pool_onlcr;
+
+/* a command run by --parallel or --batch */
+struct job {
+  char *cmd;
+  pid_t pid;            /* -1 once reaped */
+  int status;
+  int fd[2];            /* stdout and stderr, -1 once done */
+  struct pty_slot *pty; /* stdout, if it's a pty */
+  struct ind_vars vars[2];
+  struct outstream o[2];
+  struct spool *sp[2];  /* the same one twice if both go to one file */
+  int live;             /* output is written as it comes */
+  int finished;
+};
+
+static int sigchld_pipe[2] = { -1, -1 };
+
+/**
+ * SIGCHLD handler: wake up the --parallel loop
+ */
+static void
+sig_child(int unused)
+{
+  int save = errno;
+  char c = 0;
+  (void)unused;
+  if (write(sigchld_pipe[1], &c, 1)) {
+    /* full is fine, it only needs to be readable */
+  }
+  errno = save;
+}
+
+/**
+ * Next command to run, or NULL when there are no more. Empty lines in a
+ * --batch file are skipped.
+ *
+ * @return  malloc()ed command
+ */
+static char *
+cmd_next(struct cmd_source *cs)
+{
+  if (cs->argv) {
+    return *cs->argv ? strdup(*cs->argv++) : NULL;
+  }
+  for (;;) {
+    ssize_t n = getdelim(&cs->line, &cs->size, cs->delim, cs->f);
+    if (0 > n) {
+      return NULL;
+    }
+    if (n && cs->line[n - 1] == cs->delim) {
+      cs->line[--n] = 0;
+    }
+    if (n) {
+      return strdup(cs->line);
+    }
+  }
+}
+
+/**
+ * Give a pty its window size: that of our terminal or the -t size, less
+ * what the decoration takes
+ */
+static void
+pool_winsize(struct pty_slot *p, struct ind_stream *s)
+{
+  struct winsize ws;
+
+  if (pool_mode == 1) {
+    update_window_size(p->m, STDOUT_FILENO, s);
+    return;
+  }
+  memset(&ws, 0, sizeof(ws));
+  ws.ws_row = pool_rows;
+  ws.ws_col = pool_cols;
+  fixup_wsp(&ws, s);
+  ioctl(p->m, TIOCSWINSZ, &ws);
+}
+
+/**
+ * A free pty from the pool, opened the first time and otherwise reset to
+ * how it was set up: modes, pending data and window size.
+ */
+static struct pty_slot *
+pool_get(struct ind_stream *s)
+{
+  struct pty_slot *p;
+
+  for (p = pool; p->busy; p++);
+  if (0 > p->m) {
+    if (pool_mode == 1) {
+      setup_pty(s, STDOUT_FILENO, pool_onlcr, &p->m, &p->s);
+    } else {
+      setup_forced_pty(s, pool_rows, pool_cols, &p->m, &p->s);
+    }
+    fcntl(p->m, F_SETFD, FD_CLOEXEC);
+    fcntl(p->s, F_SETFD, FD_CLOEXEC);
+    /* it's drained when the command is gone, without waiting for more */
+    fcntl(p->m, F_SETFL, fcntl(p->m, F_GETFL) | O_NONBLOCK);
+    tcgetattr(p->s, &p->tio);
+  } else {
+    tcsetattr(p->s, TCSANOW, &p->tio);
+    tcflush(p->s, TCIOFLUSH);
+    pool_winsize(p, s);
+  }
+  p->busy = 1;
+  return p;
+}
+
+/**
+ * Start a command with its own decoration
+ *
+ * @return  0 on success, -1 on error (printed)
+ */
+static int
+job_start(struct job *j, int devnull, struct spill *sf, const char *hostname,
+          const char *prefix, const char *postfix,
+          const char *eprefix, const char *epostfix)
+{
+  struct ind_stream *s[2];
+  char *args[4];
+  int child_fd[2];
+  int c;
+
+  j->pid = 0;
+  for (c = 0; c < 2; c++) {
+    j->vars[c].cmd = j->cmd;
+    j->vars[c].host = hostname;
+    j->vars[c].stream = c ? "stderr" : "stdout";
+    if (!(s[c] = ind_stream_new_vars(c ? eprefix : prefix,
+                                     c ? epostfix : postfix, &j->vars[c]))
+        || outstream_init(&j->o[c], c ? STDERR_FILENO : STDOUT_FILENO,
+                          s[c])) {
+      fprintf(stderr, "%s: Out of memory setting up output\n", argv0);
+      return -1;
+    }
+  }
+
+  for (c = 0; c < 2; c++) {
+    int p[2];
+    if (!c && pool_mode) {
+      j->pty = pool_get(s[0]);
+      j->fd[0] = j->pty->m;
+      child_fd[0] = j->pty->s;
+      continue;
+    }
+    if (0 > pipe(p)) {
+      fprintf(stderr, "%s: pipe() failed: %s\n", argv0, strerror(errno));
+      return -1;
+    }
+    fcntl(p[0], F_SETFD, FD_CLOEXEC);
+    j->fd[c] = p[0];
+    child_fd[c] = p[1];
+  }
+  args[0] = "/bin/sh";
+  args[1] = "-c";
+  args[2] = j->cmd;
+  args[3] = NULL;
+  j->pid = spawn_child(devnull, child_fd[0], child_fd[1],
+                       -1, j->fd[0], j->fd[1], args);
+  if (!j->pty) {
+    do_close(child_fd[0]);
+  }
+  do_close(child_fd[1]);
+
+  for (c = 0; c < 2; c++) {
+    j->vars[c].pid = j->pid;
+    if (ind_stream_set_vars(s[c], &j->vars[c])) {
+      fprintf(stderr, "%s: Out of memory setting up streams\n", argv0);
+      return -1;
+    }
+  }
+  if (!(j->sp[0] = spool_new(sf, parallel_mem))
+      || !(j->sp[1] = same_file(STDOUT_FILENO, STDERR_FILENO)
+           ? j->sp[0] : spool_new(sf, parallel_mem))) {
+    fprintf(stderr, "%s: Out of memory setting up output\n", argv0);
+    return -1;
+  }
+  j->o[0].sp = j->sp[0];
+  j->o[1].sp = j->sp[1];
+  return 0;
+}
+
+/**
+ * The command is gone. What it left in its pty is still to be read, but
+ * won't be waited for: the pty stays open for the next command.
+ */
+static void
+job_reaped(struct job *j, int status)
+{
+  j->pid = -1;
+  j->status = status;
+  if (j->pty) {
+    while (0 < process(j->fd[0], RECORD_STDOUT, &j->o[0], 65536));
+    output_finish(&j->o[0]);
+    j->pty->busy = 0;
+    j->pty = NULL;
+    j->fd[0] = -1;
+  }
+}
+
+/**
+ * Write the output of the command from now on as it comes, starting with
+ * what has been held so far
+ */
+static void
+job_live(struct job *j)
+{
+  int c;
+  for (c = 0; c < 2; c++) {
+    if (c && j->sp[1] == j->sp[0]) {
+      break;
+    }
+    if (spool_emit(j->sp[c], c ? STDERR_FILENO : STDOUT_FILENO)) {
+      fprintf(stderr, "%s: writing output of '%s': %s\n",
+              argv0, j->cmd, strerror(errno));
+    }
+  }
+  j->o[0].sp = j->o[1].sp = NULL;
+  j->live = 1;
+}
+
+/**
+ * Add a line about how the command failed, if it did, after its stderr
+ */
+static void
+job_report(struct job *j)
+{
+  char msg[64];
+  struct iovec iov[4];
+
+  if (WIFEXITED(j->status) && !WEXITSTATUS(j->status)) {
+    return;
+  }
+  if (WIFSIGNALED(j->status)) {
+    snprintf(msg, sizeof(msg), ": signal %d\n", WTERMSIG(j->status));
+  } else {
+    snprintf(msg, sizeof(msg), ": exit %d\n", WEXITSTATUS(j->status));
+  }
+  iov[0].iov_base = (char*)argv0;
+  iov[0].iov_len = strlen(argv0);
+  iov[1].iov_base = ": ";
+  iov[1].iov_len = 2;
+  iov[2].iov_base = j->cmd;
+  iov[2].iov_len = strlen(j->cmd);
+  iov[3].iov_base = msg;
+  iov[3].iov_len = strlen(msg);
+  if (j->live) {
+    safe_writev(STDERR_FILENO, iov, 4);
+  } else {
+    spool_writev(j->sp[1], iov, 4);
+  }
+}
+
+/**
+ * Write out everything a finished command printed, and free it
+ *
+ * @return  0 on success, -1 on error (printed)
+ */
+static int
+job_emit(struct job *j)
+{
+  int ret = 0;
+  int c;
+
+  for (c = 0; c < 2; c++) {
+    if (c && j->sp[1] == j->sp[0]) {
+      break;
+    }
+    if (spool_emit(j->sp[c], c ? STDERR_FILENO : STDOUT_FILENO)) {
+      fprintf(stderr, "%s: writing output of '%s': %s\n",
+              argv0, j->cmd, strerror(errno));
+      ret = -1;
+    }
+  }
+  if (j->sp[1] != j->sp[0]) {
+    spool_free(j->sp[1]);
+  }
+  spool_free(j->sp[0]);
+  outstream_free(&j->o[0]);
+  outstream_free(&j->o[1]);
+  free(j->cmd);
+  free(j);
+  return ret;
+}
+
+/**
+ * Run every command, up to parallel at a time, and write out the output
+ * of each in one piece once it's done: as they finish, or in the order
+ * given. Output waits in spools, whose memory is bounded per running
+ * command. When the order allows, the oldest command's output isn't held
+ * but written as it comes.
+ *
+ * @return  exit code: the number of commands that failed, at most 101
+ */
+static int
+parallel_run(struct cmd_source *cs, const char *hostname,
+             const char *prefix, const char *postfix,
+             const char *eprefix, const char *epostfix)
+{
+  struct job **jobs;     /* started and not yet written out, oldest first */
+  int njobs = 0;
+  int maxjobs = parallel;
+  int running = 0;
+  int more = 1;
+  int failed = 0;
+  int last_winch = sig_winch_counter;
+  struct spill *sf;
+  struct fair_src *srcs;
+  int **which;
+  int devnull;
+  int c;
+
+  if (!(jobs = calloc(parallel, sizeof(*jobs))) || !(sf = spill_new())
+      || !(srcs = calloc(2 * parallel, sizeof(*srcs)))
+      || !(which = calloc(2 * parallel, sizeof(*which)))
+      || (pool_mode && !(pool = calloc(parallel, sizeof(*pool))))) {
+    fprintf(stderr, "%s: Out of memory\n", argv0);
+    exit(1);
+  }
+  for (c = 0; pool_mode && c < parallel; c++) {
+    pool[c].m = pool[c].s = -1;
+  }
+  if (0 > (devnull = open("/dev/null", O_RDONLY))
+      || 0 > pipe(sigchld_pipe)) {
+    fprintf(stderr, "%s: can't set up: %s\n", argv0, strerror(errno));
+    exit(1);
+  }
+  for (c = 0; c < 2; c++) {
+    fcntl(sigchld_pipe[c], F_SETFD, FD_CLOEXEC);
+    fcntl(sigchld_pipe[c], F_SETFL, O_NONBLOCK);
+  }
+  fcntl(devnull, F_SETFD, FD_CLOEXEC);
+  signal(SIGCHLD, sig_child);
+  if (pool_mode == 1) {
+    signal(SIGWINCH, sig_window_resize);
+  }
+
+  for (;;) {
+    struct timeval tv, *tvp = NULL;
+    long long now;
+    long long wake = -1;
+    int nsrcs = 0;
+    int fdmax = -1;
+    fd_set fds;
+    int n;
+
+    while (more && running < parallel) {
+      struct job *j;
+      char *cmd;
+
+      if (!(cmd = cmd_next(cs))) {
+        more = 0;
+        break;
+      }
+      if (!(j = calloc(1, sizeof(*j)))) {
+        fprintf(stderr, "%s: Out of memory\n", argv0);
+        exit(1);
+      }
+      j->cmd = cmd;
+      if (njobs == maxjobs) {
+        /* finished ones waiting their turn take room too */
+        maxjobs *= 2;
+        if (!(jobs = realloc(jobs, maxjobs * sizeof(*jobs)))) {
+          fprintf(stderr, "%s: Out of memory\n", argv0);
+          exit(1);
+        }
+      }
+      if (job_start(j, devnull, sf, hostname,
+                    prefix, postfix, eprefix, epostfix)) {
+        exit(1);
+      }
+      jobs[njobs++] = j;
+      running++;
+    }
+
+    /* reap */
+    for (;;) {
+      int status;
+      pid_t pid = waitpid(-1, &status, WNOHANG);
+      if (0 >= pid) {
+        break;
+      }
+      for (c = 0; c < njobs; c++) {
+        if (jobs[c]->pid == pid) {
+          job_reaped(jobs[c], status);
+          if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+            failed++;
+          }
+        }
+      }
+    }
+
+    /* done once reaped and all output read */
+    for (c = 0; c < njobs; c++) {
+      struct job *j = jobs[c];
+      if (j->finished || 0 <= j->pid || 0 <= j->fd[0] || 0 <= j->fd[1]) {
+        continue;
+      }
+      j->finished = 1;
+      running--;
+      output_finish(&j->o[0]);
+      output_finish(&j->o[1]);
+      job_report(j);
+      if (c && parallel_input_order
+          && (spool_park(j->sp[0])
+              || (j->sp[1] != j->sp[0] && spool_park(j->sp[1])))) {
+        fprintf(stderr, "%s: can't hold output of '%s': %s\n",
+                argv0, j->cmd, strerror(errno));
+        exit(1);
+      }
+    }
+
+    /* write out: in input order from the oldest, else any that's done */
+    for (c = 0; c < njobs; c++) {
+      if (!jobs[c]->finished) {
+        if (parallel_input_order) {
+          break;
+        }
+        continue;
+      }
+      job_emit(jobs[c]);
+      memmove(&jobs[c], &jobs[c + 1], (njobs - c - 1) * sizeof(*jobs));
+      njobs--;
+      c--;
+    }
+    if (njobs && !jobs[0]->live && (parallel_input_order || parallel == 1)) {
+      job_live(jobs[0]);
+    }
+
+    if (more && running < parallel) {
+      continue;
+    }
+    if (!njobs) {
+      break;
+    }
+
+    if (last_winch != sig_winch_counter) {
+      last_winch = sig_winch_counter;
+      for (c = 0; c < njobs; c++) {
+        if (jobs[c]->pty) {
+          pool_winsize(jobs[c]->pty, jobs[c]->o[0].s);
+        }
+      }
+    }
+
+    FD_ZERO(&fds);
+    do_fdset(&fds, sigchld_pipe[0], &fdmax);
+    now = mono_ms();
+    for (c = 0; c < njobs; c++) {
+      int i;
+      if (jobs[c]->finished) {
+        continue;
+      }
+      for (i = 0; i < 2; i++) {
+        long long t;
+        do_fdset(&fds, jobs[c]->fd[i], &fdmax);
+        if (0 <= (t = output_tick(&jobs[c]->o[i], now))
+            && (wake < 0 || t < wake)) {
+          wake = t;
+        }
+      }
+    }
+    if (0 <= wake) {
+      tv.tv_sec = (wake - now) / 1000;
+      tv.tv_usec = ((wake - now) % 1000) * 1000;
+      tvp = &tv;
+    }
+
+    TRACE(select, -1, fdmax + 1,
+          tvp ? tvp->tv_sec * 1000LL + tvp->tv_usec / 1000 : -1LL);
+    n = select(fdmax + 1, &fds, NULL, NULL, tvp);
+    TRACE(wake, -1, n, 0 > n ? errno : 0);
+    if (0 > n) {
+      if (errno != EINTR) {
+        fprintf(stderr, "%s: select(): %s\n", argv0, strerror(errno));
+      }
+      continue;
+    }
+    if (FD_ISSET(sigchld_pipe[0], &fds)) {
+      char buf[64];
+      while (0 < read(sigchld_pipe[0], buf, sizeof(buf)));
+    }
+
+    now = fair_now();
+    for (c = 0; c < njobs; c++) {
+      int i;
+      for (i = 0; i < 2; i++) {
+        if (!jobs[c]->finished && 0 <= jobs[c]->fd[i]
+            && FD_ISSET(jobs[c]->fd[i], &fds)) {
+          fair_src_init(&srcs[nsrcs], jobs[c]->fd[i],
+                        i ? FAIR_WEIGHT_STDERR : FAIR_WEIGHT_STDOUT,
+                        i ? &lat_stderr : &lat_stdout, &jobs[c]->o[i], now);
+          which[nsrcs++] = &jobs[c]->fd[i];
+        }
+      }
+    }
+    fair_run(srcs, nsrcs, NULL, 0, source_read, NULL);
+    for (c = 0; c < nsrcs; c++) {
+      if (srcs[c].done) {
+        do_close(*which[c]);
+        *which[c] = -1;
+      }
+    }
+  }
+
+  signal(SIGCHLD, SIG_DFL);
+  for (c = 0; c < 2; c++) {
+    do_close(sigchld_pipe[c]);
+  }
+  for (c = 0; pool && c < parallel; c++) {
+    do_close(pool[c].m);
+    do_close(pool[c].s);
+  }
+  free(pool);
+  do_close(devnull);
+  spill_free(sf);
+  free(jobs);
+  free(srcs);
+  free(which);
+  return failed > 100 ? 101 : failed;
+}
+
+/* --follow: a file followed, as a stream of its own */
+struct follow {
+  const char *fn;
+  const char *base;       /* file name part of fn */
+  int fd;                 /* -1 while there is no such file */
+  int wd;                 /* inotify watch of the file, or -1 */
+  int dwd;                /* of the directory it's in */
+  struct follow *wdnext;  /* next follow with the same wd */
+  dev_t dev;
+  ino_t ino;
+  off_t off;              /* how far it's been read */
+  int dirty;              /* may have more to read */
+  int recheck;            /* may have been replaced or created */
+  struct ind_vars vars;
+  struct outstream o;
+};
+
+#ifdef HAVE_SYS_INOTIFY_H
+/* follows by file watch, so that events are looked up, not searched for */
+static struct follow **follow_wd;
+static int follow_nwd;
+
+static volatile sig_atomic_t follow_stop = 0;
+
+/**
+ * SIGINT/SIGTERM handler for --follow: stop after writing what's read
+ */
+static void
+sig_follow_stop(int unused)
+{
+  (void)unused;
+  follow_stop = 1;
+}
+
+/**
+ * Watch the file for changes and for being moved or removed
+ */
+static void
+follow_watch(struct follow *f, int ino)
+{
+  if (0 > (f->wd = inotify_add_watch(ino, f->fn, IN_MODIFY | IN_ATTRIB
+                                     | IN_MOVE_SELF | IN_DELETE_SELF))) {
+    fprintf(stderr, "%s: %s: can't watch: %s\n",
+            argv0, f->fn, strerror(errno));
+    return;
+  }
+  if (f->wd >= follow_nwd) {
+    int n = f->wd * 2 + 16;
+    struct follow **m;
+    if (!(m = realloc(follow_wd, n * sizeof(*m)))) {
+      fprintf(stderr, "%s: Out of memory\n", argv0);
+      exit(1);
+    }
+    memset(m + follow_nwd, 0, (n - follow_nwd) * sizeof(*m));
+    follow_wd = m;
+    follow_nwd = n;
+  }
+  f->wdnext = follow_wd[f->wd];
+  follow_wd[f->wd] = f;
+}
+
+/**
+ * Stop watching the file, unless it's followed under another name too
+ */
+static void
+follow_unwatch(struct follow *f, int ino)
+{
+  struct follow **pp;
+
+  if (0 > f->wd) {
+    return;
+  }
+  for (pp = &follow_wd[f->wd]; *pp; pp = &(*pp)->wdnext) {
+    if (*pp == f) {
+      *pp = f->wdnext;
+      break;
+    }
+  }
+  if (!follow_wd[f->wd]) {
+    inotify_rm_watch(ino, f->wd);
+  }
+  f->wd = -1;
+}
+
+/**
+ * Open the file, if it's there. At start reading begins at the end, like
+ * tail -f. A file that shows up later is read from the start.
+ */
+static void
+follow_open(struct follow *f, int ino, int at_end)
+{
+  struct stat st;
+
+  if (0 > (f->fd = open(f->fn, O_RDONLY))) {
+    if (errno != ENOENT) {
+      fprintf(stderr, "%s: %s: %s\n", argv0, f->fn, strerror(errno));
+    }
+    return;
+  }
+  fcntl(f->fd, F_SETFD, FD_CLOEXEC);
+  if (fstat(f->fd, &st)) {
+    fprintf(stderr, "%s: %s: %s\n", argv0, f->fn, strerror(errno));
+    do_close(f->fd);
+    f->fd = -1;
+    return;
+  }
+  f->dev = st.st_dev;
+  f->ino = st.st_ino;
+  f->off = at_end ? st.st_size : 0;
+  f->dirty = 1;
+  follow_watch(f, ino);
+}
+
+/**
+ * Read the next chunk of what's been added to the file, up to the last
+ * complete line in it, so that lines from different files don't get
+ * mixed. Unless it's the last read, or a line doesn't fit.
+ */
+static void
+follow_read(struct follow *f, int last)
+{
+  static char buf[262144];
+  struct stat st;
+  ssize_t n;
+  size_t use;
+
+  f->dirty = 0;
+  if (0 > f->fd) {
+    return;
+  }
+  if (!fstat(f->fd, &st) && st.st_size < f->off) {
+    fprintf(stderr, "%s: %s: file truncated\n", argv0, f->fn);
+    f->off = 0;
+  }
+  if (0 > (n = pread(f->fd, buf, sizeof(buf), f->off))) {
+    if (errno == EINTR) {
+      f->dirty = 1;
+      return;
+    }
+    fprintf(stderr, "%s: %s: %s\n", argv0, f->fn, strerror(errno));
+    return;
+  }
+  TRACE(read, f->fd, n, 0);
+  for (use = n; use && buf[use - 1] != '\n' && buf[use - 1] != '\r'; use--);
+  if (last || (!use && (size_t)n == sizeof(buf))) {
+    use = n;
+  }
+  f->off += use;
+  output_feed(&f->o, buf, use);
+  f->dirty = (size_t)n == sizeof(buf);
+}
+
+/**
+ * The file may have been replaced (e.g. rotated), or have shown up. If
+ * so, finish the old one and go on with the new one from the start.
+ */
+static void
+follow_recheck(struct follow *f, int ino)
+{
+  struct stat st;
+
+  f->recheck = 0;
+  if (0 > f->fd) {
+    follow_open(f, ino, 0);
+    return;
+  }
+  if (stat(f->fn, &st) || (st.st_dev == f->dev && st.st_ino == f->ino)) {
+    /* gone, or the same. Whatever still has it open may write more. */
+    return;
+  }
+  do {
+    follow_read(f, 0);
+  } while (f->dirty);
+  follow_read(f, 1);
+  output_finish(&f->o);
+  follow_unwatch(f, ino);
+  do_close(f->fd);
+  f->fd = -1;
+  follow_open(f, ino, 0);
+}
+
+/**
+ * Handle what inotify has to say
+ */
+static void
+follow_events(struct follow *fs, int nfs, int ino)
+{
+  union {
+    struct inotify_event ev;
+    char buf[65536];
+  } u;
+  ssize_t n;
+  int c;
+
+  while (0 < (n = read(ino, u.buf, sizeof(u.buf)))) {
+    char *p;
+    for (p = u.buf; p < u.buf + n;
+         p += sizeof(struct inotify_event) + ((struct inotify_event*)p)->len) {
+      struct inotify_event *ev = (struct inotify_event*)p;
+      struct follow *f;
+
+      if (ev->mask & IN_Q_OVERFLOW) {
+        /* events were lost, so look at everything */
+        for (c = 0; c < nfs; c++) {
+          fs[c].dirty = fs[c].recheck = 1;
+        }
+        continue;
+      }
+      if (ev->len) {
+        /* created or moved into a watched directory */
+        for (c = 0; c < nfs; c++) {
+          if (fs[c].dwd == ev->wd && !strcmp(fs[c].base, ev->name)) {
+            fs[c].recheck = 1;
+          }
+        }
+        continue;
+      }
+      if (ev->wd < 0 || ev->wd >= follow_nwd) {
+        continue;
+      }
+      for (f = follow_wd[ev->wd]; f; f = f->wdnext) {
+        f->dirty = 1;
+        if (ev->mask & (IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF)) {
+          f->recheck = 1;
+        }
+        if (ev->mask & IN_IGNORED) {
+          f->wd = -1;
+        }
+      }
+      if (ev->mask & IN_IGNORED) {
+        follow_wd[ev->wd] = NULL;
+      }
+    }
+  }
+}
+
+/**
+ * Decorate what's written to the files, each as a stream of its own,
+ * until interrupted. Files are found again when they're rotated, and
+ * may be missing at first. inotify says when to look, so an idle file
+ * costs nothing.
+ *
+ * @return  exit code
+ */
+static int
+follow_run(char **files, int nfiles, const char *hostname,
+           const char *prefix, const char *postfix)
+{
+  struct follow *fs;
+  int ino;
+  int c;
+
+  if (0 > (ino = inotify_init())) {
+    fprintf(stderr, "%s: inotify_init(): %s\n", argv0, strerror(errno));
+    return 1;
+  }
+  fcntl(ino, F_SETFD, FD_CLOEXEC);
+  fcntl(ino, F_SETFL, O_NONBLOCK);
+  if (!(fs = calloc(nfiles, sizeof(*fs)))) {
+    fprintf(stderr, "%s: Out of memory\n", argv0);
+    return 1;
+  }
+  for (c = 0; c < nfiles; c++) {
+    struct follow *f = &fs[c];
+    struct ind_stream *s;
+    char *dir;
+    char *slash;
+
+    f->fn = files[c];
+    f->base = (slash = strrchr(f->fn, '/')) ? slash + 1 : f->fn;
+    f->fd = f->wd = -1;
+    f->vars.stream = "stdout";
+    f->vars.cmd = f->fn;
+    f->vars.host = hostname;
+    f->vars.pid = getpid();
+    f->vars.file = f->fn;
+    if (!(s = ind_stream_new_vars(prefix, postfix, &f->vars))
+        || outstream_init(&f->o, STDOUT_FILENO, s)
+        || !(dir = strdup(f->fn))) {
+      fprintf(stderr, "%s: Out of memory setting up streams\n", argv0);
+      return 1;
+    }
+    if ((slash = strrchr(dir, '/'))) {
+      slash[slash == dir] = 0;
+    } else {
+      strcpy(dir, ".");
+    }
+    if (0 > (f->dwd = inotify_add_watch(ino, dir, IN_CREATE | IN_MOVED_TO))) {
+      fprintf(stderr, "%s: %s: can't watch: %s\n",
+              argv0, dir, strerror(errno));
+    }
+    free(dir);
+    follow_open(f, ino, 1);
+    if (0 > f->fd) {
+      fprintf(stderr, "%s: %s: not there yet\n", argv0, f->fn);
+    }
+  }
+
+  signal(SIGINT, sig_follow_stop);
+  signal(SIGTERM, sig_follow_stop);
+  while (!follow_stop) {
+    struct timeval tv, *tvp = NULL;
+    long long now = mono_ms();
+    long long wake = -1;
+    int more = 0;
+    fd_set fds;
+    int n;
+
+    for (c = 0; c < nfiles; c++) {
+      long long t;
+      more |= fs[c].dirty | fs[c].recheck;
+      if (0 <= (t = output_tick(&fs[c].o, now)) && (wake < 0 || t < wake)) {
+        wake = t;
+      }
+    }
+    if (more) {
+      wake = now;
+    }
+    if (0 <= wake) {
+      tv.tv_sec = (wake - now) / 1000;
+      tv.tv_usec = ((wake - now) % 1000) * 1000;
+      tvp = &tv;
+    }
+
+    FD_ZERO(&fds);
+    FD_SET(ino, &fds);
+    TRACE(select, -1, ino + 1,
+          tvp ? tvp->tv_sec * 1000LL + tvp->tv_usec / 1000 : -1LL);
+    n = select(ino + 1, &fds, NULL, NULL, tvp);
+    TRACE(wake, -1, n, 0 > n ? errno : 0);
+    if (0 > n) {
+      if (errno != EINTR) {
+        fprintf(stderr, "%s: select(): %s\n", argv0, strerror(errno));
+      }
+      continue;
+    }
+    if (n) {
+      follow_events(fs, nfiles, ino);
+    }
+    for (c = 0; c < nfiles; c++) {
+      if (fs[c].recheck) {
+        follow_recheck(&fs[c], ino);
+      }
+    }
+    /* a chunk from each in turn, so that a busy file can't hold up the
+     * rest */
+    for (c = 0; c < nfiles; c++) {
+      if (fs[c].dirty) {
+        follow_read(&fs[c], 0);
+      }
+    }
   }
-  fixup_wsp(wsp, prefix, postfix);
-  if (0 > ioctl(dst, TIOCSWINSZ, wsp)) {
-    fprintf(stderr, "%s: ioctl(%d (copy from %d)): %s\n", argv0, dst, src,
-            strerror(errno));
-    return;
+
+  for (c = 0; c < nfiles; c++) {
+    do {
+      follow_read(&fs[c], 0);
+    } while (fs[c].dirty);
+    follow_read(&fs[c], 1);
+    output_finish(&fs[c].o);
+    outstream_free(&fs[c].o);
+    do_close(fs[c].fd);
   }
+  do_close(ino);
+  free(fs);
+  free(follow_wd);
+  return 0;
+}
+#else
+static int
+follow_run(char **files, int nfiles, const char *hostname,
+           const char *prefix, const char *postfix)
+{
+  (void)files;
+  (void)nfiles;
+  (void)hostname;
+  (void)prefix;
+  (void)postfix;
+  fprintf(stderr, "%s: --follow needs inotify, not available here\n", argv0);
+  return 1;
 }
+#endif
 
 /**
  *
@@ -751,10 +3036,102 @@ main(int argc, char **argv)
   char *eprefix = ">>";
   char *postfix = "";
   char *epostfix = "";
-  int emptyline = 1;
-  int eemptyline = 1;
+  struct ind_stream *out, *err;
+  struct ind_vars outvars, errvars;
+  char hostname[256] = "";
+  char *cmdline = NULL;
   int childpid;
   int stdin_fileno = STDIN_FILENO;
+  int stdin_tty = isatty(STDIN_FILENO);
+  int stdout_tty = isatty(STDOUT_FILENO);
+  int ind_stdin_tty;
+#ifdef HAVE_SPLICE
+  int use_splice = !stdin_tty;
+#endif
+  const char *record_file = getenv("IND_RECORD");
+  const char *replay_file = NULL;
+  double replay_speed = 1.0;
+  int force_pty = 0;
+  int inprocess = 0;
+  int force_rows = 24, force_cols = 80;
+  int log_kind = 0;
+  const char *log_socket = NULL;
+  int log_prio_out = 6, log_prio_err = 3;  /* info, err */
+  size_t flight_size = 0;
+  const char *flight_file = NULL;
+  const char *flight_dump_file = NULL;
+  const char *flight_read_file = NULL;
+  const char *trace_file = NULL;
+  size_t trace_size = 1048576;
+  const char *decode_trace_file = NULL;
+  const char *seek_when = NULL;
+  const char *index_file = NULL;
+  int index_on = 0;
+  unsigned long index_lines = 1000;
+  size_t index_bytes = 65536;
+  int follow = 0;
+  int prefix_given = 0;
+  int profile = 0;  /* 1 = text, 2 = JSON */
+  const char *profile_file = NULL;
+  const char *gaps_file = NULL;
+  int profile_sample_ms = 0;
+  long long next_sample = 0;
+  struct outstream out_o, err_o;
+  int nest = 0;
+  int no_nest = 0;
+  int onlcr = -1;             /* -1 = auto */
+  int nest_ctl = -1;          /* outer ind's control socket */
+  int nest_mine = -1;         /* ours, offered to the child */
+  int nest_theirs = -1;       /* the child's end of it */
+  struct nest_id child_id[2];
+  static const struct option long_options[] = {
+    { "record", required_argument, NULL, 'r' },
+    { "replay", required_argument, NULL, OPT_REPLAY },
+    { "speed",  required_argument, NULL, OPT_SPEED },
+    { "pty",    no_argument,       NULL, 't' },
+    { "winsize", required_argument, NULL, OPT_WINSIZE },
+    { "inprocess", no_argument,     NULL, OPT_INPROCESS },
+    { "log",    required_argument, NULL, OPT_LOG },
+    { "log-socket", required_argument, NULL, OPT_LOG_SOCKET },
+    { "log-priority", required_argument, NULL, OPT_LOG_PRIORITY },
+    { "flight", required_argument, NULL, OPT_FLIGHT },
+    { "flight-file", required_argument, NULL, OPT_FLIGHT_FILE },
+    { "flight-dump", required_argument, NULL, OPT_FLIGHT_DUMP },
+    { "flight-read", required_argument, NULL, OPT_FLIGHT_READ },
+    { "profile", required_argument, NULL, OPT_PROFILE },
+    { "profile-file", required_argument, NULL, OPT_PROFILE_FILE },
+    { "profile-sample", required_argument, NULL, OPT_PROFILE_SAMPLE },
+    { "dedup",  no_argument,       NULL, OPT_DEDUP },
+    { "dedup-window", required_argument, NULL, OPT_DEDUP_WINDOW },
+    { "dedup-time", no_argument,   NULL, OPT_DEDUP_TIME },
+    { "cr-compact", required_argument, NULL, OPT_CR_COMPACT },
+    { "nest",   no_argument,       NULL, OPT_NEST },
+    { "no-nest", no_argument,      NULL, OPT_NO_NEST },
+    { "onlcr",  required_argument, NULL, OPT_ONLCR },
+    { "group",  required_argument, NULL, OPT_GROUP },
+    { "group-start", required_argument, NULL, OPT_GROUP_START },
+    { "group-max", required_argument, NULL, OPT_GROUP_MAX },
+    { "group-timeout", required_argument, NULL, OPT_GROUP_TIMEOUT },
+    { "trace", required_argument, NULL, OPT_TRACE },
+    { "trace-size", required_argument, NULL, OPT_TRACE_SIZE },
+    { "decode-trace", required_argument, NULL, OPT_DECODE_TRACE },
+    { "parallel", required_argument, NULL, OPT_PARALLEL },
+    { "parallel-order", required_argument, NULL, OPT_PARALLEL_ORDER },
+    { "parallel-mem", required_argument, NULL, OPT_PARALLEL_MEM },
+    { "batch", required_argument, NULL, OPT_BATCH },
+    { "null", no_argument, NULL, OPT_NULL },
+    { "index", no_argument, NULL, OPT_INDEX },
+    { "index-file", required_argument, NULL, OPT_INDEX_FILE },
+    { "index-every", required_argument, NULL, OPT_INDEX_EVERY },
+    { "seek", required_argument, NULL, OPT_SEEK },
+    { "follow", no_argument, NULL, OPT_FOLLOW },
+    { "fd", required_argument, NULL, OPT_FD },
+    { "fd-postfix", required_argument, NULL, OPT_FD_POSTFIX },
+    { "fd-to", required_argument, NULL, OPT_FD_TO },
+    { "gaps", required_argument, NULL, OPT_GAPS },
+    { "gaps-file", required_argument, NULL, OPT_GAPS_FILE },
+    { NULL, 0, NULL, 0 }
+  };
 
   argv0 = argv[0];
   if (argv[argc]) {
@@ -783,12 +3160,14 @@ main(int argc, char **argv)
     }
   }
   
-  while (-1 != (c = getopt(argc, argv, "+hp:a:P:A:v"))) {
+  while (-1 != (c = getopt_long(argc, argv, "+hp:a:P:A:r:tv",
+                                long_options, NULL))) {
     switch(c) {
     case 'h':
       usage(0);
     case 'p':
       prefix = optarg;
+      prefix_given = 1;
       break;
     case 'a':
       postfix = optarg;
@@ -799,28 +3178,475 @@ main(int argc, char **argv)
     case 'A':
       epostfix = optarg;
       break;
+    case 'r':
+      record_file = optarg;
+      break;
+    case 't':
+      force_pty = 1;
+      break;
     case 'v':
       verbose++;
       break;
+    case OPT_WINSIZE:
+      if (2 != sscanf(optarg, "%dx%d", &force_rows, &force_cols)
+          || force_rows <= 0 || force_cols <= 0) {
+        fprintf(stderr, "%s: Invalid window size: %s\n", argv0, optarg);
+        exit(1);
+      }
+      break;
+    case OPT_INPROCESS:
+      inprocess = 1;
+      break;
+    case OPT_LOG:
+      if (!strcmp(optarg, "journal")) {
+        log_kind = LOGSINK_JOURNAL;
+      } else if (!strcmp(optarg, "syslog")) {
+        log_kind = LOGSINK_SYSLOG;
+      } else {
+        fprintf(stderr, "%s: Invalid log kind: %s\n", argv0, optarg);
+        exit(1);
+      }
+      break;
+    case OPT_LOG_SOCKET:
+      log_socket = optarg;
+      break;
+    case OPT_LOG_PRIORITY:
+      if (logsink_parse_priorities(optarg, &log_prio_out, &log_prio_err)) {
+        fprintf(stderr, "%s: Invalid log priorities: %s\n", argv0, optarg);
+        exit(1);
+      }
+      break;
+    case OPT_FLIGHT:
+      if (!(flight_size = parse_size(optarg))) {
+        fprintf(stderr, "%s: Invalid flight recorder size: %s\n",
+                argv0, optarg);
+        exit(1);
+      }
+      break;
+    case OPT_FLIGHT_FILE:
+      flight_file = optarg;
+      break;
+    case OPT_FLIGHT_DUMP:
+      flight_dump_file = optarg;
+      break;
+    case OPT_FLIGHT_READ:
+      flight_read_file = optarg;
+      break;
+    case OPT_PROFILE:
+      if (!strcmp(optarg, "text")) {
+        profile = 1;
+      } else if (!strcmp(optarg, "json")) {
+        profile = 2;
+      } else {
+        fprintf(stderr, "%s: Invalid profile format: %s\n", argv0, optarg);
+        exit(1);
+      }
+      break;
+    case OPT_PROFILE_FILE:
+      profile_file = optarg;
+      break;
+    case OPT_PROFILE_SAMPLE:
+      if (0 >= (profile_sample_ms = atoi(optarg))) {
+        fprintf(stderr, "%s: Invalid sample interval: %s\n", argv0, optarg);
+        exit(1);
+      }
+      break;
+    case OPT_CR_COMPACT: {
+      char *end;
+      cr_compact_ms = strtol(optarg, &end, 10);
+      if (end == optarg || *end || cr_compact_ms < 0) {
+        fprintf(stderr, "%s: Invalid --cr-compact interval: %s\n",
+                argv0, optarg);
+        exit(1);
+      }
+      break;
+    }
+    case OPT_NEST:
+      nest = 1;
+      break;
+    case OPT_NO_NEST:
+      no_nest = 1;
+      break;
+    case OPT_ONLCR:
+      if (!strcmp(optarg, "on")) {
+        onlcr = 1;
+      } else if (!strcmp(optarg, "off")) {
+        onlcr = 0;
+      } else if (!strcmp(optarg, "auto")) {
+        onlcr = -1;
+      } else {
+        fprintf(stderr, "%s: Invalid --onlcr setting: %s\n", argv0, optarg);
+        exit(1);
+      }
+      break;
+    case OPT_PARALLEL:
+      if (0 >= (parallel = atoi(optarg))) {
+        fprintf(stderr, "%s: Invalid --parallel: %s\n", argv0, optarg);
+        exit(1);
+      }
+      break;
+    case OPT_PARALLEL_ORDER:
+      if (!strcmp(optarg, "done")) {
+        parallel_input_order = 0;
+      } else if (!strcmp(optarg, "input")) {
+        parallel_input_order = 1;
+      } else {
+        fprintf(stderr, "%s: Invalid --parallel-order: %s\n", argv0, optarg);
+        exit(1);
+      }
+      break;
+    case OPT_PARALLEL_MEM:
+      if (!(parallel_mem = parse_size(optarg))) {
+        fprintf(stderr, "%s: Invalid --parallel-mem: %s\n", argv0, optarg);
+        exit(1);
+      }
+      break;
+    case OPT_BATCH:
+      batch_file = optarg;
+      break;
+    case OPT_NULL:
+      batch_delim = 0;
+      break;
+    case OPT_INDEX:
+      index_on = 1;
+      break;
+    case OPT_INDEX_FILE:
+      index_on = 1;
+      index_file = optarg;
+      break;
+    case OPT_INDEX_EVERY:
+      {
+        char *e;
+        index_lines = strtoul(optarg, &e, 10);
+        if (e == optarg || *e != ','
+            || !(index_bytes = parse_size(e + 1)) || !index_lines) {
+          fprintf(stderr, "%s: Invalid --index-every: %s\n", argv0, optarg);
+          exit(1);
+        }
+      }
+      index_on = 1;
+      break;
+    case OPT_SEEK:
+      seek_when = optarg;
+      break;
+    case OPT_FOLLOW:
+      follow = 1;
+      break;
+    case OPT_FD: {
+      const char *rest;
+      struct extra_fd *x = extra_get(optarg, &rest);
+      if (rest) {
+        x->prefix = rest;
+      }
+      break;
+    }
+    case OPT_FD_POSTFIX: {
+      const char *rest;
+      struct extra_fd *x = extra_get(optarg, &rest);
+      x->postfix = rest ? rest : "";
+      break;
+    }
+    case OPT_GAPS: {
+      char *end;
+      gaps_top = strtol(optarg, &end, 10);
+      if (end == optarg || *end || gaps_top <= 0) {
+        fprintf(stderr, "%s: Invalid --gaps: %s\n", argv0, optarg);
+        exit(1);
+      }
+      break;
+    }
+    case OPT_GAPS_FILE:
+      gaps_file = optarg;
+      if (!gaps_top) {
+        gaps_top = 5;
+      }
+      break;
+    case OPT_FD_TO: {
+      const char *rest;
+      struct extra_fd *x = extra_get(optarg, &rest);
+      if (!rest || !*rest) {
+        fprintf(stderr, "%s: Invalid --fd-to: %s\n", argv0, optarg);
+        exit(1);
+      }
+      x->to = rest;
+      break;
+    }
+    case OPT_TRACE:
+      trace_file = optarg;
+      break;
+    case OPT_TRACE_SIZE:
+      if (!(trace_size = parse_size(optarg))) {
+        fprintf(stderr, "%s: Invalid trace size: %s\n", argv0, optarg);
+        exit(1);
+      }
+      break;
+    case OPT_DECODE_TRACE:
+      decode_trace_file = optarg;
+      break;
+    case OPT_GROUP:
+      if (!strcmp(optarg, "block")) {
+        group_format = GROUP_BLOCK;
+      } else if (!strcmp(optarg, "json")) {
+        group_format = GROUP_JSON;
+      } else {
+        fprintf(stderr, "%s: Invalid group format: %s\n", argv0, optarg);
+        exit(1);
+      }
+      break;
+    case OPT_GROUP_START: {
+      int err;
+      if (group_start_set) {
+        regfree(&group_start);
+      }
+      if ((err = regcomp(&group_start, optarg, REG_EXTENDED | REG_NOSUB))) {
+        char msg[256];
+        regerror(err, &group_start, msg, sizeof(msg));
+        fprintf(stderr, "%s: Invalid --group-start pattern: %s\n",
+                argv0, msg);
+        exit(1);
+      }
+      group_start_set = 1;
+      break;
+    }
+    case OPT_GROUP_MAX:
+      if (!(group_max = parse_size(optarg))) {
+        fprintf(stderr, "%s: Invalid group size: %s\n", argv0, optarg);
+        exit(1);
+      }
+      break;
+    case OPT_GROUP_TIMEOUT: {
+      char *end;
+      group_timeout_ms = strtol(optarg, &end, 10);
+      if (end == optarg || *end || group_timeout_ms < 0) {
+        fprintf(stderr, "%s: Invalid --group-timeout: %s\n", argv0, optarg);
+        exit(1);
+      }
+      break;
+    }
+    case OPT_DEDUP:
+      dedup = 1;
+      break;
+    case OPT_DEDUP_WINDOW: {
+      char *end;
+      double sec = strtod(optarg, &end);
+      if (end == optarg || *end || sec <= 0) {
+        fprintf(stderr, "%s: Invalid dedup window: %s\n", argv0, optarg);
+        exit(1);
+      }
+      dedup_window_ms = sec * 1000;
+      break;
+    }
+    case OPT_DEDUP_TIME:
+      dedup_time = 1;
+      break;
+    case OPT_REPLAY:
+      replay_file = optarg;
+      break;
+    case OPT_SPEED: {
+      char *end;
+      replay_speed = strtod(optarg, &end);
+      if (end == optarg || *end) {
+        fprintf(stderr, "%s: Invalid speed: %s\n", argv0, optarg);
+        exit(1);
+      }
+      break;
+    }
     default:
       usage(1);
     }
   }
 
-  if (optind >= argc) {
+  if (flight_read_file) {
+    return flight_read(flight_read_file) ? 1 : 0;
+  }
+  if (decode_trace_file) {
+    return trace_decode(decode_trace_file) ? 1 : 0;
+  }
+  if (seek_when) {
+    if (optind + 1 != argc) {
+      usage(1);
+    }
+    return index_seek(seek_when, argv[optind], index_file) ? 1 : 0;
+  }
+  if (group_start_set && !group_format) {
+    group_format = GROUP_BLOCK;
+  }
+
+  if (batch_file ? optind < argc : optind >= argc && !replay_file) {
     usage(1);
   }
 
-  { /* bail on format errors */
-    char *tmp;
-    format(prefix, &tmp, 1);
-    free(tmp);
-    format(postfix, &tmp, 1);
-    free(tmp);
-    format(eprefix, &tmp, 1);
-    free(tmp);
-    format(epostfix, &tmp, 1);
-    free(tmp);
+  { /* bail on format errors. Strings without '%' can't be broken. */
+    const char *fmts[4];
+    int c;
+    fmts[0] = prefix;
+    fmts[1] = postfix;
+    fmts[2] = eprefix;
+    fmts[3] = epostfix;
+    for (c = 0; c < 4 + 2 * nextras; c++) {
+      const char *fmt = (c < 4) ? fmts[c]
+        : (c & 1) ? extras[(c - 4) / 2].postfix : extras[(c - 4) / 2].prefix;
+      if (strchr(fmt, '%') && ind_format_check(fmt)) {
+        fprintf(stderr, "ind: Format string '%s' is broken.\n", fmt);
+        exit(1);
+      }
+    }
+  }
+
+  /* template variables. The pid is filled in once the child exists. */
+  if (!replay_file) {
+    cmdline = join_args(&argv[optind]);
+    if (0 > gethostname(hostname, sizeof(hostname))) {
+      hostname[0] = 0;
+    }
+    hostname[sizeof(hostname) - 1] = 0;
+  }
+  /* If the terminal turns NL into CRNL anyway, the child's pty doesn't
+   * have to. Then ind sees lines just like through a pipe. */
+  if (0 > onlcr) {
+    struct termios tio;
+    onlcr = !(stdout_tty
+              && !tcgetattr(STDOUT_FILENO, &tio)
+              && (tio.c_oflag & OPOST)
+              && (tio.c_oflag & ONLCR));
+  }
+
+  if (follow) {
+    if (replay_file || (record_file && *record_file) || profile || log_kind
+        || index_on || parallel || batch_file || nextras || gaps_top) {
+      fprintf(stderr, "%s: --follow can't be combined with --replay, "
+              "--record, --profile, --log, --index, --parallel, --batch, "
+              "--fd or --gaps\n", argv0);
+      exit(1);
+    }
+    free(cmdline);
+    return follow_run(&argv[optind], argc - optind, hostname,
+                      prefix_given ? prefix : "%{file}: ", postfix);
+  }
+  if (parallel || batch_file) {
+    struct cmd_source cs;
+    int ret;
+
+    if (replay_file || (record_file && *record_file) || flight_size
+        || profile || index_on || nextras || gaps_top) {
+      fprintf(stderr, "%s: --parallel and --batch can't be combined with "
+              "--replay, --record, --flight, --profile, --index, --fd or "
+              "--gaps\n", argv0);
+      exit(1);
+    }
+    free(cmdline);
+    nest_scrub();
+    memset(&cs, 0, sizeof(cs));
+    if (batch_file) {
+      cs.delim = batch_delim;
+      if (!strcmp(batch_file, "-")) {
+        cs.f = stdin;
+      } else if (!(cs.f = fopen(batch_file, "r"))) {
+        fprintf(stderr, "%s: %s: %s\n", argv0, batch_file, strerror(errno));
+        exit(1);
+      }
+    } else {
+      cs.argv = &argv[optind];
+    }
+    if (!parallel) {
+      parallel = 1;
+    }
+    if (0 > parallel_input_order) {
+      parallel_input_order = !!batch_file;
+    }
+    if (force_pty && !stdout_tty) {
+      pool_mode = 2;
+    } else if (stdout_tty) {
+      pool_mode = 1;
+    }
+    pool_rows = force_rows;
+    pool_cols = force_cols;
+    pool_onlcr = onlcr;
+    ret = parallel_run(&cs, hostname, prefix, postfix, eprefix, epostfix);
+    if (cs.f && cs.f != stdin) {
+      fclose(cs.f);
+    }
+    free(cs.line);
+    return ret;
+  }
+
+  memset(&outvars, 0, sizeof(outvars));
+  outvars.cmd = cmdline;
+  outvars.host = hostname;
+  errvars = outvars;
+  outvars.stream = "stdout";
+  errvars.stream = "stderr";
+
+  if (!(out = ind_stream_new_vars(prefix, postfix, &outvars))
+      || !(err = ind_stream_new_vars(eprefix, epostfix, &errvars))) {
+    fprintf(stderr, "%s: Out of memory creating streams\n", argv0);
+    exit(1);
+  }
+
+  if (replay_file) {
+    struct replay_state rs;
+    rs.out = out;
+    rs.err = err;
+    return replay(replay_file, replay_speed, replay_chunk, &rs) ? 1 : 0;
+  }
+
+  /* lines can't be sent to a log, kept or compared from inside the child,
+   * and there's no child to wait for */
+  if (inprocess && !log_kind && !flight_size && !profile && !dedup
+      && 0 > cr_compact_ms && !group_format && !trace_file && !index_on
+      && !nextras && !gaps_top) {
+    inprocess_exec(&argv[optind], cmdline,
+                   prefix, postfix, eprefix, epostfix);
+    /* still here, so fall back to the normal way */
+  }
+
+  if (record_file && *record_file) {
+    if (record_open(record_file, &argv[optind])) {
+      fprintf(stderr, "%s: can't open trace file %s: %s\n",
+              argv0, record_file, strerror(errno));
+    }
+  }
+
+  /* output stages */
+  gaps_start = fair_now();
+  if (outstream_init(&out_o, STDOUT_FILENO, out)
+      || outstream_init(&err_o, STDERR_FILENO, err)
+      || (gaps_top
+          && (!(out_o.gp = gaps_new("stdout", gaps_top, gaps_start))
+              || !(err_o.gp = gaps_new("stderr", gaps_top, gaps_start))))) {
+    fprintf(stderr, "%s: Out of memory setting up output\n", argv0);
+    exit(1);
+  }
+
+  if (trace_file && trace_open(trace_file, trace_size)) {
+    fprintf(stderr, "%s: can't set up trace in %s: %s\n",
+            argv0, trace_file, strerror(errno));
+    exit(1);
+  }
+  if (flight_size) {
+    if (flight_open(flight_file, flight_size)) {
+      fprintf(stderr, "%s: can't set up flight recorder: %s\n",
+              argv0, strerror(errno));
+    }
+    signal(SIGUSR1, sig_flight_dump);
+  }
+
+  /* Under another ind, hand the output over to it so that it makes one
+   * hop however deep the nesting. Not if it has to pass through us. */
+  if (!no_nest && !(record_file && *record_file) && !log_kind
+      && !flight_size && !profile && !dedup && 0 > cr_compact_ms
+      && !group_format && !trace_file && !index_on && !nextras
+      && !gaps_top) {
+    nest_ctl = nest_find();
+  }
+  if (0 > nest_ctl) {
+    nest_scrub();
+  }
+  if (0 > nest_ctl && nest) {
+    if (0 > (nest_mine = nest_offer(&nest_theirs)) && verbose) {
+      fprintf(stderr, "%s: can't create nesting socket: %s\n",
+              argv0, strerror(errno));
+    }
   }
 
   /* create communication pipes (stderr is always in a pipe) */
@@ -828,27 +3654,34 @@ main(int argc, char **argv)
     int pip_stdin[2];
     int pip_stdout[2];
 
-    if (isatty(STDIN_FILENO)) {
-      setup_pty(prefix, postfix, STDIN_FILENO, &ptym_in, &ptys_in);
+    if (stdin_tty && 0 > nest_ctl) {
+      setup_pty(out, STDIN_FILENO, onlcr, &ptym_in, &ptys_in);
     }
     
     /* only allocate a new pty if stdout is not the same terminal as stdin */
-    if (isatty(STDOUT_FILENO)) {
-      if (0 <= ptym_in) {
-	char *ttyin, *ttyout;
-	ttyin = strdup(ttyname(STDIN_FILENO));
-	ttyout = strdup(ttyname(STDOUT_FILENO));
-	if (!strcmp(ttyin, ttyout)) {
-	  ptym_out = ptym_in;
-	  ptys_out = ptys_in;
-	}
+    if (force_pty && !stdout_tty) {
+      setup_forced_pty(out, force_rows, force_cols,
+                       &ptym_out, &ptys_out);
+    } else if (stdout_tty) {
+      if (0 <= ptym_in && same_tty(STDIN_FILENO, STDOUT_FILENO)) {
+        ptym_out = ptym_in;
+        ptys_out = ptys_in;
       }
       if (0 > ptym_out) {
-	setup_pty(prefix, postfix, STDOUT_FILENO, &ptym_out, &ptys_out);
+	setup_pty(out, STDOUT_FILENO, onlcr, &ptym_out, &ptys_out);
       }
     }
 
-    if (isatty(STDIN_FILENO)) {
+    if (0 <= nest_ctl) {
+      /* the child reads our stdin itself */
+      if (0 > (child_stdin = dup(STDIN_FILENO))) {
+	fprintf(stderr, "%s: dup(stdin) failed: %s\n", argv[0],
+		strerror(errno));
+	exit(1);
+      }
+      ind_stdin = -1;
+      stdin_fileno = -1;
+    } else if (stdin_tty) {
       child_stdin = ptys_in;
       ind_stdin = ptym_in;
     } else {
@@ -858,9 +3691,14 @@ main(int argc, char **argv)
       }
       child_stdin = pip_stdin[0];
       ind_stdin = pip_stdin[1];
+#ifdef F_SETPIPE_SZ
+      /* bulk input moves in fewer, larger chunks with a bigger pipe. Not
+       * being allowed to is fine. */
+      fcntl(ind_stdin, F_SETPIPE_SZ, 1048576);
+#endif
     }
 
-    if (isatty(STDOUT_FILENO)) {
+    if (0 <= ptym_out) {
       child_stdout = ptys_out;
       ind_stdout = ptym_out;
     } else {
@@ -892,15 +3730,60 @@ main(int argc, char **argv)
     ind_stderr = es[0];
   }
 
-  switch ((childpid = fork())) {
-  case 0:
-    do_close3(ind_stdin, ind_stdout, ind_stderr);
-    child(child_stdin, child_stdout, child_stderr, &argv[optind]);
-  case -1:
-    fprintf(stderr, "%s: fork() failed: %s\n", argv[0], strerror(errno));
+  extras_setup();
+
+  ind_stdin_tty = (0 <= ind_stdin) && isatty(ind_stdin);
+  memset(child_id, 0, sizeof(child_id));
+  nest_id_get(child_stdout, &child_id[0]);
+  nest_id_get(child_stderr, &child_id[1]);
+
+  childpid = spawn_child(child_stdin, child_stdout, child_stderr,
+                         ind_stdin, ind_stdout, ind_stderr,
+                         &argv[optind]);
+  do_close3(child_stdin, child_stdout, child_stderr);
+  do_close(nest_theirs);
+  if (profile) {
+    profile_start(childpid);
+  } else {
+    profile_sample_ms = 0;
+  }
+
+  outvars.pid = errvars.pid = childpid;
+  if (ind_stream_set_vars(out, &outvars)
+      || ind_stream_set_vars(err, &errvars)) {
+    fprintf(stderr, "%s: Out of memory setting up streams\n", argv0);
     exit(1);
   }
-  do_close3(child_stdin, child_stdout, child_stderr);
+  extras_start(&outvars);
+
+  if (0 <= nest_ctl) {
+    if (nested_handover(nest_ctl, ind_stdout, ind_stderr, child_id,
+                        prefix, postfix, eprefix, epostfix,
+                        &outvars, &errvars)) {
+      /* not taken, so it's ours after all */
+      do_close(nest_ctl);
+      nest_ctl = -1;
+    } else {
+      nested_wait(childpid, ptym_out, out);
+      do_close(ind_stdout);
+      do_close(ind_stderr);
+      ind_stdout = ind_stderr = -1;
+    }
+  }
+  if (0 <= nest_mine
+      && (nested_add_root(&child_id[0], prefix, postfix, &outvars,
+                          RECORD_STDOUT, STDOUT_FILENO)
+          || nested_add_root(&child_id[1], eprefix, epostfix, &errvars,
+                             RECORD_STDERR, STDERR_FILENO))) {
+    fprintf(stderr, "%s: Out of memory setting up streams\n", argv0);
+    exit(1);
+  }
+
+  if (log_kind && logsink_open(log_kind, log_socket, argv[optind], childpid,
+                               log_prio_out, log_prio_err)) {
+    fprintf(stderr, "%s: can't connect to log socket %s: %s\n",
+            argv0, log_socket ? log_socket : "(default)", strerror(errno));
+  }
 
   if (verbose > 1) {
     fprintf(stderr, "%s: childpid: %d\n", argv[0], childpid);
@@ -909,16 +3792,17 @@ main(int argc, char **argv)
     terminfo(2);
   }
   /* Raw stdin */
-  if (tcgetattr(stdin_fileno, &orig_stdin_tio)) {
+  if (!stdin_tty || tcgetattr(stdin_fileno, &orig_stdin_tio)) {
     /* if we can't get stdin attrs, don't even try to set them */
   } else {
     struct termios tio;
 
     orig_stdin_tio_ok = 1;
 
-    if (!tcgetattr(stdin_fileno, &tio)) {
+    memcpy(&tio, &orig_stdin_tio, sizeof(tio));
+    {
       tio.c_iflag &= ~(IGNBRK|BRKINT|PARMRK|ISTRIP|IXON);
-      if (isatty(STDOUT_FILENO)) {
+      if (stdout_tty) {
 	tio.c_lflag &= ~(ECHO|ECHONL);
 	tio.c_iflag &= ~(INLCR|IGNCR|ICRNL);
 	tio.c_lflag &= ~(ICANON);
@@ -945,9 +3829,29 @@ main(int argc, char **argv)
   signal(SIGWINCH, sig_window_resize);
   signal(SIGCONT, sig_window_resize);
 
+  if (0 > nest_ctl) {
+    sinks_open();
+  }
+  if (index_on) {
+    struct stat st;
+    if (fstat(STDOUT_FILENO, &st) || !S_ISREG(st.st_mode)) {
+      fprintf(stderr, "%s: --index needs stdout to be a file\n", argv0);
+      exit(1);
+    }
+    if (!(indexes[STDOUT_FILENO] = index_open(STDOUT_FILENO, index_file,
+                                              index_lines, index_bytes))) {
+      fprintf(stderr, "%s: can't open index: %s\n", argv0, strerror(errno));
+      exit(1);
+    }
+    if (sinks[STDERR_FILENO] == sinks[STDOUT_FILENO]) {
+      indexes[STDERR_FILENO] = indexes[STDOUT_FILENO];
+    }
+  }
+
   /* main loop */
   for(;;) {
-    fd_set fds;
+    fd_set fds, wfds;
+    struct timeval tv, *tvp = NULL;
     int n;
     int fdmax;
 
@@ -956,33 +3860,51 @@ main(int argc, char **argv)
     /*
      * done when both channels to/from child are closed
      */
-    if (isatty(stdin_fileno)) {
+    if (stdin_fileno != -1 && stdin_tty) {
       if (ind_stdin == -1
 	  && ind_stdout == -1
-	  && ind_stderr == -1) {
+	  && ind_stderr == -1
+	  && !nested_fds
+	  && !extras_open()) {
 	break;
       }
     } else {
       if (stdin_fileno == -1
 	  && ind_stdin == -1
 	  && ind_stdout == -1
-	  && ind_stderr == -1) {
+	  && ind_stderr == -1
+	  && !nested_fds
+	  && !extras_open()) {
 	break;
       }
     }
 
+    /* don't read what can't be written, and write what's queued */
     FD_ZERO(&fds);
-    do_fdset(&fds, ind_stdout, &fdmax);
-    do_fdset(&fds, ind_stderr, &fdmax);
+    FD_ZERO(&wfds);
+    if (!output_blocked(&out_o)) {
+      do_fdset(&fds, ind_stdout, &fdmax);
+      do_fdset(&fds, ind_stdin, &fdmax);
+    }
+    if (!output_blocked(&err_o)) {
+      do_fdset(&fds, ind_stderr, &fdmax);
+    }
     do_fdset(&fds, stdin_fileno, &fdmax);
-    do_fdset(&fds, ind_stdin, &fdmax);
-
-    if (verbose > 1) {
-      fprintf(stderr, "%s: select(%d %d %d %d)\n", argv0,
-	      ind_stdin,
-	      ind_stdout,
-	      ind_stderr,
-	      stdin_fileno);
+    do_fdset(&fds, nest_mine, &fdmax);
+    for (c = 0; c < nnested; c++) {
+      if (!output_blocked(&nested[c].o)) {
+        do_fdset(&fds, nested[c].fd, &fdmax);
+      }
+    }
+    for (c = 0; c < nextras; c++) {
+      if (!output_blocked(extras[c].o)) {
+        do_fdset(&fds, extras[c].fd, &fdmax);
+      }
+    }
+    for (c = STDOUT_FILENO; c <= STDERR_FILENO; c++) {
+      if (sinks[c] && sink_queued(sinks[c])) {
+        do_fdset(&wfds, sink_fd(sinks[c]), &fdmax);
+      }
     }
 
     /* resize window, if needed */
@@ -994,13 +3916,76 @@ main(int argc, char **argv)
        *       catch it until the next iteration.
        */
       if (sigwinchcount != last_sigwinchcount) {
-        update_window_size(ind_stdin, STDIN_FILENO, prefix, postfix);
-        update_window_size(ind_stdout, STDOUT_FILENO, prefix, postfix);
+        update_window_size(ind_stdin, STDIN_FILENO, out);
+        update_window_size(ind_stdout, STDOUT_FILENO, out);
         last_sigwinchcount = sigwinchcount;
       }
     }
+
+    /* dump flight recorder, if asked to */
+    {
+      static sig_atomic_t last_usr1count = 0;
+      sig_atomic_t usr1count = sig_usr1_counter;
+      if (usr1count != last_usr1count) {
+        flight_dump(flight_dump_file, "SIGUSR1");
+        last_usr1count = usr1count;
+      }
+    }
     
-    n = select(fdmax + 1, &fds, NULL, NULL, NULL);
+    /* timed work: profile sampling, and output stages */
+    if (profile_sample_ms || dedup || 0 <= cr_compact_ms || group_format) {
+      long long now = mono_ms();
+      long long wake = -1;
+      if (profile_sample_ms) {
+        if (now >= next_sample) {
+          profile_sample();
+          next_sample = now + profile_sample_ms;
+        }
+        wake = next_sample;
+      }
+      {
+        struct outstream *os[2];
+        int i;
+        os[0] = &out_o;
+        os[1] = &err_o;
+        for (i = 0; i < 2; i++) {
+          long long t = output_tick(os[i], now);
+          if (0 <= t && (wake < 0 || t < wake)) {
+            wake = t;
+          }
+        }
+        for (i = 0; i < nnested; i++) {
+          long long t;
+          if (0 > nested[i].fd) {
+            continue;
+          }
+          t = output_tick(&nested[i].o, now);
+          if (0 <= t && (wake < 0 || t < wake)) {
+            wake = t;
+          }
+        }
+        for (i = 0; i < nextras; i++) {
+          long long t;
+          if (0 > extras[i].fd) {
+            continue;
+          }
+          t = output_tick(extras[i].o, now);
+          if (0 <= t && (wake < 0 || t < wake)) {
+            wake = t;
+          }
+        }
+      }
+      if (0 <= wake) {
+        tv.tv_sec = (wake - now) / 1000;
+        tv.tv_usec = ((wake - now) % 1000) * 1000;
+        tvp = &tv;
+      }
+    }
+
+    TRACE(select, -1, fdmax + 1,
+          tvp ? tvp->tv_sec * 1000LL + tvp->tv_usec / 1000 : -1LL);
+    n = select(fdmax + 1, &fds, &wfds, NULL, tvp);
+    TRACE(wake, -1, n, 0 > n ? errno : 0);
 
     if (0 > n) {
       switch (errno) {
@@ -1013,42 +3998,27 @@ main(int argc, char **argv)
       continue;
     }
 
-    if (verbose > 1) {
-      fprintf(stderr, "%s: select(): %d\n", argv0, n);
-      if (ind_stdin != -1 && FD_ISSET(ind_stdin, &fds)) {
-	fprintf(stderr,"%s: \tfd: ind_stdin (%d) %d readable\n",
-		argv0,ind_stdin, isatty(ind_stdin));
-      }
-      if (ind_stdout != -1 && FD_ISSET(ind_stdout, &fds)) {
-	fprintf(stderr,"%s: \tfd: ind_stdout (%d) readable\n",
-		argv0,ind_stdout);
-      }
-      if (ind_stderr != -1 && FD_ISSET(ind_stderr, &fds)) {
-	fprintf(stderr,"%s: \tfd: ind_stderr (%d) readable\n",
-		argv0,ind_stderr);
-      }
-      if (stdin_fileno != -1 && FD_ISSET(stdin_fileno, &fds)) {
-	fprintf(stderr, "%s: \tfd: stdin_fileno (%d) readable\n",argv0,
-		stdin_fileno);
+    for (c = STDOUT_FILENO; c <= STDERR_FILENO; c++) {
+      if (sinks[c] && FD_ISSET(sink_fd(sinks[c]), &wfds)) {
+        /* errors show up on the next write */
+        sink_drain(sinks[c]);
       }
     }
 
     if (ind_stdin != ind_stdout
-	&& isatty(stdin_fileno) && !isatty(ind_stdin)) {
+	&& (stdin_fileno != -1 && stdin_tty)
+	&& !(ind_stdin != -1 && ind_stdin_tty)) {
       do_close(ind_stdin);
       ind_stdin = -1;
     }
     
     /* if stdin != stdout then echo anything read from stdin to stdout */
     if ((-1 < ind_stdin)
-	&& isatty(ind_stdin)
+	&& ind_stdin_tty
 	&& (ind_stdin != ind_stdout)
 	&& FD_ISSET(ind_stdin, &fds)) {
-      if (verbose > 1) {
-	fprintf(stderr, "%s: read()ing ind_stdin\n", argv0);
-      }
-      if (isatty(ind_stdout)) {
-	if (process(ind_stdin, STDOUT_FILENO, prefix, postfix, &emptyline)) {
+      if (stdout_tty) {
+	if (0 > process(ind_stdin, RECORD_ECHO, &out_o, 4096)) {
 	  ind_stdin = -1;
 	}
       } else {
@@ -1061,40 +4031,144 @@ main(int argc, char **argv)
       }
     }
 
-    if (-1 < ind_stdout && FD_ISSET(ind_stdout, &fds)) {
-      if (verbose > 1) {
-	fprintf(stderr, "%s: read()ing ind_stdout\n", argv0);
+    /* child output, and output handed over by nested inds. Closed nested
+     * ones are replaced by the last, which has already been looked at.
+     * --fd ones are -3 and down. */
+    {
+      /* not alloca(), that would only be given back when main() returns */
+      static struct fair_src *srcs = NULL;
+      static int *which = NULL;
+      static int srcs_size = 0;
+      long long now = fair_now();
+      int urgent[2];
+      int nsrcs = 0;
+
+      if (srcs_size < 2 + nnested + nextras) {
+        srcs_size = 2 + nnested + nextras;
+        if (!(srcs = realloc(srcs, srcs_size * sizeof(*srcs)))
+            || !(which = realloc(which, srcs_size * sizeof(*which)))) {
+          fprintf(stderr, "%s: Out of memory\n", argv0);
+          exit(1);
+        }
       }
-      if (process(ind_stdout, STDOUT_FILENO, prefix, postfix,&emptyline)) {
-	if (ind_stdin == ind_stdout) {
-	  ind_stdin = -1;
-	}
-	ind_stdout = -1;
+
+      if (-1 < ind_stdout && FD_ISSET(ind_stdout, &fds)) {
+        fair_src_init(&srcs[nsrcs], ind_stdout, FAIR_WEIGHT_STDOUT,
+                       &lat_stdout, &out_o, now);
+        which[nsrcs++] = -1;
       }
-      if (verbose > 1) {
-        fprintf(stderr, "%s: \tdone read()ing ind_stdout\n", argv0);
+      if (-1 < ind_stderr && FD_ISSET(ind_stderr, &fds)) {
+        fair_src_init(&srcs[nsrcs], ind_stderr, FAIR_WEIGHT_STDERR,
+                       &lat_stderr, &err_o, now);
+        which[nsrcs++] = -2;
       }
-    }
-
-    if (-1 < ind_stderr && FD_ISSET(ind_stderr, &fds)) {
-      if (verbose > 1) {
-	fprintf(stderr, "%s: read()ing ind_stderr\n", argv0);
+      for (c = 0; c < nnested; c++) {
+        if (0 > nested[c].fd || !FD_ISSET(nested[c].fd, &fds)) {
+          continue;
+        }
+        fair_src_init(&srcs[nsrcs], nested[c].fd,
+                       (nested[c].stream == RECORD_STDERR)
+                       ? FAIR_WEIGHT_STDERR : FAIR_WEIGHT_STDOUT,
+                       &lat_nested, &nested[c].o, now);
+        which[nsrcs++] = c;
       }
-      if (process(ind_stderr, STDERR_FILENO, eprefix, epostfix, &eemptyline)) {
-	ind_stderr = -1;
+      for (c = 0; c < nextras; c++) {
+        if (0 > extras[c].fd || !FD_ISSET(extras[c].fd, &fds)) {
+          continue;
+        }
+        fair_src_init(&srcs[nsrcs], extras[c].fd,
+                       (extras[c].dest == STDERR_FILENO)
+                       ? FAIR_WEIGHT_STDERR : FAIR_WEIGHT_STDOUT,
+                       &extras[c].lat, extras[c].o, now);
+        which[nsrcs++] = -3 - c;
       }
-      if (verbose > 1) {
-        fprintf(stderr, "%s: \tdone read()ing ind_stderr\n", argv0);
+
+      /* only a terminal is the user typing, piped stdin is just more work */
+      urgent[0] = stdin_tty ? stdin_fileno : -1;
+      urgent[1] = (ind_stdin_tty && ind_stdin != ind_stdout) ? ind_stdin : -1;
+      fair_run(srcs, nsrcs, urgent, 2, source_read, NULL);
+
+      for (c = nsrcs - 1; c >= 0; c--) {
+        if (!srcs[c].done) {
+          continue;
+        }
+        if (which[c] == -1) {
+          if (ind_stdin == ind_stdout) {
+            ind_stdin = -1;
+          }
+          ind_stdout = -1;
+        } else if (which[c] == -2) {
+          ind_stderr = -1;
+        } else if (which[c] <= -3) {
+          do_close(extras[-3 - which[c]].fd);
+          extras[-3 - which[c]].fd = -1;
+        } else {
+          nested_clear(&nested[which[c]]);
+          nested[which[c]] = nested[--nnested];
+        }
       }
     }
+    if (0 <= nest_mine && FD_ISSET(nest_mine, &fds)) {
+      nested_accept(nest_mine);
+    }
 
     if (-1 < stdin_fileno && FD_ISSET(stdin_fileno, &fds)) {
-      char buf[128];
+      static char buf[65536];
       ssize_t n;
-      if (verbose > 1) {
-	fprintf(stderr, "%s: read()ing stdin_fileno\n", argv0);
+#ifdef HAVE_SPLICE
+      /* move data straight from stdin into the child's stdin pipe, without
+       * copying it through userspace */
+      if (use_splice && -1 < ind_stdin) {
+        sigset_t pipeset, oldset;
+        int save;
+
+        /* splice() raises SIGPIPE if the child is gone, even when there
+         * was nothing to move. Take that as the child being done with
+         * its stdin instead. */
+        sigemptyset(&pipeset);
+        sigaddset(&pipeset, SIGPIPE);
+        sigprocmask(SIG_BLOCK, &pipeset, &oldset);
+        do {
+          n = splice(stdin_fileno, NULL, ind_stdin, NULL, sizeof(buf),
+                     SPLICE_F_MOVE | SPLICE_F_MORE);
+        } while (0 > n && errno == EINTR);
+        save = errno;
+        TRACE(read, stdin_fileno, n, 0 > n ? save : 0);
+        if (0 > n && save == EPIPE && !sigismember(&oldset, SIGPIPE)) {
+          struct timespec zero = { 0, 0 };
+          sigtimedwait(&pipeset, NULL, &zero);
+        }
+        sigprocmask(SIG_SETMASK, &oldset, NULL);
+        errno = save;
+        if (0 > n && errno == EPIPE) {
+          n = 0;
+        }
+        if (0 > n && (errno == EINVAL || errno == ENOSYS)) {
+          /* not supported for this kind of fd */
+          use_splice = 0;
+          continue;
+        }
+        if (0 > n && errno != EAGAIN) {
+          fprintf(stderr, "%s: splice(stdin -> child stdin): %d %s\n",
+                  argv0, errno, strerror(errno));
+          reset_stdin_terminal();
+          exit(1);
+        }
+        if (!n) {
+          stdin_fileno = -1;
+          do_close(ind_stdin);
+          ind_stdin = -1;
+        }
+        continue;
+      }
+#endif
+      n = read(stdin_fileno, buf, stdin_tty ? 128 : sizeof(buf));
+      TRACE(read, stdin_fileno, n, 0 > n ? errno : 0);
+      if (0 > n && (errno == EAGAIN || errno == EINTR)) {
+        /* ind doesn't make stdin non-blocking, but whatever else shares
+         * it (e.g. the same terminal as another program's stdout) may */
+        continue;
       }
-      n = read(stdin_fileno, buf, sizeof(buf));
       if (0 > n) {
 	fprintf(stderr, "%s: read(stdin_fileno): %d %s",
 		argv0, errno, strerror(errno));
@@ -1122,17 +4196,67 @@ main(int argc, char **argv)
     fprintf(stderr, "%s: resetting terminal\n", argv0);
   }
   reset_stdin_terminal();
+  sinks_close();
+  index_close(indexes[STDOUT_FILENO]);
+  profile_read_delay("stdout", lat_stdout.count, lat_stdout.total,
+                     lat_stdout.max);
+  profile_read_delay("stderr", lat_stderr.count, lat_stderr.total,
+                     lat_stderr.max);
+  if (lat_nested.count) {
+    profile_read_delay("nested", lat_nested.count, lat_nested.total,
+                       lat_nested.max);
+  }
+  for (c = 0; c < nextras; c++) {
+    profile_read_delay(extras[c].name, extras[c].lat.count,
+                       extras[c].lat.total, extras[c].lat.max);
+  }
+  if (gaps_top) {
+    long long now = fair_now();
+    gaps_end(out_o.gp, now);
+    gaps_report(out_o.gp, gaps_file);
+    gaps_end(err_o.gp, now);
+    gaps_report(err_o.gp, gaps_file);
+    for (c = 0; c < nextras; c++) {
+      gaps_end(extras[c].o->gp, now);
+      gaps_report(extras[c].o->gp, gaps_file);
+    }
+  }
+  extras_close();
+  record_close();
+  logsink_close();
 
   {
     int status;
+    struct rusage ru;
+    pid_t ret;
     if (verbose > 1) {
       fprintf(stderr, "%s: waitpid(%d)\n", argv0, childpid);
     }
-    if (-1 == waitpid(childpid, &status, 0)) {
+    memset(&ru, 0, sizeof(ru));
+#ifdef HAVE_WAIT4
+    ret = wait4(childpid, &status, 0, &ru);
+#else
+    ret = waitpid(childpid, &status, 0);
+    getrusage(RUSAGE_CHILDREN, &ru);
+#endif
+    if (-1 == ret) {
       fprintf(stderr, "%s: waitpid(%d): %d %s", argv0,
 	      childpid, errno, strerror(errno));
       status = 1;
+    } else if (profile) {
+      profile_report(profile_file, profile == 2, cmdline, status, &ru);
+    }
+    if (WIFSIGNALED(status) || (WIFEXITED(status) && WEXITSTATUS(status))) {
+      char why[64];
+      if (WIFSIGNALED(status)) {
+        snprintf(why, sizeof(why), "killed by signal %d", WTERMSIG(status));
+      } else {
+        snprintf(why, sizeof(why), "exit status %d", WEXITSTATUS(status));
+      }
+      flight_dump(flight_dump_file, why);
     }
+    flight_close();
+    trace_close();
     if (verbose > 1) {
       fprintf(stderr, "%s: exiting\n", argv0);
     }
@@ -0,0 +1,547 @@
+/* ind/ind_preload.c - LD_PRELOAD shim for ind --inprocess
+ *
+ * (BSD license without advertising clause below)
+ *
+ * Copyright (c) 2019 Thomas Habets <thomas@habets.se>. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+/*
+ * Loaded into the child by "ind --inprocess". Decorates everything
+ * written to ind's stdout and stderr in-process, instead of going through
+ * a pty or pipe to a separate ind process.
+ *
+ * Which fds are "ind's stdout and stderr" is decided at load time by
+ * comparing fd 1 and 2 with the device/inode ind passed along, so that
+ * for example output captured by a shell's $(...) is left alone. After
+ * that dup()s and close()s are followed.
+ *
+ * Direct write()/writev() calls are covered everywhere. stdio in glibc
+ * does not write through the interposable write(), so with glibc stdout
+ * and stderr are replaced with fopencookie() streams with the same
+ * buffering they would have had. That relies on glibc's FILE layout (see
+ * preload_stdio()); with other libcs stdio is left alone, and only what
+ * goes through write()/writev() is decorated.
+ *
+ * Line state is per process, so output from several processes that
+ * share a line can get a prefix in the middle of it.
+ *
+ * Configured by the environment variables set by ind:
+ *   IND_PRELOAD_PREFIX, IND_PRELOAD_POSTFIX     stdout formats
+ *   IND_PRELOAD_EPREFIX, IND_PRELOAD_EPOSTFIX   stderr formats
+ *   IND_PRELOAD_STDOUT, IND_PRELOAD_STDERR      "<dev>:<ino>" of ind's
+ *                                               stdout and stderr
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "libind.h"
+
+typedef ssize_t (*write_t)(int, const void *, size_t);
+typedef ssize_t (*writev_t)(int, const struct iovec *, int);
+typedef int (*dup_t)(int);
+typedef int (*dup2_t)(int, int);
+typedef int (*dup3_t)(int, int, int);
+typedef int (*fcntl_t)(int, int, ...);
+typedef int (*close_t)(int);
+
+static write_t real_write;
+static writev_t real_writev;
+static dup_t real_dup;
+static dup2_t real_dup2;
+static dup3_t real_dup3;
+static fcntl_t real_fcntl;
+static fcntl_t real_fcntl64;
+static close_t real_close;
+
+/* decoration state for ind's stdout (1) and stderr (2) */
+struct preload_fd {
+  struct ind_stream *s;
+  pthread_mutex_t lock;
+};
+static struct preload_fd fds[3] = {
+  { NULL, PTHREAD_MUTEX_INITIALIZER },
+  { NULL, PTHREAD_MUTEX_INITIALIZER },
+  { NULL, PTHREAD_MUTEX_INITIALIZER },
+};
+
+/* set while this thread holds one of the locks above. A signal handler
+ * that writes in the middle of that gets its output undecorated, instead
+ * of waiting for a lock that is never given back. */
+static __thread int preload_busy;
+
+/* which of the above each fd writes to, 0 for none */
+#define FDMAP_SIZE 1024
+static volatile unsigned char fdmap[FDMAP_SIZE];
+
+/* the real function, looked up on first use */
+#define REAL(name) \
+  (*(name##_t*)preload_sym((void**)&real_##name, #name))
+
+/**
+ * Look up symbol in the next library, unless already done
+ *
+ * @return  slot, which is set to the symbol (or NULL)
+ */
+static void **
+preload_sym(void **slot, const char *name)
+{
+  if (!*slot) {
+    *slot = dlsym(RTLD_NEXT, name);
+  }
+  return slot;
+}
+
+/**
+ * Write the whole iovec list with the real writev()
+ */
+static int
+preload_writev_all(int fd, struct iovec *iov, int iovcnt)
+{
+  ssize_t ret;
+
+  while (iovcnt > 0) {
+    do {
+      ret = real_writev(fd, iov, iovcnt);
+    } while ((-1 == ret) && (errno == EINTR));
+    if (ret <= 0) {
+      return -1;
+    }
+    while (iovcnt > 0 && (size_t)ret >= iov->iov_len) {
+      ret -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = (char*)iov->iov_base + ret;
+      iov->iov_len -= ret;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Decorate and write. Caller holds the fd lock.
+ */
+static ssize_t
+preload_decorate(struct preload_fd *p, int fd, const char *buf, size_t len)
+{
+  size_t left = len;
+  struct iovec *iov;
+  int iovcnt;
+  size_t n;
+
+  while (left) {
+    n = ind_stream_feed(p->s, buf, left, &iov, &iovcnt);
+    if (preload_writev_all(fd, iov, iovcnt)) {
+      return (left == len) ? -1 : (ssize_t)(len - left);
+    }
+    buf += n;
+    left -= n;
+  }
+  return len;
+}
+
+/**
+ * Take the fd lock, unless this thread already holds one
+ *
+ * @return  0 if taken, -1 if output should go out undecorated
+ */
+static int
+preload_lock(struct preload_fd *p)
+{
+  if (preload_busy) {
+    return -1;
+  }
+  preload_busy = 1;
+  pthread_mutex_lock(&p->lock);
+  return 0;
+}
+
+/**
+ * Give back the fd lock taken with preload_lock()
+ */
+static void
+preload_unlock(struct preload_fd *p)
+{
+  pthread_mutex_unlock(&p->lock);
+  preload_busy = 0;
+}
+
+/**
+ * Hold all the locks over fork(), so that the new process doesn't start
+ * out with one held by a thread it doesn't have
+ */
+static void
+preload_prefork(void)
+{
+  pthread_mutex_lock(&fds[STDOUT_FILENO].lock);
+  pthread_mutex_lock(&fds[STDERR_FILENO].lock);
+}
+
+/**
+ * Give back the locks after fork(), in both processes
+ */
+static void
+preload_postfork(void)
+{
+  pthread_mutex_unlock(&fds[STDERR_FILENO].lock);
+  pthread_mutex_unlock(&fds[STDOUT_FILENO].lock);
+}
+
+/**
+ * Get decoration state for fd, or NULL if it's not to be decorated
+ */
+static struct preload_fd *
+preload_get(int fd)
+{
+  int s;
+  if (fd < 0 || fd >= FDMAP_SIZE || !(s = fdmap[fd])) {
+    return NULL;
+  }
+  return fds[s].s ? &fds[s] : NULL;
+}
+
+/**
+ * Follow fd 'from' being duplicated to 'to'
+ */
+static void
+preload_dup(int from, int to)
+{
+  if (to < 0 || to >= FDMAP_SIZE) {
+    return;
+  }
+  fdmap[to] = (from >= 0 && from < FDMAP_SIZE) ? fdmap[from] : 0;
+}
+
+/**
+ * Interposed write()
+ */
+ssize_t
+write(int fd, const void *buf, size_t len)
+{
+  struct preload_fd *p;
+  ssize_t ret;
+
+  if (!(p = preload_get(fd)) || preload_lock(p)) {
+    return REAL(write)(fd, buf, len);
+  }
+  ret = preload_decorate(p, fd, buf, len);
+  preload_unlock(p);
+  return ret;
+}
+
+/**
+ * Interposed writev()
+ */
+ssize_t
+writev(int fd, const struct iovec *iov, int iovcnt)
+{
+  struct preload_fd *p;
+  ssize_t ret = 0;
+  int c;
+
+  if (!(p = preload_get(fd)) || preload_lock(p)) {
+    return REAL(writev)(fd, iov, iovcnt);
+  }
+  for (c = 0; c < iovcnt; c++) {
+    ssize_t n = preload_decorate(p, fd, iov[c].iov_base, iov[c].iov_len);
+    if (n < 0) {
+      if (!ret) {
+        ret = -1;
+      }
+      break;
+    }
+    ret += n;
+    if ((size_t)n != iov[c].iov_len) {
+      break;
+    }
+  }
+  preload_unlock(p);
+  return ret;
+}
+
+/**
+ * Interposed dup()
+ */
+int
+dup(int fd)
+{
+  int ret = REAL(dup)(fd);
+  preload_dup(fd, ret);
+  return ret;
+}
+
+/**
+ * Interposed dup2()
+ */
+int
+dup2(int fd, int fd2)
+{
+  int ret = REAL(dup2)(fd, fd2);
+  if (ret >= 0) {
+    preload_dup(fd, ret);
+  }
+  return ret;
+}
+
+/**
+ * Interposed dup3()
+ */
+int
+dup3(int fd, int fd2, int flags)
+{
+  int ret = REAL(dup3)(fd, fd2, flags);
+  if (ret >= 0) {
+    preload_dup(fd, ret);
+  }
+  return ret;
+}
+
+/**
+ * Common part of the fcntl() wrappers. Only F_DUPFD* are of interest,
+ * but the argument has to be passed on for all commands.
+ */
+static int
+preload_fcntl(fcntl_t f, int fd, int cmd, void *arg)
+{
+  int ret = f(fd, cmd, arg);
+  if (ret >= 0 && (cmd == F_DUPFD
+#ifdef F_DUPFD_CLOEXEC
+                   || cmd == F_DUPFD_CLOEXEC
+#endif
+                   )) {
+    preload_dup(fd, ret);
+  }
+  return ret;
+}
+
+/**
+ * Interposed fcntl()
+ */
+int
+fcntl(int fd, int cmd, ...)
+{
+  va_list ap;
+  void *arg;
+
+  va_start(ap, cmd);
+  arg = va_arg(ap, void *);
+  va_end(ap);
+  return preload_fcntl(REAL(fcntl), fd, cmd, arg);
+}
+
+/**
+ * Interposed fcntl64(), which is what fcntl() is with large file support
+ * in newer glibc
+ */
+int
+fcntl64(int fd, int cmd, ...)
+{
+  va_list ap;
+  void *arg;
+
+  if (!real_fcntl64
+      && !(real_fcntl64 = (fcntl_t)dlsym(RTLD_NEXT, "fcntl64"))) {
+    real_fcntl64 = REAL(fcntl);
+  }
+  va_start(ap, cmd);
+  arg = va_arg(ap, void *);
+  va_end(ap);
+  return preload_fcntl(real_fcntl64, fd, cmd, arg);
+}
+
+/**
+ * Interposed close()
+ */
+int
+close(int fd)
+{
+  if (fd >= 0 && fd < FDMAP_SIZE) {
+    fdmap[fd] = 0;
+  }
+  return REAL(close)(fd);
+}
+
+/* fopencookie() streams standing in for stdout and stderr. Only done
+ * where fileno() can be made to work on them, see preload_stdio(). */
+#if defined(HAVE_FOPENCOOKIE) && defined(__GLIBC__) && __GLIBC__ == 2
+#define PRELOAD_STDIO 1
+#endif
+
+#ifdef PRELOAD_STDIO
+/**
+ * fopencookie() write function for the replaced stdout/stderr. Goes
+ * wherever the fd goes now, decorated or not.
+ */
+static ssize_t
+preload_cookie_write(void *cookie, const char *buf, size_t len)
+{
+  int fd = (int)(long)cookie;
+  struct preload_fd *p;
+  ssize_t ret;
+
+  if (!(p = preload_get(fd)) || preload_lock(p)) {
+    return REAL(write)(fd, buf, len);
+  }
+  ret = preload_decorate(p, fd, buf, len);
+  preload_unlock(p);
+  return ret < 0 ? 0 : ret;
+}
+
+/**
+ * Replace a stdio stream with one that decorates, keeping the buffering
+ * libc would have picked.
+ */
+static FILE *
+preload_stdio(FILE *old, int fd)
+{
+  cookie_io_functions_t funcs;
+  FILE *f;
+
+  memset(&funcs, 0, sizeof(funcs));
+  funcs.write = preload_cookie_write;
+  if (!(f = fopencookie((void*)(long)fd, "w", funcs))) {
+    return old;
+  }
+  /* Programs (Python, for one) look at fileno(stdout) to find their
+   * output, and a cookie stream has none. _fileno is private to glibc,
+   * though it has been in the same place in every glibc 2. If fileno()
+   * doesn't see it, leave stdio alone. */
+  f->_fileno = fd;
+  if (fileno(f) != fd) {
+    fclose(f);
+    return old;
+  }
+  if (fd == STDERR_FILENO) {
+    setvbuf(f, NULL, _IONBF, 0);
+  } else if (isatty(fd)) {
+    setvbuf(f, NULL, _IOLBF, 0);
+  }
+  return f;
+}
+#endif
+
+/**
+ *
+ */
+static const char *
+preload_env(const char *name, const char *def)
+{
+  const char *ret = getenv(name);
+  return ret ? ret : def;
+}
+
+/**
+ * Does fd refer to the file described by "<dev>:<ino>" in env var?
+ */
+static int
+preload_is(int fd, const char *name)
+{
+  const char *id = getenv(name);
+  unsigned long long dev, ino;
+  struct stat st;
+
+  if (!id || 2 != sscanf(id, "%llu:%llu", &dev, &ino)) {
+    return 0;
+  }
+  if (fstat(fd, &st)) {
+    return 0;
+  }
+  return (unsigned long long)st.st_dev == dev
+    && (unsigned long long)st.st_ino == ino;
+}
+
+/**
+ * Set up decoration when the library is loaded
+ */
+__attribute__((constructor))
+static void
+preload_init(void)
+{
+  static const char *const env[3] = {
+    NULL, "IND_PRELOAD_STDOUT", "IND_PRELOAD_STDERR"
+  };
+  struct ind_vars vars;
+  char hostname[256] = "";
+  int fd;
+
+  if (!REAL(write) || !REAL(writev) || !REAL(close)
+      || !REAL(dup) || !REAL(dup2) || !REAL(fcntl)) {
+    return;
+  }
+  /* fd 1 prefers to be stdout and fd 2 stderr, if they are the same file */
+  for (fd = STDOUT_FILENO; fd <= STDERR_FILENO; fd++) {
+    int first = fd;
+    int second = (fd == STDOUT_FILENO) ? STDERR_FILENO : STDOUT_FILENO;
+    if (preload_is(fd, env[first])) {
+      fdmap[fd] = first;
+    } else if (preload_is(fd, env[second])) {
+      fdmap[fd] = second;
+    }
+  }
+
+  /* the process is the child itself, so %{pid} is just getpid() */
+  if (0 > gethostname(hostname, sizeof(hostname))) {
+    hostname[0] = 0;
+  }
+  hostname[sizeof(hostname) - 1] = 0;
+  memset(&vars, 0, sizeof(vars));
+  vars.cmd = preload_env("IND_PRELOAD_CMD", "");
+  vars.host = hostname;
+  vars.pid = getpid();
+
+  vars.stream = "stdout";
+  fds[STDOUT_FILENO].s =
+    ind_stream_new_vars(preload_env("IND_PRELOAD_PREFIX", "  "),
+                        preload_env("IND_PRELOAD_POSTFIX", ""), &vars);
+  vars.stream = "stderr";
+  fds[STDERR_FILENO].s =
+    ind_stream_new_vars(preload_env("IND_PRELOAD_EPREFIX", ">>"),
+                        preload_env("IND_PRELOAD_EPOSTFIX", ""), &vars);
+  pthread_atfork(preload_prefork, preload_postfork, preload_postfork);
+
+#ifdef PRELOAD_STDIO
+  if (fdmap[STDOUT_FILENO]) {
+    fflush(stdout);
+    stdout = preload_stdio(stdout, STDOUT_FILENO);
+  }
+  if (fdmap[STDERR_FILENO]) {
+    stderr = preload_stdio(stderr, STDERR_FILENO);
+  }
+#endif
+}
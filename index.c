@@ -0,0 +1,705 @@
+/* ind/index.c - time and line index of an output file
+ *
+ * (BSD license without advertising clause below)
+ *
+ * Copyright (c) 2019 Thomas Habets <thomas@habets.se>. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+/*
+ * When output goes to a file, ind can keep a sidecar index next to it
+ * (file.idx): a header naming the file by device and inode, then fixed
+ * size records of line number, wall time and offset, one every so many
+ * lines or bytes. Records are only ever appended, unless the file is
+ * truncated (e.g. by logrotate's copytruncate), in which case the index
+ * starts over with it. If the file is renamed, the index is renamed with
+ * it.
+ *
+ * Noting what's written costs a memchr() per line. The clock, the file
+ * offset and the index are only touched when a record is due.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "index.h"
+
+static const char index_magic[8] = { 'I','N','D','I','D','X','0','1' };
+
+struct index_hdr {
+  char magic[8];
+  uint64_t dev;      /* of the indexed file */
+  uint64_t ino;
+  uint64_t reserved;
+};
+
+struct index_rec {
+  uint64_t line;     /* line number in the file, from 1 */
+  int64_t  wall_ns;  /* CLOCK_REALTIME when the line was written */
+  uint64_t offset;   /* where the line starts */
+};
+
+struct index {
+  int fd;            /* the indexed file */
+  int rfd;           /* it again, for reading, or -1 */
+  int idx;           /* the index */
+  char *fn;          /* name of the index */
+  char *datafn;      /* name of the file, if fn is made from it */
+  uint64_t dev, ino;
+  unsigned long every_lines;
+  size_t every_bytes;
+  uint64_t off;      /* offset of the next byte written */
+  uint64_t line;     /* number of the last line started */
+  int linestart;     /* the next byte starts a line */
+  struct index_rec last;  /* last record */
+  int have_last;
+};
+
+/**
+ *
+ */
+static int64_t
+now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * Offset the next write to fd goes to
+ */
+static off_t
+file_pos(int fd)
+{
+  struct stat st;
+  int fl;
+
+  if (0 <= (fl = fcntl(fd, F_GETFL)) && (fl & O_APPEND)) {
+    return fstat(fd, &st) ? -1 : st.st_size;
+  }
+  return lseek(fd, 0, SEEK_CUR);
+}
+
+/**
+ * Count newlines in part of a file
+ *
+ * @param   nl:        set to the count
+ * @param   linestart: set to whether 'to' is at the start of a line
+ *
+ * @return  0 on success, -1 on error (errno set)
+ */
+static int
+count_lines(int fd, uint64_t from, uint64_t to, uint64_t *nl, int *linestart)
+{
+  char buf[65536];
+  char lastc = '\n';
+
+  *nl = 0;
+  while (from < to) {
+    const char *p, *end;
+    size_t want = to - from > sizeof(buf) ? sizeof(buf) : to - from;
+    ssize_t n = pread(fd, buf, want, from);
+    if (0 > n) {
+      return -1;
+    }
+    if (!n) {
+      break;
+    }
+    for (p = buf, end = buf + n; (p = memchr(p, '\n', end - p)); p++) {
+      (*nl)++;
+    }
+    lastc = buf[n - 1];
+    from += n;
+  }
+  *linestart = lastc == '\n';
+  return 0;
+}
+
+/**
+ * Open the file behind fd again, for reading. Needed to count the lines
+ * already in it, as stdout is usually write only.
+ *
+ * @return  fd, or -1 on error (errno set)
+ */
+static int
+fd_reopen(int fd)
+{
+  char proc[64];
+  int ret;
+
+  snprintf(proc, sizeof(proc), "/proc/self/fd/%d", fd);
+  if (0 <= (ret = open(proc, O_RDONLY))) {
+    fcntl(ret, F_SETFD, FD_CLOEXEC);
+  }
+  return ret;
+}
+
+/**
+ * Name of the file behind fd, or NULL
+ *
+ * @return  malloc()ed name
+ */
+static char *
+fd_path(int fd)
+{
+  char proc[64];
+  char buf[4096];
+  ssize_t n;
+
+  snprintf(proc, sizeof(proc), "/proc/self/fd/%d", fd);
+  if (0 > (n = readlink(proc, buf, sizeof(buf) - 1))) {
+    return NULL;
+  }
+  buf[n] = 0;
+  return strdup(buf);
+}
+
+/**
+ *
+ */
+static char *
+idx_name(const char *fn)
+{
+  char *ret;
+  if ((ret = malloc(strlen(fn) + 5))) {
+    strcpy(ret, fn);
+    strcat(ret, ".idx");
+  }
+  return ret;
+}
+
+/**
+ * Empty the index and count lines from the start of the file to pos
+ *
+ * @return  0 on success, -1 on error (errno set)
+ */
+static int
+index_restart(struct index *ix, uint64_t pos)
+{
+  struct index_hdr h;
+  uint64_t nl;
+
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, index_magic, sizeof(index_magic));
+  h.dev = ix->dev;
+  h.ino = ix->ino;
+  if (ftruncate(ix->idx, 0)
+      || sizeof(h) != write(ix->idx, &h, sizeof(h))
+      || count_lines(ix->rfd, 0, pos, &nl, &ix->linestart)) {
+    return -1;
+  }
+  ix->have_last = 0;
+  ix->off = pos;
+  ix->line = nl + !ix->linestart;
+  return 0;
+}
+
+/**
+ * Carry on with an index left by an earlier run on the same file, if
+ * there is one that fits
+ *
+ * @return  1 if resumed, 0 if not
+ */
+static int
+index_resume(struct index *ix, uint64_t pos)
+{
+  struct index_hdr h;
+  struct stat st;
+  uint64_t nrec, nl;
+
+  if (fstat(ix->idx, &st)
+      || sizeof(h) != pread(ix->idx, &h, sizeof(h), 0)
+      || memcmp(h.magic, index_magic, sizeof(index_magic))
+      || h.dev != ix->dev || h.ino != ix->ino) {
+    return 0;
+  }
+  nrec = (st.st_size - sizeof(h)) / sizeof(struct index_rec);
+  if (!nrec) {
+    return 0;
+  }
+  if (sizeof(ix->last) != pread(ix->idx, &ix->last, sizeof(ix->last),
+                                sizeof(h) + (nrec - 1) * sizeof(ix->last))
+      || ix->last.offset > pos
+      || ftruncate(ix->idx, sizeof(h) + nrec * sizeof(ix->last))
+      || count_lines(ix->rfd, ix->last.offset, pos, &nl, &ix->linestart)) {
+    return 0;
+  }
+  ix->have_last = 1;
+  ix->off = pos;
+  ix->line = ix->last.line + nl - ix->linestart;
+  return 1;
+}
+
+/**
+ * Start indexing what's written to fd, a regular file
+ *
+ * @param   fn           index file, or NULL for the file's name plus ".idx"
+ * @param   every_lines  add a record at least this many lines apart
+ * @param   every_bytes  or this many bytes apart
+ *
+ * @return  index, or NULL on error (errno set)
+ */
+struct index *
+index_open(int fd, const char *fn, unsigned long every_lines,
+           size_t every_bytes)
+{
+  struct index *ix;
+  struct stat st;
+  off_t pos;
+
+  if (fstat(fd, &st) || 0 > (pos = file_pos(fd))) {
+    return NULL;
+  }
+  if (!(ix = calloc(1, sizeof(struct index)))) {
+    return NULL;
+  }
+  ix->fd = fd;
+  ix->rfd = fd_reopen(fd);
+  ix->idx = -1;
+  ix->dev = st.st_dev;
+  ix->ino = st.st_ino;
+  ix->every_lines = every_lines;
+  ix->every_bytes = every_bytes;
+  if (fn) {
+    ix->fn = strdup(fn);
+  } else if ((ix->datafn = fd_path(fd))) {
+    ix->fn = idx_name(ix->datafn);
+  }
+  if (!ix->fn
+      || 0 > (ix->idx = open(ix->fn, O_RDWR | O_CREAT | O_APPEND, 0644))) {
+    goto errout;
+  }
+  fcntl(ix->idx, F_SETFD, FD_CLOEXEC);
+  if (!index_resume(ix, pos) && index_restart(ix, pos)) {
+    goto errout;
+  }
+  return ix;
+
+ errout:
+  {
+    int save = errno;
+    index_close(ix);
+    errno = save;
+  }
+  return NULL;
+}
+
+/**
+ * If the file has been renamed, rename the index to go with it. Unless
+ * whatever renamed the file did the index too.
+ */
+static void
+index_follow(struct index *ix)
+{
+  struct stat st, ist;
+  char *datafn, *fn;
+  const char *deleted = " (deleted)";
+  size_t len;
+
+  if (!ix->datafn || !(datafn = fd_path(ix->fd))) {
+    return;
+  }
+  len = strlen(datafn);
+  if (!strcmp(datafn, ix->datafn)
+      || (len > strlen(deleted)
+          && !strcmp(datafn + len - strlen(deleted), deleted))
+      || !(fn = idx_name(datafn))) {
+    free(datafn);
+    return;
+  }
+  if (!fstat(ix->idx, &ist)
+      && ((!stat(ix->fn, &st) && st.st_ino == ist.st_ino
+           && st.st_dev == ist.st_dev && !rename(ix->fn, fn))
+          || (!stat(fn, &st) && st.st_ino == ist.st_ino
+              && st.st_dev == ist.st_dev))) {
+    free(ix->fn);
+    ix->fn = fn;
+  } else {
+    free(fn);
+  }
+  free(ix->datafn);
+  ix->datafn = datafn;
+}
+
+/**
+ * Add a record for the line starting now. The offset counted so far is
+ * checked against the file first: if the file has shrunk, it has been
+ * truncated, and the index starts over.
+ *
+ * @param   start:  offset counted for the start of what's being noted
+ * @param   line0:  line number counted for it
+ * @param   ls0:    it's the start of a line
+ * @param   queued: bytes written before it that are not in the file yet
+ *
+ * @return  0 on success, -1 on error (errno set)
+ */
+static int
+index_add(struct index *ix, uint64_t *start, uint64_t line0, int ls0,
+          size_t queued)
+{
+  struct index_rec r;
+  off_t pos;
+
+  if (0 > (pos = file_pos(ix->fd))) {
+    return -1;
+  }
+  pos += queued;
+  if ((uint64_t)pos < *start) {
+    /* truncated. Lines noted since *start are not in the file yet. */
+    uint64_t d = ix->off - *start;
+    uint64_t k = ix->line - line0 - ls0;
+    if (index_restart(ix, pos)) {
+      return -1;
+    }
+    ix->line = ix->line - !ix->linestart + k + 1;
+    ix->linestart = 0;
+    ix->off = pos + d;
+    *start = pos;
+  } else if ((uint64_t)pos > *start) {
+    /* someone else wrote to it too */
+    ix->off += pos - *start;
+    *start = pos;
+  }
+  index_follow(ix);
+
+  r.line = ix->line;
+  r.wall_ns = now_ns();
+  r.offset = ix->off;
+  if (sizeof(r) != write(ix->idx, &r, sizeof(r))) {
+    return -1;
+  }
+  ix->last = r;
+  ix->have_last = 1;
+  return 0;
+}
+
+/**
+ * Note data about to be written to the file, adding records as they
+ * become due
+ *
+ * @param   queued: bytes written before this that are not in the file yet
+ *
+ * @return  0 on success, -1 on error (errno set), after which the index
+ *          is left as is and should be closed
+ */
+int
+index_note(struct index *ix, const struct iovec *iov, int iovcnt,
+           size_t queued)
+{
+  uint64_t start = ix->off;
+  uint64_t line0 = ix->line;
+  int ls0 = ix->linestart;
+  int c;
+
+  for (c = 0; c < iovcnt; c++) {
+    const char *p = iov[c].iov_base;
+    const char *end = p + iov[c].iov_len;
+    while (p < end) {
+      const char *nl;
+      if (ix->linestart) {
+        ix->linestart = 0;
+        ix->line++;
+        if ((!ix->have_last
+             || ix->line - ix->last.line >= ix->every_lines
+             || ix->off - ix->last.offset >= ix->every_bytes)
+            && index_add(ix, &start, line0, ls0, queued)) {
+          return -1;
+        }
+      }
+      if (!(nl = memchr(p, '\n', end - p))) {
+        ix->off += end - p;
+        break;
+      }
+      ix->off += nl + 1 - p;
+      p = nl + 1;
+      ix->linestart = 1;
+    }
+  }
+  return 0;
+}
+
+/**
+ *
+ */
+void
+index_close(struct index *ix)
+{
+  if (!ix) {
+    return;
+  }
+  if (0 <= ix->idx) {
+    close(ix->idx);
+  }
+  if (0 <= ix->rfd) {
+    close(ix->rfd);
+  }
+  free(ix->fn);
+  free(ix->datafn);
+  free(ix);
+}
+
+/**
+ * Parse a time to seek to: "@<epoch>", "YYYY-MM-DD[ HH:MM[:SS]]", or
+ * "HH:MM[:SS]", which is the latest such time up to 'latest'
+ *
+ * @return  0 on success, -1 if not understood
+ */
+static int
+parse_when(const char *when, int64_t latest_ns, int64_t *ns)
+{
+  static const char *dated[] = {
+    "%Y-%m-%d %H:%M:%S", "%Y-%m-%dT%H:%M:%S", "%Y-%m-%d %H:%M",
+    "%Y-%m-%dT%H:%M", "%Y-%m-%d", NULL
+  };
+  static const char *timed[] = { "%H:%M:%S", "%H:%M", NULL };
+  struct tm tm;
+  const char *end;
+  time_t t;
+  int c;
+
+  if (*when == '@') {
+    char *e;
+    double d = strtod(when + 1, &e);
+    if (e == when + 1 || *e) {
+      return -1;
+    }
+    *ns = d * 1e9;
+    return 0;
+  }
+  for (c = 0; dated[c]; c++) {
+    memset(&tm, 0, sizeof(tm));
+    if ((end = strptime(when, dated[c], &tm)) && !*end) {
+      tm.tm_isdst = -1;
+      *ns = (int64_t)mktime(&tm) * 1000000000LL;
+      return 0;
+    }
+  }
+  for (c = 0; timed[c]; c++) {
+    struct tm hms;
+    memset(&hms, 0, sizeof(hms));
+    if ((end = strptime(when, timed[c], &hms)) && !*end) {
+      t = latest_ns / 1000000000LL;
+      memcpy(&tm, localtime(&t), sizeof(tm));
+      tm.tm_hour = hms.tm_hour;
+      tm.tm_min = hms.tm_min;
+      tm.tm_sec = hms.tm_sec;
+      tm.tm_isdst = -1;
+      if ((t = mktime(&tm)) > latest_ns / 1000000000LL) {
+        tm.tm_mday--;
+        tm.tm_isdst = -1;
+        t = mktime(&tm);
+      }
+      *ns = (int64_t)t * 1000000000LL;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+/**
+ * Read record n of the index
+ */
+static int
+rec_read(int idx, uint64_t n, struct index_rec *r)
+{
+  return sizeof(*r) == pread(idx, r, sizeof(*r),
+                             sizeof(struct index_hdr) + n * sizeof(*r))
+    ? 0 : -1;
+}
+
+/**
+ * Write a file to stdout from the line given by number (when is all
+ * digits) or by time, finding where to start in its index
+ *
+ * @param   idxfn:  index file, or NULL for fn plus ".idx"
+ *
+ * @return  0 on success, -1 on error (printed)
+ */
+int
+index_seek(const char *when, const char *fn, const char *idxfn)
+{
+  struct index_hdr h;
+  struct index_rec r;
+  struct stat st, ist;
+  char *myidxfn = NULL;
+  uint64_t nrec = 0;
+  uint64_t lo, hi;
+  uint64_t target = 0;
+  int usable = 0;
+  uint64_t off = 0, line = 1;
+  int64_t target_ns = 0;
+  int byline = when[strspn(when, "0123456789")] == 0 && *when;
+  char buf[65536];
+  int ret = -1;
+  int fd, idx = -1;
+
+  if (0 > (fd = open(fn, O_RDONLY)) || fstat(fd, &st)) {
+    fprintf(stderr, "ind: %s: %s\n", fn, strerror(errno));
+    goto out;
+  }
+  if (!idxfn && !(idxfn = myidxfn = idx_name(fn))) {
+    fprintf(stderr, "ind: Out of memory\n");
+    goto out;
+  }
+  if (0 > (idx = open(idxfn, O_RDONLY)) || fstat(idx, &ist)
+      || sizeof(h) != pread(idx, &h, sizeof(h), 0)
+      || memcmp(h.magic, index_magic, sizeof(index_magic))) {
+    fprintf(stderr, "ind: %s: no usable index%s\n", idxfn,
+            byline ? ", reading from the start" : "");
+  } else if (h.dev != (uint64_t)st.st_dev || h.ino != (uint64_t)st.st_ino) {
+    fprintf(stderr, "ind: %s: index is of another file%s\n", idxfn,
+            byline ? ", reading from the start" : "");
+  } else {
+    nrec = (ist.st_size - sizeof(h)) / sizeof(r);
+    usable = 1;
+  }
+
+  /* records are in offset order. Ignore those past the end of the file,
+   * which may have been written just before the file was truncated. */
+  for (lo = 0, hi = nrec; lo < hi;) {
+    uint64_t mid = lo + (hi - lo) / 2;
+    if (rec_read(idx, mid, &r)) {
+      goto readerr;
+    }
+    if (r.offset <= (uint64_t)st.st_size) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  nrec = lo;
+
+  if (byline) {
+    if (!(target = strtoull(when, NULL, 10))) {
+      target = 1;
+    }
+  } else {
+    if (!nrec) {
+      if (usable) {
+        fprintf(stderr, "ind: %s: index is empty\n", idxfn);
+      }
+      goto out;
+    }
+    if (rec_read(idx, nrec - 1, &r)) {
+      goto readerr;
+    }
+    if (parse_when(when, r.wall_ns, &target_ns)) {
+      fprintf(stderr, "ind: Can't parse time '%s'. Use HH:MM[:SS], "
+              "YYYY-MM-DD[ HH:MM[:SS]] or @<epoch>\n", when);
+      goto out;
+    }
+  }
+
+  /* last record at or before what's looked for */
+  for (lo = 0, hi = nrec; lo < hi;) {
+    uint64_t mid = lo + (hi - lo) / 2;
+    if (rec_read(idx, mid, &r)) {
+      goto readerr;
+    }
+    if (byline ? r.line <= target : r.wall_ns <= target_ns) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  if (lo) {
+    if (rec_read(idx, lo - 1, &r)) {
+      goto readerr;
+    }
+    off = r.offset;
+    line = r.line;
+  }
+
+  /* the rest of the way to the line, if by line */
+  while (byline && line < target) {
+    ssize_t n = pread(fd, buf, sizeof(buf), off);
+    const char *p = buf;
+    const char *nl;
+    if (0 > n) {
+      goto fileerr;
+    }
+    if (!n) {
+      fprintf(stderr, "ind: %s: there is no line %llu\n",
+              fn, (unsigned long long)target);
+      goto out;
+    }
+    while (line < target && (nl = memchr(p, '\n', buf + n - p))) {
+      p = nl + 1;
+      line++;
+    }
+    off += (line < target) ? (size_t)n : (size_t)(p - buf);
+  }
+
+  for (;;) {
+    ssize_t n = pread(fd, buf, sizeof(buf), off);
+    const char *p = buf;
+    if (0 > n) {
+      goto fileerr;
+    }
+    if (!n) {
+      break;
+    }
+    off += n;
+    while (n) {
+      ssize_t w = write(STDOUT_FILENO, p, n);
+      if (0 > w) {
+        if (errno == EINTR) {
+          continue;
+        }
+        fprintf(stderr, "ind: writing: %s\n", strerror(errno));
+        goto out;
+      }
+      p += w;
+      n -= w;
+    }
+  }
+  ret = 0;
+  goto out;
+
+ fileerr:
+  fprintf(stderr, "ind: %s: %s\n", fn, strerror(errno));
+  goto out;
+ readerr:
+  fprintf(stderr, "ind: %s: %s\n", idxfn, strerror(errno));
+ out:
+  if (0 <= idx) {
+    close(idx);
+  }
+  if (0 <= fd) {
+    close(fd);
+  }
+  free(myidxfn);
+  return ret;
+}
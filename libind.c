@@ -0,0 +1,911 @@
+/* ind/libind.c - line decoration engine
+ *
+ * (BSD license without advertising clause below)
+ *
+ * Copyright (c) 2019 Thomas Habets <thomas@habets.se>. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "libind.h"
+
+/* room for a few lines' worth of prefix, data, postfix and newline */
+#define IND_IOV_MAX 64
+
+/* max parts a format is split into by %{seq} */
+#define IND_MAX_PARTS 8
+
+/* room for rendered sequence numbers of all lines in one feed call */
+#define IND_DIGITS_SIZE 1024
+#define IND_DIGITS_MAX 21
+
+/* let the compiler specialize feed_kernel() for each set of features */
+#ifdef __GNUC__
+#define IND_ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+#define IND_ALWAYS_INLINE inline
+#endif
+
+struct ind_stream;
+typedef size_t (*ind_feed_fn)(struct ind_stream *s,
+                              const char *buf, size_t len, int *iovcnt);
+
+/* a piece of format that is either strftime() text or %{seq} */
+struct ind_part {
+  int seq;              /* this part is the line sequence number */
+  char *fmt;            /* ' ' + strftime format, see fmt_expand() */
+  int dynamic;          /* has escapes, needs expanding as time passes */
+  time_t when;          /* time of last expansion */
+  char *buf;            /* expanded, leading space at buf[0] */
+  size_t bufsize;
+  size_t len;           /* length of expansion, excluding leading space */
+};
+
+struct ind_fmt {
+  struct ind_part part[IND_MAX_PARTS];
+  int nparts;
+  int nseq;             /* number of %{seq} parts */
+};
+
+struct ind_stream {
+  char *prefix;         /* templates, as given */
+  char *postfix;
+  struct ind_fmt pre;
+  struct ind_fmt post;
+  int emptyline;
+  int aftercr;          /* last line ended with \r, a \n may complete it */
+  unsigned long long seq;
+  char seqstr[IND_DIGITS_MAX];  /* seq in decimal, right-aligned */
+  size_t seqpos;                /* first digit in seqstr */
+  char digits[IND_DIGITS_SIZE];
+  size_t digitsused;
+  struct iovec iov[IND_IOV_MAX];
+  ind_feed_fn feed;     /* kernel for the features the templates use */
+  const char *kernel;   /* its name */
+};
+
+static void feed_select(struct ind_stream *s);
+
+/**
+ * Expand a strftime() format that has an extra leading space.
+ *
+ * We need to inject a space as the first character in order to differentiate
+ * %p expanding to an empty string and an error, since strftime() sucks at
+ * error handling.
+ *
+ * @param   fmt:     format string, with leading space
+ * @param   t:       time to expand for
+ * @param   buf:     buffer, realloc()ed as needed
+ * @param   bufsize: size of *buf
+ *
+ * @return  length of expansion including leading space, or -1 if broken
+ */
+static ssize_t
+fmt_expand(const char *fmt, time_t t, char **buf, size_t *bufsize)
+{
+  struct tm tm;
+  size_t n;
+
+  memcpy(&tm, localtime(&t), sizeof(tm));
+  for (;;) {
+    if (*bufsize && (n = strftime(*buf, *bufsize, fmt, &tm))) {
+      return n;
+    }
+    {
+      size_t newsize = *bufsize ? *bufsize * 2 : 64;
+      char *newbuf;
+      if (newsize > IND_MAX_FMT_LENGTH) {
+        /* Format expanded to too long a string, or is incorrectly formatted.
+         * in either case it's a user error or madness. */
+        return -1;
+      }
+      if (!(newbuf = realloc(*buf, newsize))) {
+        return -1;
+      }
+      *buf = newbuf;
+      *bufsize = newsize;
+    }
+  }
+}
+
+/**
+ * Expand strftime()-style format into *buf, growing it as needed.
+ *
+ * @param   fmt:     format string
+ * @param   buf:     buffer (may be NULL), realloc()ed as needed
+ * @param   bufsize: size of *buf
+ *
+ * @return  length of the NUL-terminated expansion, or -1 if the format is
+ *          broken, expands to something absurdly long, or memory ran out
+ */
+ssize_t
+ind_format(const char *fmt, char **buf, size_t *bufsize)
+{
+  char sfmt[strlen(fmt) + 2];
+  ssize_t n;
+
+  sfmt[0] = ' ';
+  strcpy(&sfmt[1], fmt);
+  if (0 > (n = fmt_expand(sfmt, time(NULL), buf, bufsize))) {
+    return -1;
+  }
+  memmove(*buf, *buf + 1, n);
+  return n - 1;
+}
+
+/**
+ * Expand part for time t into p->buf
+ */
+static void
+part_update(struct ind_part *p, time_t t)
+{
+  ssize_t n;
+
+  p->when = t;
+  if (0 > (n = fmt_expand(p->fmt, t, &p->buf, &p->bufsize))) {
+    static const char *err = " ind fmt error";
+    if (p->bufsize > strlen(err)) {
+      strcpy(p->buf, err);
+      p->len = strlen(err) - 1;
+    } else {
+      p->len = 0;
+    }
+    return;
+  }
+  p->len = n - 1;
+}
+
+/**
+ * Init a strftime() part from the first len bytes of fmt. The expansion is
+ * done right away, and redone later only if the format has escapes and the
+ * time has changed.
+ *
+ * @return  0 on success, -1 if out of memory
+ */
+static int
+part_init(struct ind_part *p, const char *fmt, size_t len)
+{
+  memset(p, 0, sizeof(*p));
+  if (!(p->fmt = malloc(len + 2))
+      || !(p->buf = malloc(p->bufsize = 64))) {
+    return -1;
+  }
+  p->fmt[0] = ' ';
+  memcpy(&p->fmt[1], fmt, len);
+  p->fmt[len + 1] = 0;
+  p->dynamic = !!strchr(p->fmt, '%');
+  part_update(p, time(NULL));
+  return 0;
+}
+
+/**
+ * Re-expand a part if the time has changed since last time
+ */
+static void
+part_refresh(struct ind_part *p)
+{
+  time_t t;
+
+  if (!p->dynamic) {
+    return;
+  }
+  t = time(NULL);
+  if (t != p->when) {
+    part_update(p, t);
+  }
+}
+
+/**
+ *
+ */
+static void
+fmt_free(struct ind_fmt *f)
+{
+  int c;
+  for (c = 0; c < f->nparts; c++) {
+    free(f->part[c].fmt);
+    free(f->part[c].buf);
+  }
+  memset(f, 0, sizeof(*f));
+}
+
+/**
+ * Append to a growing string, escaping '%' if asked to
+ */
+static int
+str_append(char **str, size_t *len, size_t *size,
+           const char *add, size_t addlen, int escape)
+{
+  size_t c;
+  for (c = 0; c <= addlen; c++) {
+    if (*len + 3 > *size) {
+      size_t newsize = *size ? *size * 2 : 64;
+      char *n;
+      if (!(n = realloc(*str, newsize))) {
+        return -1;
+      }
+      *str = n;
+      *size = newsize;
+    }
+    if (c == addlen) {
+      break;
+    }
+    if (escape && add[c] == '%') {
+      (*str)[(*len)++] = '%';
+    }
+    (*str)[(*len)++] = add[c];
+  }
+  (*str)[*len] = 0;
+  return 0;
+}
+
+/**
+ * Look up template variable name (namelen long). *val is set to its value,
+ * or to NULL for %{seq}, which has no fixed value. pid is scratch space for
+ * %{pid}.
+ *
+ * @return  0 if known, -1 if not
+ */
+static int
+var_lookup(const char *name, size_t namelen, const struct ind_vars *vars,
+           char *pid, size_t pidsize, const char **val)
+{
+#define IS_VAR(n) (namelen == strlen(n) && !strncmp(name, n, namelen))
+  *val = NULL;
+  if (IS_VAR("seq")) {
+    /* changes every line */
+  } else if (IS_VAR("stream")) {
+    *val = (vars && vars->stream) ? vars->stream : "";
+  } else if (IS_VAR("pid")) {
+    snprintf(pid, pidsize, "%ld", vars ? vars->pid : 0L);
+    *val = pid;
+  } else if (IS_VAR("host")) {
+    *val = (vars && vars->host) ? vars->host : "";
+  } else if (IS_VAR("cmd")) {
+    *val = (vars && vars->cmd) ? vars->cmd : "";
+  } else if (IS_VAR("file")) {
+    *val = (vars && vars->file) ? vars->file : "";
+  } else {
+    return -1;
+  }
+#undef IS_VAR
+  return 0;
+}
+
+/**
+ * Compile a template into parts. %{stream}, %{pid}, %{host}, %{cmd} and
+ * %{file} are resolved here, %{seq} gets its own part and everything else
+ * is left to strftime().
+ *
+ * @return  0 on success, -1 on too many %{seq} or out of memory
+ */
+static int
+fmt_init(struct ind_fmt *f, const char *tmpl, const struct ind_vars *vars)
+{
+  char *text = NULL;
+  size_t len = 0, size = 0;
+  const char *p;
+  char pid[IND_DIGITS_MAX];
+
+  memset(f, 0, sizeof(*f));
+  if (str_append(&text, &len, &size, "", 0, 0)) {
+    return -1;
+  }
+  for (p = tmpl; *p; p++) {
+    const char *end;
+    const char *val = NULL;
+
+    if (p[0] != '%' || (p[1] != '%' && p[1] != '{')) {
+      if (str_append(&text, &len, &size, p, 1, 0)) {
+        goto errout;
+      }
+      continue;
+    }
+    if (p[1] == '%') {
+      if (str_append(&text, &len, &size, p, 2, 0)) {
+        goto errout;
+      }
+      p++;
+      continue;
+    }
+
+    /* %{name}. Anything else is kept as text, like before there were
+     * variables. */
+    if (!(end = strchr(p + 2, '}'))
+        || var_lookup(p + 2, end - (p + 2), vars, pid, sizeof(pid), &val)) {
+      if (str_append(&text, &len, &size, p, 2, 1)) {
+        goto errout;
+      }
+      p++;
+      continue;
+    }
+    if (!val) {
+      /* %{seq} */
+      if (f->nparts + 2 > IND_MAX_PARTS) {
+        goto errout;
+      }
+      if (part_init(&f->part[f->nparts++], text, len)) {
+        goto errout;
+      }
+      f->part[f->nparts++].seq = 1;
+      f->nseq++;
+      len = 0;
+      text[0] = 0;
+    }
+    if (val && str_append(&text, &len, &size, val, strlen(val), 1)) {
+      goto errout;
+    }
+    p = end;
+  }
+  if (part_init(&f->part[f->nparts++], text, len)) {
+    goto errout;
+  }
+  free(text);
+  return 0;
+
+ errout:
+  free(text);
+  fmt_free(f);
+  return -1;
+}
+
+/**
+ * Check that a template is valid: not too many %{seq}, and not expanding
+ * to something broken or absurdly long.
+ *
+ * @return  0 if ok, -1 if not
+ */
+int
+ind_format_check(const char *tmpl)
+{
+  struct ind_vars vars;
+  struct ind_fmt f;
+  int ret = 0;
+  int c;
+
+  memset(&vars, 0, sizeof(vars));
+  if (fmt_init(&f, tmpl, &vars)) {
+    return -1;
+  }
+  for (c = 0; c < f.nparts; c++) {
+    if (!f.part[c].seq
+        && 0 > fmt_expand(f.part[c].fmt, time(NULL),
+                          &f.part[c].buf, &f.part[c].bufsize)) {
+      ret = -1;
+    }
+  }
+  fmt_free(&f);
+  return ret;
+}
+
+/**
+ * Substitute %{stream}, %{pid}, %{host}, %{cmd} and %{file} in a template,
+ * leaving %{seq} and strftime() formats in place. Used to combine templates
+ * that have different values for the variables into one.
+ *
+ * @return  malloc()ed template, or NULL if out of memory
+ */
+char *
+ind_format_resolve(const char *tmpl, const struct ind_vars *vars)
+{
+  char *text = NULL;
+  size_t len = 0, size = 0;
+  const char *p;
+  char pid[IND_DIGITS_MAX];
+
+  if (str_append(&text, &len, &size, "", 0, 0)) {
+    return NULL;
+  }
+  for (p = tmpl; *p; p++) {
+    const char *end;
+    const char *val;
+    size_t n = 1;
+
+    if (p[0] == '%' && p[1] == '{') {
+      if (!(end = strchr(p + 2, '}'))
+          || var_lookup(p + 2, end - (p + 2), vars, pid, sizeof(pid), &val)) {
+        /* not a variable, left for fmt_init() to keep as text */
+        val = NULL;
+        end = p + 1;
+      }
+      if (val) {
+        if (str_append(&text, &len, &size, val, strlen(val), 1)) {
+          free(text);
+          return NULL;
+        }
+        p = end;
+        continue;
+      }
+      n = end - p + 1;
+    } else if (p[0] == '%' && p[1]) {
+      n = 2;
+    }
+    if (str_append(&text, &len, &size, p, n, 0)) {
+      free(text);
+      return NULL;
+    }
+    p += n - 1;
+  }
+  return text;
+}
+
+/**
+ * Create a decorating stream.
+ *
+ * @param   prefix:  strftime() format added before every line
+ * @param   postfix: strftime() format added after every line
+ *
+ * @return  new stream, or NULL if out of memory or a template is invalid
+ */
+struct ind_stream *
+ind_stream_new(const char *prefix, const char *postfix)
+{
+  return ind_stream_new_vars(prefix, postfix, NULL);
+}
+
+/**
+ * Create a decorating stream, with values for template variables.
+ *
+ * @param   prefix:  template added before every line
+ * @param   postfix: template added after every line
+ * @param   vars:    values of %{stream} etc, or NULL
+ *
+ * @return  new stream, or NULL if out of memory or a template is invalid
+ */
+struct ind_stream *
+ind_stream_new_vars(const char *prefix, const char *postfix,
+                    const struct ind_vars *vars)
+{
+  struct ind_stream *s;
+
+  if (!(s = calloc(1, sizeof(struct ind_stream)))) {
+    return NULL;
+  }
+  if (!(s->prefix = strdup(prefix))
+      || !(s->postfix = strdup(postfix))
+      || ind_stream_set_vars(s, vars)) {
+    ind_stream_free(s);
+    return NULL;
+  }
+  /* the line is empty before anything is written to it */
+  s->emptyline = 1;
+  s->seqpos = sizeof(s->seqstr);
+  return s;
+}
+
+/**
+ * Change the values of template variables, e.g. when the pid becomes known.
+ *
+ * @return  0 on success, -1 if out of memory or a template is invalid
+ */
+int
+ind_stream_set_vars(struct ind_stream *s, const struct ind_vars *vars)
+{
+  struct ind_fmt pre, post;
+
+  if (fmt_init(&pre, s->prefix, vars)) {
+    return -1;
+  }
+  if (fmt_init(&post, s->postfix, vars)) {
+    fmt_free(&pre);
+    return -1;
+  }
+  fmt_free(&s->pre);
+  fmt_free(&s->post);
+  s->pre = pre;
+  s->post = post;
+  feed_select(s);
+  return 0;
+}
+
+/**
+ * Current width of prefix plus postfix
+ */
+size_t
+ind_stream_width(struct ind_stream *s)
+{
+  size_t ret = 0;
+  int c;
+
+  for (c = 0; c < s->pre.nparts; c++) {
+    ret += s->pre.part[c].seq
+      ? (size_t)snprintf(NULL, 0, "%llu", s->seq + 1)
+      : s->pre.part[c].len;
+  }
+  for (c = 0; c < s->post.nparts; c++) {
+    ret += s->post.part[c].seq
+      ? (size_t)snprintf(NULL, 0, "%llu", s->seq + 1)
+      : s->post.part[c].len;
+  }
+  return ret;
+}
+
+/**
+ *
+ */
+void
+ind_stream_free(struct ind_stream *s)
+{
+  if (!s) {
+    return;
+  }
+  fmt_free(&s->pre);
+  fmt_free(&s->post);
+  free(s->prefix);
+  free(s->postfix);
+  free(s);
+}
+
+/**
+ * just like strpbrk(), but haystack is not null-terminated
+ *
+ * @param  p:       string to search in
+ * @param  chars:   characters to look for
+ * @param  len:     length of string to search in
+ *
+ * @return   Pointer to first occurance of any of the characters, or NULL
+ *           if not found.
+ */
+const char *
+ind_mempbrk(const char *p, const char *chars, size_t len)
+{
+  int c;
+  const char *ret = NULL;
+  const char *tmp;
+
+  for(c = strlen(chars); c; c--) {
+    tmp = memchr(p, chars[c-1], len);
+    if (tmp) {
+      ret = tmp;
+      len = tmp - p;
+    }
+  }
+  return ret;
+}
+
+/**
+ * Add to iovec list, skipping empty entries
+ */
+static void
+iov_add(struct ind_stream *s, int *cnt, const char *p, size_t len)
+{
+  if (len) {
+    s->iov[*cnt].iov_base = (void*)p;
+    s->iov[*cnt].iov_len = len;
+    (*cnt)++;
+  }
+}
+
+/**
+ * Next line number. Done on the decimal string, since that is what is
+ * needed and it's cheaper than formatting a number every line.
+ */
+static void
+seq_inc(struct ind_stream *s)
+{
+  size_t c = sizeof(s->seqstr);
+
+  s->seq++;
+  while (c-- > 0) {
+    if (c < s->seqpos) {
+      s->seqstr[c] = '1';
+      s->seqpos = c;
+      return;
+    }
+    if (s->seqstr[c] != '9') {
+      s->seqstr[c]++;
+      return;
+    }
+    s->seqstr[c] = '0';
+  }
+}
+
+/**
+ * Add expanded format to iovec list. Sequence numbers are rendered into
+ * the stream's digit buffer, which the caller has made sure has room.
+ */
+static void
+iov_add_fmt(struct ind_stream *s, int *cnt, struct ind_fmt *f)
+{
+  int c;
+
+  for (c = 0; c < f->nparts; c++) {
+    struct ind_part *p = &f->part[c];
+    if (p->seq) {
+      char *d = s->digits + s->digitsused;
+      size_t n = sizeof(s->seqstr) - s->seqpos;
+      memcpy(d, s->seqstr + s->seqpos, n);
+      iov_add(s, cnt, d, n);
+      s->digitsused += n;
+    } else {
+      iov_add(s, cnt, p->buf + 1, p->len);
+    }
+  }
+}
+
+/**
+ *
+ */
+static void
+fmt_refresh(struct ind_fmt *f)
+{
+  int c;
+  for (c = 0; c < f->nparts; c++) {
+    part_refresh(&f->part[c]);
+  }
+}
+
+/**
+ * Decorate data, with the features used by the templates given as
+ * constants, so that each caller gets a copy with the rest compiled out.
+ * The generic case has every feature on.
+ *
+ * @param   post:     there is a postfix. Without one, data and line end
+ *                    are adjacent and go in one iovec.
+ * @param   seq:      a template has %{seq}. Without it both templates are
+ *                    single parts, and lines need not be counted.
+ * @param   refresh:  a template has strftime() escapes, and is to be
+ *                    expanded again when the time changes
+ *
+ * @return  number of bytes of buf used
+ */
+static IND_ALWAYS_INLINE size_t
+feed_kernel(struct ind_stream *s, const char *buf, size_t len, int *iovcnt,
+            const int post, const int seq, const int refresh)
+{
+  const char *p = buf;
+  const char *end = buf + len;
+  const char *nl = NULL;
+  const char *cr = NULL;
+  const int per_line = (post || seq)
+    ? s->pre.nparts + s->post.nparts + 2 : 2;
+  const size_t digits_per_line = seq
+    ? (s->pre.nseq + s->post.nseq) * IND_DIGITS_MAX : 0;
+  int cnt = 0;
+
+  if (refresh) {
+    fmt_refresh(&s->pre);
+    if (post) {
+      fmt_refresh(&s->post);
+    }
+  }
+  if (seq) {
+    s->digitsused = 0;
+  }
+
+  /* each round adds at most prefix, data, postfix and newline */
+  while (p < end
+         && cnt + per_line <= IND_IOV_MAX
+         && (!seq || s->digitsused + digits_per_line <= IND_DIGITS_SIZE)) {
+    const char *q;
+    const char *eol;
+
+    /* remember where the next CR and LF are, so that no byte is scanned
+     * more than once per character */
+    if (!nl || (nl != end && nl < p)) {
+      if (!(nl = memchr(p, '\n', end - p))) {
+        nl = end;
+      }
+    }
+    if (!cr || (cr != end && cr < p)) {
+      if (!(cr = memchr(p, '\r', end - p))) {
+        cr = end;
+      }
+    }
+    q = (cr < nl) ? cr : nl;
+
+    /* \r\n is one line end, even when split between reads */
+    if (s->aftercr) {
+      s->aftercr = 0;
+      if (q == p && *q == '\n') {
+        iov_add(s, &cnt, q, 1);
+        p = q + 1;
+        continue;
+      }
+    }
+
+    if (s->emptyline) {
+      if (seq) {
+        seq_inc(s);
+        iov_add_fmt(s, &cnt, &s->pre);
+      } else {
+        iov_add(s, &cnt, s->pre.part[0].buf + 1, s->pre.part[0].len);
+      }
+      s->emptyline = 0;
+    }
+    if (q == end) {
+      iov_add(s, &cnt, p, end - p);
+      p = end;
+      break;
+    }
+    eol = q + 1;
+    if (*q == '\r') {
+      if (eol == end) {
+        s->aftercr = 1;
+      } else if (*eol == '\n') {
+        eol++;
+      }
+    }
+    if (post) {
+      iov_add(s, &cnt, p, q - p);
+      if (seq) {
+        iov_add_fmt(s, &cnt, &s->post);
+      } else {
+        iov_add(s, &cnt, s->post.part[0].buf + 1, s->post.part[0].len);
+      }
+      iov_add(s, &cnt, q, eol - q);
+    } else {
+      iov_add(s, &cnt, p, eol - p);
+    }
+    p = eol;
+    s->emptyline = 1;
+  }
+  *iovcnt = cnt;
+  return p - buf;
+}
+
+/**
+ * No prefix or postfix: the data is passed on as is, and only where the
+ * line ends is kept track of, in case the templates change.
+ */
+static size_t
+feed_passthrough(struct ind_stream *s, const char *buf, size_t len,
+                 int *iovcnt)
+{
+  int cnt = 0;
+
+  if (len) {
+    iov_add(s, &cnt, buf, len);
+    s->emptyline = buf[len - 1] == '\n' || buf[len - 1] == '\r';
+    s->aftercr = buf[len - 1] == '\r';
+  }
+  *iovcnt = cnt;
+  return len;
+}
+
+/**
+ * Constant prefix, e.g. the default "  "
+ */
+static size_t
+feed_prefix(struct ind_stream *s, const char *buf, size_t len, int *iovcnt)
+{
+  return feed_kernel(s, buf, len, iovcnt, 0, 0, 0);
+}
+
+/**
+ * Constant prefix and postfix
+ */
+static size_t
+feed_prefix_postfix(struct ind_stream *s, const char *buf, size_t len,
+                    int *iovcnt)
+{
+  return feed_kernel(s, buf, len, iovcnt, 1, 0, 0);
+}
+
+/**
+ * Prefix that changes with time, e.g. "%T "
+ */
+static size_t
+feed_time(struct ind_stream *s, const char *buf, size_t len, int *iovcnt)
+{
+  return feed_kernel(s, buf, len, iovcnt, 0, 0, 1);
+}
+
+/**
+ * Anything, e.g. %{seq}
+ */
+static size_t
+feed_generic(struct ind_stream *s, const char *buf, size_t len, int *iovcnt)
+{
+  return feed_kernel(s, buf, len, iovcnt, 1, 1, 1);
+}
+
+/**
+ * Pick the kernel with the fewest features that still does all the
+ * templates ask for
+ */
+static void
+feed_select(struct ind_stream *s)
+{
+  const int seq = s->pre.nseq + s->post.nseq;
+  const int post = s->post.nparts > 1 || s->post.part[0].len
+    || s->post.part[0].dynamic;
+  const int dynamic = s->pre.part[0].dynamic || s->post.part[0].dynamic;
+
+  if (seq || (post && dynamic)) {
+    s->feed = feed_generic;
+    s->kernel = "generic";
+  } else if (dynamic) {
+    s->feed = feed_time;
+    s->kernel = "time";
+  } else if (post) {
+    s->feed = feed_prefix_postfix;
+    s->kernel = "prefix+postfix";
+  } else if (s->pre.part[0].len) {
+    s->feed = feed_prefix;
+    s->kernel = "prefix";
+  } else {
+    s->feed = feed_passthrough;
+    s->kernel = "passthrough";
+  }
+}
+
+/**
+ * Use the generic kernel even where a specialized one would do. For
+ * testing the specialized ones against it.
+ */
+void
+ind_stream_generic(struct ind_stream *s)
+{
+  s->feed = feed_generic;
+  s->kernel = "generic";
+}
+
+/**
+ * Name of the kernel the stream decorates with, e.g. "prefix"
+ */
+const char *
+ind_stream_kernel(const struct ind_stream *s)
+{
+  return s->kernel;
+}
+
+/**
+ * Decorate data. Adds prefix and postfix when crossing newlines (CR, LF
+ * or CRLF).
+ *
+ * @param   s:       stream
+ * @param   buf:     data
+ * @param   len:     length of data
+ * @param   iov:     set to output vector
+ * @param   iovcnt:  set to length of output vector
+ *
+ * @return  number of bytes of buf used. Call again with the rest.
+ */
+size_t
+ind_stream_feed(struct ind_stream *s, const char *buf, size_t len,
+                struct iovec **iov, int *iovcnt)
+{
+  *iov = s->iov;
+  return s->feed(s, buf, len, iovcnt);
+}
+
+/**
+ * Get any output held back by the stream. Call when the input ends.
+ */
+void
+ind_stream_flush(struct ind_stream *s, struct iovec **iov, int *iovcnt)
+{
+  *iov = s->iov;
+  *iovcnt = 0;
+}
@@ -0,0 +1,96 @@
+/* ind/libind.h - line decoration engine
+ *
+ * (BSD license without advertising clause below)
+ *
+ * Copyright (c) 2019 Thomas Habets <thomas@habets.se>. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+/*
+ * Streaming prefix/postfix decoration, as done by ind.
+ *
+ *   struct ind_stream *s = ind_stream_new("%T ", "");
+ *   while (len) {
+ *     struct iovec *iov;
+ *     int iovcnt;
+ *     size_t n = ind_stream_feed(s, buf, len, &iov, &iovcnt);
+ *     writev(fd, iov, iovcnt);
+ *     buf += n;
+ *     len -= n;
+ *   }
+ *   ind_stream_flush(s, &iov, &iovcnt);
+ *   writev(fd, iov, iovcnt);
+ *   ind_stream_free(s);
+ *
+ * The iovecs point into the fed buffer and into the stream, and are valid
+ * until the next call on the stream. No memory is allocated after
+ * ind_stream_new() unless a time-varying format expands to something
+ * longer than it ever has before.
+ *
+ * Each stream decorates with code specialized for what its templates use
+ * (e.g. a constant prefix and no postfix), see ind_stream_kernel().
+ *
+ * Prefix and postfix are strftime() formats, plus the variables %{seq},
+ * %{stream}, %{pid}, %{host}, %{cmd} and %{file}. All but %{seq} are resolved
+ * when the stream is created, so they cost nothing per line.
+ */
+#ifndef __INCLUDE_LIBIND_H__
+#define __INCLUDE_LIBIND_H__
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/* arbitrary maxlength for prefixes and postfixes. Should be enough */
+#define IND_MAX_FMT_LENGTH 1048576
+
+struct ind_stream;
+
+/* values for the template variables %{stream}, %{cmd}, %{host}, %{pid}
+ * and %{file}. %{seq}, the line number, is kept by the stream. */
+struct ind_vars {
+  const char *stream;
+  const char *cmd;
+  const char *host;
+  long pid;
+  const char *file;
+};
+
+struct ind_stream *ind_stream_new(const char *prefix, const char *postfix);
+struct ind_stream *ind_stream_new_vars(const char *prefix, const char *postfix,
+                                       const struct ind_vars *vars);
+int ind_stream_set_vars(struct ind_stream *s, const struct ind_vars *vars);
+size_t ind_stream_width(struct ind_stream *s);
+void ind_stream_free(struct ind_stream *s);
+size_t ind_stream_feed(struct ind_stream *s, const char *buf, size_t len,
+                       struct iovec **iov, int *iovcnt);
+void ind_stream_flush(struct ind_stream *s, struct iovec **iov, int *iovcnt);
+const char *ind_stream_kernel(const struct ind_stream *s);
+void ind_stream_generic(struct ind_stream *s);
+
+ssize_t ind_format(const char *fmt, char **buf, size_t *bufsize);
+int ind_format_check(const char *tmpl);
+char *ind_format_resolve(const char *tmpl, const struct ind_vars *vars);
+const char *ind_mempbrk(const char *p, const char *chars, size_t len);
+
+#endif
@@ -0,0 +1,488 @@
+/* ind/logsink.c - send output lines to journald or syslog
+ *
+ * (BSD license without advertising clause below)
+ *
+ * Copyright (c) 2019 Thomas Habets <thomas@habets.se>. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+/*
+ * Every complete line of child output is sent as one datagram, either
+ * in journald's native format:
+ *
+ *   PRIORITY=6\nSYSLOG_IDENTIFIER=tag\nMESSAGE=line\n
+ *
+ * or as RFC 5424 syslog:
+ *
+ *   <14>1 2019-01-01T12:00:00.000000+01:00 host tag pid - - line
+ *
+ * Lines are queued as they come in, pointing straight into the read
+ * buffer, and the queue is sent with one sendmmsg() per chunk read from
+ * the child. The socket is non-blocking and the queue is bounded: if the
+ * receiver doesn't make room within LOGSINK_WAIT_MS the rest of the batch
+ * is dropped and counted, rather than stalling the child for good.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#include "logsink.h"
+
+#define LOGSINK_JOURNAL_PATH "/run/systemd/journal/socket"
+#define LOGSINK_SYSLOG_PATH  "/dev/log"
+
+/* messages per sendmmsg() */
+#define LOGSINK_BATCH 64
+
+/* how long to wait for a busy receiver before dropping a batch */
+#define LOGSINK_WAIT_MS 1000
+
+/* longer lines are split into several messages */
+#define LOGSINK_LINE_MAX 8192
+
+/* user facility, for syslog */
+#define LOGSINK_FACILITY (1 << 3)
+
+/* start of a line whose end has not been read yet */
+struct logsink_partial {
+  char buf[LOGSINK_LINE_MAX];
+  size_t len;
+};
+
+#ifndef HAVE_SENDMMSG
+struct mmsghdr {
+  struct msghdr msg_hdr;
+  unsigned int msg_len;
+};
+#endif
+
+static int log_fd = -1;
+static int log_kind;
+static char log_path[sizeof(((struct sockaddr_un*)0)->sun_path)];
+static char log_tag[49];
+static char log_host[256];
+static long log_pid;
+static int log_prio[2];
+static char log_hdr[2][512];
+static size_t log_hdrlen[2];
+static struct logsink_partial log_partial[2];
+
+static struct mmsghdr log_msg[LOGSINK_BATCH];
+static struct iovec log_iov[LOGSINK_BATCH][3];
+static int log_stream[LOGSINK_BATCH];
+static int log_queued;
+static unsigned long log_dropped;
+
+static const char *log_prio_names[] = {
+  "emerg", "alert", "crit", "err", "warning", "notice", "info", "debug",
+  NULL
+};
+
+/**
+ * Parse one priority, by name or number
+ *
+ * @return  priority 0-7, or -1 if invalid
+ */
+static int
+logsink_parse_priority(const char *s, size_t len)
+{
+  int c;
+
+  if (len == 1 && *s >= '0' && *s <= '7') {
+    return *s - '0';
+  }
+  for (c = 0; log_prio_names[c]; c++) {
+    if (len == strlen(log_prio_names[c])
+        && !strncmp(s, log_prio_names[c], len)) {
+      return c;
+    }
+  }
+  return -1;
+}
+
+/**
+ * Parse "<stdout priority>,<stderr priority>", e.g. "info,err"
+ *
+ * @return  0 on success, -1 if invalid
+ */
+int
+logsink_parse_priorities(const char *s, int *prio_out, int *prio_err)
+{
+  const char *comma = strchr(s, ',');
+
+  if (!comma) {
+    return -1;
+  }
+  *prio_out = logsink_parse_priority(s, comma - s);
+  *prio_err = logsink_parse_priority(comma + 1, strlen(comma + 1));
+  if (*prio_out < 0 || *prio_err < 0) {
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * (Re)connect to log_path
+ *
+ * @return  0 on success, -1 on error (errno set)
+ */
+static int
+logsink_connect(void)
+{
+  struct sockaddr_un sa;
+  int fd;
+
+  if (0 <= log_fd) {
+    close(log_fd);
+    log_fd = -1;
+  }
+  memset(&sa, 0, sizeof(sa));
+  sa.sun_family = AF_UNIX;
+  memcpy(sa.sun_path, log_path, sizeof(sa.sun_path));
+
+  if (0 > (fd = socket(AF_UNIX, SOCK_DGRAM, 0))) {
+    return -1;
+  }
+  if (0 > connect(fd, (struct sockaddr*)&sa, sizeof(sa))) {
+    int save = errno;
+    close(fd);
+    errno = save;
+    return -1;
+  }
+  fcntl(fd, F_SETFD, fcntl(fd, F_GETFD) | FD_CLOEXEC);
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  log_fd = fd;
+  return 0;
+}
+
+/**
+ * Set up the per-stream message headers. For syslog they contain the
+ * time, so they are redone before every batch.
+ */
+static void
+logsink_headers(void)
+{
+  char ts[64] = "-";
+  int c;
+
+  if (log_kind == LOGSINK_SYSLOG) {
+    struct timeval tv;
+    struct tm tm;
+    char zone[8];
+
+    gettimeofday(&tv, NULL);
+    if (localtime_r(&tv.tv_sec, &tm)
+        && strftime(zone, sizeof(zone), "%z", &tm) == 5) {
+      size_t n = strftime(ts, sizeof(ts), "%Y-%m-%dT%H:%M:%S", &tm);
+      snprintf(ts + n, sizeof(ts) - n, ".%06ld%.3s:%s",
+               (long)tv.tv_usec, zone, zone + 3);
+    }
+  }
+  for (c = 0; c < 2; c++) {
+    int n;
+    if (log_kind == LOGSINK_JOURNAL) {
+      n = snprintf(log_hdr[c], sizeof(log_hdr[c]),
+                   "PRIORITY=%d\nSYSLOG_IDENTIFIER=%s\nMESSAGE=",
+                   log_prio[c], log_tag);
+    } else {
+      n = snprintf(log_hdr[c], sizeof(log_hdr[c]),
+                   "<%d>1 %s %s %s %ld - - ",
+                   LOGSINK_FACILITY | log_prio[c], ts,
+                   *log_host ? log_host : "-", log_tag, log_pid);
+    }
+    log_hdrlen[c] = (n < 0) ? 0 : ((size_t)n >= sizeof(log_hdr[c])
+                                   ? sizeof(log_hdr[c]) - 1 : (size_t)n);
+  }
+}
+
+/**
+ * Send up to cnt messages
+ *
+ * @return  number of messages sent, or -1 on error (errno set)
+ */
+static int
+logsink_send(struct mmsghdr *msgs, int cnt)
+{
+#ifdef HAVE_SENDMMSG
+  return sendmmsg(log_fd, msgs, cnt, 0);
+#else
+  int c;
+  for (c = 0; c < cnt; c++) {
+    if (0 > sendmsg(log_fd, &msgs[c].msg_hdr, 0)) {
+      return c ? c : -1;
+    }
+  }
+  return cnt;
+#endif
+}
+
+/**
+ * Send all queued messages. What can't be sent is dropped.
+ */
+static void
+logsink_flush(void)
+{
+  int sent = 0;
+  int retried = 0;
+  int c;
+
+  if (!log_queued) {
+    return;
+  }
+  if (log_kind == LOGSINK_SYSLOG) {
+    logsink_headers();
+    for (c = 0; c < log_queued; c++) {
+      log_iov[c][0].iov_len = log_hdrlen[log_stream[c]];
+    }
+  }
+  while (sent < log_queued && 0 <= log_fd) {
+    int n = logsink_send(&log_msg[sent], log_queued - sent);
+    if (n >= 0) {
+      sent += n;
+      continue;
+    }
+    if (errno == EINTR) {
+      continue;
+    }
+    /* receiver is busy. Give it a while, then give up on this batch */
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) {
+      struct pollfd pfd;
+      int r;
+      pfd.fd = log_fd;
+      pfd.events = POLLOUT;
+      do {
+        r = poll(&pfd, 1, LOGSINK_WAIT_MS);
+      } while (0 > r && errno == EINTR);
+      if (0 < r) {
+        continue;
+      }
+      break;
+    }
+    /* receiver restarted? Try once to get back in touch */
+    if (!retried
+        && (errno == ECONNREFUSED || errno == ENOTCONN || errno == ENOENT)) {
+      retried = 1;
+      if (!logsink_connect()) {
+        continue;
+      }
+    }
+    break;
+  }
+  log_dropped += log_queued - sent;
+  log_queued = 0;
+}
+
+/**
+ * Queue one message, splitting it if it's too long
+ */
+static void
+logsink_queue(int err, const char *p, size_t len)
+{
+  do {
+    size_t n = (len > LOGSINK_LINE_MAX) ? LOGSINK_LINE_MAX : len;
+    struct iovec *iov;
+
+    if (log_queued == LOGSINK_BATCH) {
+      logsink_flush();
+    }
+    iov = log_iov[log_queued];
+    iov[0].iov_base = log_hdr[err];
+    iov[0].iov_len = log_hdrlen[err];
+    iov[1].iov_base = (void*)p;
+    iov[1].iov_len = n;
+    iov[2].iov_base = "\n";
+    iov[2].iov_len = 1;
+    memset(&log_msg[log_queued], 0, sizeof(log_msg[log_queued]));
+    log_msg[log_queued].msg_hdr.msg_iov = iov;
+    log_msg[log_queued].msg_hdr.msg_iovlen =
+      (log_kind == LOGSINK_JOURNAL) ? 3 : 2;
+    log_stream[log_queued] = err;
+    log_queued++;
+    p += n;
+    len -= n;
+  } while (len);
+}
+
+/**
+ * Start sending lines to a log socket.
+ *
+ * @param   kind:     LOGSINK_JOURNAL or LOGSINK_SYSLOG
+ * @param   path:     socket to send to, or NULL for the default. If the
+ *                    journal isn't there the syslog socket is tried.
+ * @param   tag:      program name to log as
+ * @param   pid:      process id to log as
+ * @param   prio_out: priority of stdout lines
+ * @param   prio_err: priority of stderr lines
+ *
+ * @return  0 on success, -1 on error (errno set)
+ */
+int
+logsink_open(int kind, const char *path, const char *tag, long pid,
+             int prio_out, int prio_err)
+{
+  const char *base = strrchr(tag, '/');
+  char *p;
+
+  log_kind = kind;
+  log_pid = pid;
+  log_prio[0] = prio_out;
+  log_prio[1] = prio_err;
+  snprintf(log_tag, sizeof(log_tag), "%s", base ? base + 1 : tag);
+  for (p = log_tag; *p; p++) {
+    if (*p <= ' ' || *p > '~') {
+      *p = '_';
+    }
+  }
+  if (0 > gethostname(log_host, sizeof(log_host))) {
+    log_host[0] = 0;
+  }
+  log_host[sizeof(log_host) - 1] = 0;
+
+  if (!path) {
+    path = (kind == LOGSINK_JOURNAL)
+      ? LOGSINK_JOURNAL_PATH : LOGSINK_SYSLOG_PATH;
+  }
+  snprintf(log_path, sizeof(log_path), "%s", path);
+  if (logsink_connect()) {
+    if (kind != LOGSINK_JOURNAL || strcmp(path, LOGSINK_JOURNAL_PATH)) {
+      return -1;
+    }
+    /* no journald, fall back to syslog */
+    log_kind = LOGSINK_SYSLOG;
+    snprintf(log_path, sizeof(log_path), "%s", LOGSINK_SYSLOG_PATH);
+    if (logsink_connect()) {
+      return -1;
+    }
+  }
+  logsink_headers();
+  return 0;
+}
+
+/**
+ * Queue the complete lines in a chunk of child output and send them.
+ * The start of an unfinished line is kept until its end shows up.
+ *
+ * @param   err:   nonzero if the data came from stderr
+ * @param   buf:   data
+ * @param   len:   length of data
+ */
+void
+logsink_chunk(int err, const char *buf, size_t len)
+{
+  struct logsink_partial *part;
+  const char *end = buf + len;
+  const char *nl;
+
+  if (0 > log_fd) {
+    return;
+  }
+  err = !!err;
+  part = &log_partial[err];
+
+  /* complete lines. A partial line is queued at most once per chunk, so
+   * it's not touched again until after the flush below. */
+  while ((nl = memchr(buf, '\n', end - buf))) {
+    size_t n = nl - buf;
+    if (part->len) {
+      size_t take = LOGSINK_LINE_MAX - part->len;
+      if (take > n) {
+        take = n;
+      }
+      memcpy(part->buf + part->len, buf, take);
+      part->len += take;
+      buf += take;
+      n -= take;
+      if (!n && part->buf[part->len - 1] == '\r') {
+        part->len--;
+      }
+      if (part->len) {
+        logsink_queue(err, part->buf, part->len);
+      }
+    }
+    if (n && buf[n - 1] == '\r') {
+      n--;
+    }
+    if (n || !part->len) {
+      logsink_queue(err, buf, n);
+    }
+    part->len = 0;
+    buf = nl + 1;
+  }
+  logsink_flush();
+
+  /* keep the rest for next time */
+  while (buf < end) {
+    size_t take = LOGSINK_LINE_MAX - part->len;
+    if (take > (size_t)(end - buf)) {
+      take = end - buf;
+    }
+    memcpy(part->buf + part->len, buf, take);
+    part->len += take;
+    buf += take;
+    if (part->len == LOGSINK_LINE_MAX) {
+      logsink_queue(err, part->buf, part->len);
+      logsink_flush();
+      part->len = 0;
+    }
+  }
+}
+
+/**
+ * Send any unfinished lines and close the socket
+ */
+void
+logsink_close(void)
+{
+  int c;
+
+  if (0 > log_fd) {
+    return;
+  }
+  for (c = 0; c < 2; c++) {
+    if (log_partial[c].len) {
+      logsink_queue(c, log_partial[c].buf, log_partial[c].len);
+      log_partial[c].len = 0;
+    }
+  }
+  logsink_flush();
+  close(log_fd);
+  log_fd = -1;
+  if (log_dropped) {
+    fprintf(stderr, "ind: %lu log messages could not be sent to %s\n",
+            log_dropped, log_path);
+  }
+}
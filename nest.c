@@ -0,0 +1,400 @@
+/* ind/nest.c - handing output over to an outer ind
+ *
+ * (BSD license without advertising clause below)
+ *
+ * Copyright (c) 2019 Thomas Habets <thomas@habets.se>. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+/*
+ * An ind running a command with --nest offers a control socket to
+ * everything below it, by leaving one end of a datagram socketpair open in
+ * the child and naming it in $IND_NEST. An ind further down the tree sends
+ * one message on it:
+ *
+ *   header (NEST_MAGIC, stream ids, template lengths)
+ *   prefix, postfix, eprefix, epostfix, resolved and without NULs
+ *   SCM_RIGHTS: child stdout read end, child stderr read end, reply socket
+ *
+ * The outer ind looks up the stream ids to find which of its streams the
+ * nested ind's stdout and stderr are, and answers 'y' or 'n' on the reply
+ * socket. Each message is one datagram, so any number of nested inds can
+ * share the socket, and the answer goes only to the one that asked.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "nest.h"
+
+#define NEST_MAGIC "INDNEST1"
+
+/* templates longer than this together are decorated the normal way */
+#define NEST_MSG_MAX 65536
+
+struct nest_hdr {
+  char magic[8];
+  uint64_t dev[4];   /* parent stdout, parent stderr, child stdout, stderr */
+  uint64_t ino[4];
+  uint32_t len[4];   /* of the templates following the header */
+};
+
+#ifndef MSG_CMSG_CLOEXEC
+#define MSG_CMSG_CLOEXEC 0
+#endif
+
+/**
+ * Get what fd is, to compare with what another process has.
+ *
+ * @return  0 on success, -1 on error (errno set)
+ */
+int
+nest_id_get(int fd, struct nest_id *id)
+{
+  struct stat st;
+
+  if (fstat(fd, &st)) {
+    return -1;
+  }
+  id->dev = st.st_dev;
+  id->ino = st.st_ino;
+  return 0;
+}
+
+/**
+ *
+ */
+int
+nest_id_eq(const struct nest_id *a, const struct nest_id *b)
+{
+  return a->dev == b->dev && a->ino == b->ino;
+}
+
+/**
+ * Create the control socket and export it to children.
+ *
+ * @param   theirs:  set to the end the child should inherit. Close it once
+ *                   the child is started.
+ *
+ * @return  our end, non-blocking, or -1 on error (errno set)
+ */
+int
+nest_offer(int *theirs)
+{
+  int sv[2];
+  char num[16];
+
+  if (socketpair(AF_UNIX, SOCK_DGRAM, 0, sv)) {
+    return -1;
+  }
+  snprintf(num, sizeof(num), "%d", sv[1]);
+  if (fcntl(sv[0], F_SETFD, FD_CLOEXEC)
+      || fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL) | O_NONBLOCK)
+      || setenv(NEST_ENV, num, 1)) {
+    int save = errno;
+    close(sv[0]);
+    close(sv[1]);
+    errno = save;
+    return -1;
+  }
+  *theirs = sv[1];
+  return sv[0];
+}
+
+/**
+ * Close the fds of a message that can't be used
+ */
+static void
+close_fds(struct msghdr *msg)
+{
+  struct cmsghdr *cmsg;
+
+  for (cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+      int *fds = (int*)CMSG_DATA(cmsg);
+      size_t n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      size_t c;
+      for (c = 0; c < n; c++) {
+        close(fds[c]);
+      }
+    }
+  }
+}
+
+/**
+ * Take one message off the control socket. Broken messages are dropped.
+ *
+ * @return  1 if r was filled in, 0 if there is nothing (more) to read
+ */
+int
+nest_receive(int ctl, struct nest_reg *r)
+{
+  static char buf[sizeof(struct nest_hdr) + NEST_MSG_MAX];
+  union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(3 * sizeof(int))];
+  } cbuf;
+
+  for (;;) {
+    struct nest_hdr hdr;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct iovec iov;
+    const char *p;
+    ssize_t n;
+    size_t total;
+    int c;
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = buf;
+    iov.iov_len = sizeof(buf);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf.buf;
+    msg.msg_controllen = sizeof(cbuf.buf);
+    do {
+      n = recvmsg(ctl, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+    } while (0 > n && errno == EINTR);
+    if (0 > n) {
+      return 0;
+    }
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if ((msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC))
+        || (size_t)n < sizeof(hdr)
+        || !cmsg
+        || cmsg->cmsg_level != SOL_SOCKET
+        || cmsg->cmsg_type != SCM_RIGHTS
+        || cmsg->cmsg_len != CMSG_LEN(3 * sizeof(int))) {
+      close_fds(&msg);
+      continue;
+    }
+    memcpy(&hdr, buf, sizeof(hdr));
+    for (total = 0, c = 0; c < 4; c++) {
+      total += hdr.len[c];
+    }
+    if (memcmp(hdr.magic, NEST_MAGIC, sizeof(hdr.magic))
+        || total != n - sizeof(hdr)) {
+      close_fds(&msg);
+      continue;
+    }
+
+    memset(r, 0, sizeof(*r));
+    memcpy(&r->fd[0], CMSG_DATA(cmsg), sizeof(int));
+    memcpy(&r->fd[1], CMSG_DATA(cmsg) + sizeof(int), sizeof(int));
+    memcpy(&r->reply, CMSG_DATA(cmsg) + 2 * sizeof(int), sizeof(int));
+    for (c = 0; c < 2; c++) {
+      r->parent[c].dev = hdr.dev[c];
+      r->parent[c].ino = hdr.ino[c];
+      r->child[c].dev = hdr.dev[c + 2];
+      r->child[c].ino = hdr.ino[c + 2];
+    }
+    for (p = buf + sizeof(hdr), c = 0; c < 4; p += hdr.len[c], c++) {
+      if (!(r->tmpl[c] = malloc(hdr.len[c] + 1))) {
+        nest_reg_free(r);
+        return 0;
+      }
+      memcpy(r->tmpl[c], p, hdr.len[c]);
+      r->tmpl[c][hdr.len[c]] = 0;
+      if (strlen(r->tmpl[c]) != hdr.len[c]) {
+        nest_reg_free(r);
+        break;
+      }
+    }
+    if (c == 4) {
+      return 1;
+    }
+  }
+}
+
+/**
+ * Tell the nested ind whether its output was taken. Closes the reply socket.
+ */
+void
+nest_reply(struct nest_reg *r, int ok)
+{
+  char c = ok ? 'y' : 'n';
+
+  if (0 <= r->reply) {
+    while (0 > write(r->reply, &c, 1) && errno == EINTR);
+    close(r->reply);
+    r->reply = -1;
+  }
+}
+
+/**
+ * Free a message, closing whatever fds have not been taken (set to -1).
+ */
+void
+nest_reg_free(struct nest_reg *r)
+{
+  int c;
+
+  for (c = 0; c < 2; c++) {
+    if (0 <= r->fd[c]) {
+      close(r->fd[c]);
+      r->fd[c] = -1;
+    }
+  }
+  nest_reply(r, 0);
+  for (c = 0; c < 4; c++) {
+    free(r->tmpl[c]);
+    r->tmpl[c] = NULL;
+  }
+}
+
+/**
+ * Find the control socket of an outer ind, if there is one.
+ *
+ * @return  fd, or -1 if not running under ind
+ */
+int
+nest_find(void)
+{
+  const char *env = getenv(NEST_ENV);
+  struct stat st;
+  char *end;
+  long fd;
+  int type;
+  socklen_t len = sizeof(type);
+
+  if (!env || !*env) {
+    return -1;
+  }
+  fd = strtol(env, &end, 10);
+  if (*end || fd <= 2 || fd > 65535
+      || fstat(fd, &st) || !S_ISSOCK(st.st_mode)
+      || getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &len)
+      || type != SOCK_DGRAM) {
+    return -1;
+  }
+  return fd;
+}
+
+/**
+ * Keep an outer ind's control socket from our child, when the output
+ * doesn't go straight to that ind. Nothing below us could use it.
+ */
+void
+nest_scrub(void)
+{
+  int fd;
+
+  if (0 <= (fd = nest_find())) {
+    close(fd);
+  }
+  unsetenv(NEST_ENV);
+}
+
+/**
+ * Hand the output of our child over to the outer ind, and wait for the
+ * answer. The fds in r are not closed.
+ *
+ * @return  0 if the outer ind took it, -1 if not
+ */
+int
+nest_register(int ctl, const struct nest_reg *r)
+{
+  static char buf[sizeof(struct nest_hdr) + NEST_MSG_MAX];
+  union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(3 * sizeof(int))];
+  } cbuf;
+  struct nest_hdr hdr;
+  struct msghdr msg;
+  struct cmsghdr *cmsg;
+  struct iovec iov;
+  size_t total = sizeof(hdr);
+  int rep[2];
+  int fds[3];
+  ssize_t n;
+  char answer = 0;
+  int c;
+
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, NEST_MAGIC, sizeof(hdr.magic));
+  for (c = 0; c < 2; c++) {
+    hdr.dev[c] = r->parent[c].dev;
+    hdr.ino[c] = r->parent[c].ino;
+    hdr.dev[c + 2] = r->child[c].dev;
+    hdr.ino[c + 2] = r->child[c].ino;
+  }
+  for (c = 0; c < 4; c++) {
+    hdr.len[c] = strlen(r->tmpl[c]);
+    if (total + hdr.len[c] > sizeof(buf)) {
+      errno = EMSGSIZE;
+      return -1;
+    }
+    memcpy(buf + total, r->tmpl[c], hdr.len[c]);
+    total += hdr.len[c];
+  }
+  memcpy(buf, &hdr, sizeof(hdr));
+
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, rep)) {
+    return -1;
+  }
+  fds[0] = r->fd[0];
+  fds[1] = r->fd[1];
+  fds[2] = rep[1];
+
+  memset(&msg, 0, sizeof(msg));
+  iov.iov_base = buf;
+  iov.iov_len = total;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = cbuf.buf;
+  msg.msg_controllen = sizeof(cbuf.buf);
+  cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+  memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+  do {
+    n = sendmsg(ctl, &msg, 0);
+  } while (0 > n && errno == EINTR);
+  close(rep[1]);
+  if (0 > n) {
+    close(rep[0]);
+    return -1;
+  }
+
+  /* the outer ind is alive, since we're keeping one of its streams open */
+  do {
+    n = read(rep[0], &answer, 1);
+  } while (0 > n && errno == EINTR);
+  close(rep[0]);
+  return (1 == n && answer == 'y') ? 0 : -1;
+}
@@ -0,0 +1,64 @@
+/* ind/nest.h - handing output over to an outer ind
+ *
+ * (BSD license without advertising clause below)
+ *
+ * Copyright (c) 2019 Thomas Habets <thomas@habets.se>. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef __INCLUDE_NEST_H__
+#define __INCLUDE_NEST_H__
+
+/* environment variable with the fd of the outer ind's control socket */
+#define NEST_ENV "IND_NEST"
+
+/* what a stream is, as seen by the process writing to it */
+struct nest_id {
+  unsigned long long dev;
+  unsigned long long ino;
+};
+
+/* a nested ind handing its child's output over */
+struct nest_reg {
+  struct nest_id parent[2];  /* the nested ind's own stdout and stderr */
+  struct nest_id child[2];   /* its child's stdout and stderr */
+  char *tmpl[4];             /* prefix, postfix, eprefix, epostfix */
+  int fd[2];                 /* read ends of the child's stdout and stderr */
+  int reply;
+};
+
+int nest_id_get(int fd, struct nest_id *id);
+int nest_id_eq(const struct nest_id *a, const struct nest_id *b);
+
+/* outer side */
+int nest_offer(int *theirs);
+int nest_receive(int ctl, struct nest_reg *r);
+void nest_reply(struct nest_reg *r, int ok);
+void nest_reg_free(struct nest_reg *r);
+
+/* nested side */
+int nest_find(void);
+void nest_scrub(void);
+int nest_register(int ctl, const struct nest_reg *r);
+
+#endif
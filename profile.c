@@ -0,0 +1,318 @@
+/* ind/profile.c - resource usage report of the child
+ *
+ * (BSD license without advertising clause below)
+ *
+ * Copyright (c) 2019 Thomas Habets <thomas@habets.se>. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "profile.h"
+
+static pid_t profile_pid;
+static struct timespec profile_started;
+static long profile_threads = -1;
+static long profile_fds = -1;
+
+/* how output destinations held ind up */
+#define PROFILE_STALLS_MAX 2
+static struct {
+  const char *name;
+  unsigned long count;
+  double total;
+  double max;
+} profile_stalls[PROFILE_STALLS_MAX];
+static int profile_nstalls = 0;
+
+/* how long child streams waited to be read, once ind was awake */
+#define PROFILE_LATENCY_MAX 16
+static struct {
+  const char *name;
+  unsigned long count;
+  double total;
+  double max;
+} profile_lat[PROFILE_LATENCY_MAX];
+static int profile_nlat = 0;
+
+/**
+ * Start the wall clock for a child that was just started
+ */
+void
+profile_start(pid_t pid)
+{
+  profile_pid = pid;
+  clock_gettime(CLOCK_MONOTONIC, &profile_started);
+}
+
+/**
+ * Look at /proc/<pid> and remember peak thread and fd counts. Quietly does
+ * nothing where there's no /proc.
+ */
+void
+profile_sample(void)
+{
+  char fn[64];
+  char line[256];
+  FILE *f;
+  DIR *d;
+
+  snprintf(fn, sizeof(fn), "/proc/%ld/status", (long)profile_pid);
+  if ((f = fopen(fn, "r"))) {
+    while (fgets(line, sizeof(line), f)) {
+      long n;
+      if (1 == sscanf(line, "Threads: %ld", &n)) {
+        if (n > profile_threads) {
+          profile_threads = n;
+        }
+        break;
+      }
+    }
+    fclose(f);
+  }
+
+  snprintf(fn, sizeof(fn), "/proc/%ld/fd", (long)profile_pid);
+  if ((d = opendir(fn))) {
+    struct dirent *de;
+    long n = 0;
+    while ((de = readdir(d))) {
+      if (de->d_name[0] != '.') {
+        n++;
+      }
+    }
+    closedir(d);
+    if (n > profile_fds) {
+      profile_fds = n;
+    }
+  }
+}
+
+/**
+ * Add stall times of an output destination to the report
+ *
+ * @param   name:   e.g. "stdout". Not copied.
+ * @param   count:  number of stalls
+ * @param   total:  seconds stalled in total
+ * @param   max:    longest stall, in seconds
+ */
+void
+profile_stall(const char *name, unsigned long count, double total,
+              double max)
+{
+  if (profile_nstalls < PROFILE_STALLS_MAX) {
+    profile_stalls[profile_nstalls].name = name;
+    profile_stalls[profile_nstalls].count = count;
+    profile_stalls[profile_nstalls].total = total;
+    profile_stalls[profile_nstalls].max = max;
+    profile_nstalls++;
+  }
+}
+
+/**
+ * Add the read delay of a child stream to the report: how long it waited,
+ * after select() found it readable, before ind got to reading it. Time
+ * before select() returned is not known, and not counted.
+ *
+ * @param   name:   e.g. "stdout". Not copied.
+ * @param   count:  number of times it was read
+ * @param   total:  seconds waited in total
+ * @param   max:    longest wait, in seconds
+ */
+void
+profile_read_delay(const char *name, unsigned long count, double total,
+                   double max)
+{
+  if (profile_nlat < PROFILE_LATENCY_MAX) {
+    profile_lat[profile_nlat].name = name;
+    profile_lat[profile_nlat].count = count;
+    profile_lat[profile_nlat].total = total;
+    profile_lat[profile_nlat].max = max;
+    profile_nlat++;
+  }
+}
+
+/**
+ * Write string as a JSON string
+ */
+static void
+profile_json_string(FILE *f, const char *s)
+{
+  putc('"', f);
+  for (; *s; s++) {
+    unsigned char ch = *s;
+    if (ch == '"' || ch == '\\') {
+      fprintf(f, "\\%c", ch);
+    } else if (ch < 0x20) {
+      fprintf(f, "\\u%04x", ch);
+    } else {
+      putc(ch, f);
+    }
+  }
+  putc('"', f);
+}
+
+/**
+ * Seconds in a timeval
+ */
+static double
+profile_tv(const struct timeval *tv)
+{
+  return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+/**
+ * Write the report, as one line of text or one JSON object.
+ *
+ * @param   fn:      file to append to, or NULL for stderr
+ * @param   json:    nonzero for JSON
+ * @param   cmd:     command line of the child
+ * @param   status:  wait status of the child
+ * @param   ru:      resource usage of the child
+ */
+void
+profile_report(const char *fn, int json, const char *cmd, int status,
+               const struct rusage *ru)
+{
+  struct timespec now;
+  double wall;
+  FILE *f = stderr;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  wall = (now.tv_sec - profile_started.tv_sec)
+    + (now.tv_nsec - profile_started.tv_nsec) / 1e9;
+
+  if (fn && !(f = fopen(fn, "a"))) {
+    fprintf(stderr, "ind: can't open %s for profile: %s\n",
+            fn, strerror(errno));
+    f = stderr;
+  }
+
+  /* ru_maxrss is kB on Linux and the BSDs, ru_[io]ublock 512 byte blocks */
+  if (json) {
+    fprintf(f, "{\"cmd\":");
+    profile_json_string(f, cmd);
+    if (WIFSIGNALED(status)) {
+      fprintf(f, ",\"exit\":null,\"signal\":%d", WTERMSIG(status));
+    } else {
+      fprintf(f, ",\"exit\":%d,\"signal\":null", WEXITSTATUS(status));
+    }
+    fprintf(f, ",\"wall_s\":%.6f,\"user_s\":%.6f,\"sys_s\":%.6f"
+            ",\"maxrss_kb\":%ld,\"nvcsw\":%ld,\"nivcsw\":%ld"
+            ",\"read_bytes\":%lld,\"write_bytes\":%lld",
+            wall, profile_tv(&ru->ru_utime), profile_tv(&ru->ru_stime),
+            (long)ru->ru_maxrss, (long)ru->ru_nvcsw, (long)ru->ru_nivcsw,
+            (long long)ru->ru_inblock * 512,
+            (long long)ru->ru_oublock * 512);
+    if (profile_threads >= 0) {
+      fprintf(f, ",\"peak_threads\":%ld", profile_threads);
+    }
+    if (profile_fds >= 0) {
+      fprintf(f, ",\"peak_fds\":%ld", profile_fds);
+    }
+    if (profile_nstalls) {
+      int c;
+      fprintf(f, ",\"stalls\":{");
+      for (c = 0; c < profile_nstalls; c++) {
+        fprintf(f, "%s", c ? "," : "");
+        profile_json_string(f, profile_stalls[c].name);
+        fprintf(f, ":{\"count\":%lu,\"total_s\":%.6f,\"max_s\":%.6f}",
+                profile_stalls[c].count, profile_stalls[c].total,
+                profile_stalls[c].max);
+      }
+      fprintf(f, "}");
+    }
+    if (profile_nlat) {
+      int c;
+      fprintf(f, ",\"read_delay\":{");
+      for (c = 0; c < profile_nlat; c++) {
+        fprintf(f, "%s", c ? "," : "");
+        profile_json_string(f, profile_lat[c].name);
+        fprintf(f, ":{\"count\":%lu,\"total_s\":%.6f,\"max_s\":%.6f}",
+                profile_lat[c].count, profile_lat[c].total,
+                profile_lat[c].max);
+      }
+      fprintf(f, "}");
+    }
+    fprintf(f, "}\n");
+  } else {
+    fprintf(f, "ind: %s: ", cmd);
+    if (WIFSIGNALED(status)) {
+      fprintf(f, "signal %d", WTERMSIG(status));
+    } else {
+      fprintf(f, "exit %d", WEXITSTATUS(status));
+    }
+    fprintf(f, ", wall %.3fs, user %.3fs, sys %.3fs, maxrss %ld kB"
+            ", ctxsw %ld/%ld, read %lld B, written %lld B",
+            wall, profile_tv(&ru->ru_utime), profile_tv(&ru->ru_stime),
+            (long)ru->ru_maxrss, (long)ru->ru_nvcsw, (long)ru->ru_nivcsw,
+            (long long)ru->ru_inblock * 512,
+            (long long)ru->ru_oublock * 512);
+    if (profile_threads >= 0) {
+      fprintf(f, ", threads %ld", profile_threads);
+    }
+    if (profile_fds >= 0) {
+      fprintf(f, ", fds %ld", profile_fds);
+    }
+    {
+      int c;
+      for (c = 0; c < profile_nstalls; c++) {
+        if (profile_stalls[c].count) {
+          fprintf(f, ", %s stalled %lu times %.3fs (max %.3fs)",
+                  profile_stalls[c].name, profile_stalls[c].count,
+                  profile_stalls[c].total, profile_stalls[c].max);
+        }
+      }
+    }
+    {
+      int c;
+      for (c = 0; c < profile_nlat; c++) {
+        if (profile_lat[c].count) {
+          fprintf(f, ", %s read delay %.3fms avg (max %.3fms)",
+                  profile_lat[c].name,
+                  profile_lat[c].total * 1000 / profile_lat[c].count,
+                  profile_lat[c].max * 1000);
+        }
+      }
+    }
+    fprintf(f, "\n");
+  }
+  if (f != stderr) {
+    fclose(f);
+  } else {
+    fflush(f);
+  }
+}
@@ -0,0 +1,347 @@
+/* ind/record.c - session recording and replay
+ *
+ * (BSD license without advertising clause below)
+ *
+ * Copyright (c) 2019 Thomas Habets <thomas@habets.se>. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+/*
+ * Trace file format (native byte order):
+ *
+ *   "INDREC01"                                  file magic, written once
+ *   { u64 ns, u32 len, u8 stream, u8 pad[3] }   record header
+ *   <len bytes>                                 raw data
+ *   ...
+ *
+ * ns is CLOCK_MONOTONIC nanoseconds since the start of the session. Every
+ * ind run appends a RECORD_SESSION record first, whose data is the
+ * CLOCK_REALTIME start time (u64 ns) followed by the command line.
+ *
+ * The file is only ever appended to, so several runs (or a run that
+ * was killed) leave a readable trace behind. A new file is created with
+ * the magic already in it, under a temporary name that's then linked
+ * into place, so that inds starting at the same time (e.g. nested ones,
+ * which inherit $IND_RECORD) can't append before it.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+#include "record.h"
+
+static const char record_magic[8] = { 'I','N','D','R','E','C','0','1' };
+
+struct record_hdr {
+  uint64_t ns;
+  uint32_t len;
+  uint8_t stream;
+  uint8_t pad[3];
+};
+
+static int record_fd = -1;
+static uint64_t record_start;
+
+/**
+ * Monotonic time in nanoseconds
+ */
+static uint64_t
+record_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Append one record with a single writev(). On error recording is
+ * turned off, the child keeps running.
+ */
+static void
+record_write(int stream, uint64_t ns,
+             const void *buf1, size_t len1,
+             const void *buf2, size_t len2)
+{
+  struct record_hdr hdr;
+  struct iovec iov[3];
+  ssize_t n;
+
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.ns = ns;
+  hdr.len = len1 + len2;
+  hdr.stream = stream;
+
+  iov[0].iov_base = &hdr;
+  iov[0].iov_len = sizeof(hdr);
+  iov[1].iov_base = (void*)buf1;
+  iov[1].iov_len = len1;
+  iov[2].iov_base = (void*)buf2;
+  iov[2].iov_len = len2;
+
+  do {
+    n = writev(record_fd, iov, 3);
+  } while ((-1 == n) && (errno == EINTR));
+  if (n != (ssize_t)(sizeof(hdr) + len1 + len2)) {
+    fprintf(stderr, "ind: writing trace failed, recording stopped: %s\n",
+            (n < 0) ? strerror(errno) : "short write");
+    record_close();
+  }
+}
+
+/**
+ * Create fn with the file magic in it, unless it's already there
+ *
+ * @return  0 on success or if fn exists, -1 on error (errno set)
+ */
+static int
+record_create(const char *fn)
+{
+  char *tmp;
+  mode_t mask;
+  int fd;
+  int ret = -1;
+  int save;
+
+  if (!(tmp = malloc(strlen(fn) + 8))) {
+    return -1;
+  }
+  sprintf(tmp, "%s.XXXXXX", fn);
+  if (0 > (fd = mkstemp(tmp))) {
+    save = errno;
+    free(tmp);
+    errno = save;
+    return -1;
+  }
+  mask = umask(0);
+  umask(mask);
+  if (!fchmod(fd, 0644 & ~mask)
+      && sizeof(record_magic) == write(fd, record_magic,
+                                       sizeof(record_magic))
+      && (!link(tmp, fn) || errno == EEXIST)) {
+    ret = 0;
+  }
+  save = errno;
+  close(fd);
+  unlink(tmp);
+  free(tmp);
+  errno = save;
+  return ret;
+}
+
+/**
+ * Open trace file for appending and write the session record
+ *
+ * @param   fn:    trace file name
+ * @param   argv:  command line of the child, stored in the session record
+ *
+ * @return  0 on success, -1 on error (errno set)
+ */
+int
+record_open(const char *fn, char * const *argv)
+{
+  struct stat st;
+  struct timespec ts;
+  uint64_t realtime;
+  char *cmd;
+  size_t cmdlen = 0;
+  int c;
+
+  if (0 > (record_fd = open(fn, O_WRONLY | O_APPEND))
+      && (errno != ENOENT || record_create(fn)
+          || 0 > (record_fd = open(fn, O_WRONLY | O_APPEND)))) {
+    return -1;
+  }
+  fcntl(record_fd, F_SETFD, FD_CLOEXEC);
+  if (fstat(record_fd, &st)) {
+    record_close();
+    return -1;
+  }
+  if (!st.st_size) {
+    /* created some other way */
+    if (sizeof(record_magic) != write(record_fd, record_magic,
+                                      sizeof(record_magic))) {
+      record_close();
+      return -1;
+    }
+  }
+
+  for (c = 0; argv[c]; c++) {
+    cmdlen += strlen(argv[c]) + 1;
+  }
+  if (!(cmd = malloc(cmdlen + 1))) {
+    fprintf(stderr, "ind: Memory alloc of %zd bytes failed!\n", cmdlen + 1);
+    exit(1);
+  }
+  *cmd = 0;
+  for (c = 0; argv[c]; c++) {
+    if (c) {
+      strcat(cmd, " ");
+    }
+    strcat(cmd, argv[c]);
+  }
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  realtime = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+  record_start = record_now();
+  record_write(RECORD_SESSION, 0, &realtime, sizeof(realtime),
+               cmd, strlen(cmd));
+  free(cmd);
+  return (record_fd < 0) ? -1 : 0;
+}
+
+/**
+ * Record a chunk of raw data read from the child
+ */
+void
+record_chunk(int stream, const char *buf, size_t len)
+{
+  if (record_fd < 0) {
+    return;
+  }
+  record_write(stream, record_now() - record_start, buf, len, NULL, 0);
+}
+
+/**
+ *
+ */
+void
+record_close(void)
+{
+  int fd = record_fd;
+  record_fd = -1;
+  if (fd >= 0) {
+    close(fd);
+  }
+}
+
+/**
+ * Sleep until 'target' (monotonic ns)
+ */
+static void
+replay_sleep_until(uint64_t target)
+{
+  uint64_t now = record_now();
+  struct timespec ts;
+
+  if (target <= now) {
+    return;
+  }
+  ts.tv_sec = (target - now) / 1000000000ULL;
+  ts.tv_nsec = (target - now) % 1000000000ULL;
+  while (nanosleep(&ts, &ts) && errno == EINTR) {
+  }
+}
+
+/**
+ * Replay a trace file, calling cb() for every data record
+ *
+ * @param   fn:     trace file name
+ * @param   speed:  1.0 is real speed, 2.0 twice as fast. <= 0 means as fast
+ *                  as possible
+ * @param   cb:     called for every data record
+ * @param   arg:    passed to cb
+ *
+ * @return  0 on success, -1 on error (message already printed)
+ */
+int
+replay(const char *fn, double speed, replay_cb_t cb, void *arg)
+{
+  struct stat st;
+  const char *map;
+  size_t off;
+  uint64_t start = 0;
+  int fd;
+  int ret = 0;
+
+  if (0 > (fd = open(fn, O_RDONLY))) {
+    fprintf(stderr, "ind: open(%s): %s\n", fn, strerror(errno));
+    return -1;
+  }
+  if (fstat(fd, &st)) {
+    fprintf(stderr, "ind: fstat(%s): %s\n", fn, strerror(errno));
+    close(fd);
+    return -1;
+  }
+  if ((size_t)st.st_size < sizeof(record_magic)) {
+    fprintf(stderr, "ind: %s: not an ind trace file\n", fn);
+    close(fd);
+    return -1;
+  }
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    fprintf(stderr, "ind: mmap(%s): %s\n", fn, strerror(errno));
+    return -1;
+  }
+#ifdef MADV_SEQUENTIAL
+  madvise((void*)map, st.st_size, MADV_SEQUENTIAL);
+#endif
+  if (memcmp(map, record_magic, sizeof(record_magic))) {
+    fprintf(stderr, "ind: %s: not an ind trace file\n", fn);
+    munmap((void*)map, st.st_size);
+    return -1;
+  }
+
+  for (off = sizeof(record_magic); off < (size_t)st.st_size;) {
+    struct record_hdr hdr;
+
+    if (st.st_size - off < sizeof(hdr)) {
+      fprintf(stderr, "ind: %s: truncated record at offset %zd\n", fn, off);
+      ret = -1;
+      break;
+    }
+    memcpy(&hdr, map + off, sizeof(hdr));
+    off += sizeof(hdr);
+    if (st.st_size - off < hdr.len) {
+      fprintf(stderr, "ind: %s: truncated record at offset %zd\n",
+              fn, off - sizeof(hdr));
+      ret = -1;
+      break;
+    }
+
+    if (hdr.stream == RECORD_SESSION) {
+      start = record_now();
+    } else {
+      if (speed > 0) {
+        replay_sleep_until(start + (uint64_t)(hdr.ns / speed));
+      }
+      cb(hdr.stream, map + off, hdr.len, arg);
+    }
+    off += hdr.len;
+  }
+  munmap((void*)map, st.st_size);
+  return ret;
+}
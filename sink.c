@@ -0,0 +1,334 @@
+/* ind/sink.c - non-blocking output with a queue
+ *
+ * (BSD license without advertising clause below)
+ *
+ * Copyright (c) 2019 Thomas Habets <thomas@habets.se>. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+/*
+ * A destination (stdout or stderr) in non-blocking mode. What it won't
+ * take right away is queued and written when select() says it's writable,
+ * so that a slow reader of one destination doesn't hold up the others.
+ * The caller stops reading whatever feeds a sink that is sink_full().
+ *
+ * O_NONBLOCK is not set on the fd given: its file status flags are shared
+ * with the shell and whatever else writes there, and would stay changed if
+ * ind was killed. Pipes, terminals and the like are opened again through
+ * /proc instead, which gives a file description of ind's own. Files don't
+ * block for long, and are written to as they are, as is anything that
+ * can't be opened again.
+ *
+ * The time from first having to queue until the queue is empty again is
+ * a stall, i.e. time spent waiting for the reader, not for ind.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <poll.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "sink.h"
+#include "trace.h"
+
+struct sink {
+  int fd;               /* written to */
+  int own;              /* fd opened for the sink, or -1 */
+  int failed;           /* errno of failed write, after which all fail */
+  char *buf;            /* queue is buf[start .. start+len) */
+  size_t start;
+  size_t len;
+  size_t size;
+
+  /* stall accounting */
+  struct timespec stall_start;
+  unsigned long stalls;
+  double stall_total;
+  double stall_max;
+};
+
+/**
+ * Make a sink for fd, non-blocking if it can be opened again
+ *
+ * @return  new sink, or NULL if out of memory
+ */
+struct sink *
+sink_new(int fd)
+{
+  struct sink *k;
+  struct stat st;
+
+  if (!(k = calloc(1, sizeof(struct sink)))) {
+    return NULL;
+  }
+  k->fd = fd;
+  k->own = -1;
+  if (!fstat(fd, &st) && !S_ISREG(st.st_mode) && !S_ISBLK(st.st_mode)) {
+    char proc[64];
+    snprintf(proc, sizeof(proc), "/proc/self/fd/%d", fd);
+    if (0 <= (k->own = open(proc, O_WRONLY | O_NONBLOCK | O_NOCTTY))) {
+      fcntl(k->own, F_SETFD, FD_CLOEXEC);
+      k->fd = k->own;
+    }
+  }
+  return k;
+}
+
+/**
+ *
+ */
+void
+sink_free(struct sink *k)
+{
+  if (k) {
+    if (0 <= k->own) {
+      close(k->own);
+    }
+    free(k->buf);
+    free(k);
+  }
+}
+
+/**
+ * The fd written to, to select() on
+ */
+int
+sink_fd(const struct sink *k)
+{
+  return k->fd;
+}
+
+/**
+ * Bytes waiting to be written
+ */
+size_t
+sink_queued(const struct sink *k)
+{
+  return k->len;
+}
+
+/**
+ * True if what feeds the sink should wait. A failed sink is never full, so
+ * that its writers find out.
+ */
+int
+sink_full(const struct sink *k)
+{
+  return !k->failed && k->len >= SINK_QUEUE_MAX;
+}
+
+/**
+ * Start or end a stall
+ */
+static void
+stall(struct sink *k, int start)
+{
+  struct timespec now;
+  double t;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if (start) {
+    k->stall_start = now;
+    return;
+  }
+  t = (now.tv_sec - k->stall_start.tv_sec)
+    + (now.tv_nsec - k->stall_start.tv_nsec) / 1e9;
+  k->stalls++;
+  k->stall_total += t;
+  if (t > k->stall_max) {
+    k->stall_max = t;
+  }
+}
+
+/**
+ * Add to the end of the queue
+ *
+ * @return  0 on success, -1 if out of memory
+ */
+static int
+enqueue(struct sink *k, const char *p, size_t len)
+{
+  if (k->start + k->len + len > k->size) {
+    if (k->start) {
+      memmove(k->buf, k->buf + k->start, k->len);
+      k->start = 0;
+    }
+    if (k->len + len > k->size) {
+      size_t newsize = k->size ? k->size : 65536;
+      char *n;
+      while (newsize < k->len + len) {
+        newsize *= 2;
+      }
+      if (!(n = realloc(k->buf, newsize))) {
+        return -1;
+      }
+      k->buf = n;
+      k->size = newsize;
+    }
+  }
+  memcpy(k->buf + k->start + k->len, p, len);
+  k->len += len;
+  return 0;
+}
+
+/**
+ * Give up on the sink
+ */
+static int
+fail(struct sink *k, int err)
+{
+  k->failed = err;
+  k->start = k->len = 0;
+  errno = err;
+  return -1;
+}
+
+/**
+ * Write, or queue what can't be written now. The iovec list is not
+ * modified.
+ *
+ * @return  0 on success, -1 if the destination is broken (errno set)
+ */
+int
+sink_writev(struct sink *k, const struct iovec *iov, int iovcnt)
+{
+  ssize_t n = 0;
+  size_t want = 0;
+  int c;
+
+  if (k->failed) {
+    errno = k->failed;
+    return -1;
+  }
+  if (!k->len) {
+    for (c = 0; c < iovcnt; c++) {
+      want += iov[c].iov_len;
+    }
+    do {
+      n = writev(k->fd, iov, iovcnt);
+      TRACE(write, k->fd, want, n);
+    } while (0 > n && errno == EINTR);
+    if (0 > n) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        return fail(k, errno);
+      }
+      n = 0;
+    }
+    if ((size_t)n < want) {
+      TRACE(partial, k->fd, want, n);
+    }
+  }
+
+  /* skip what was written, queue the rest */
+  for (c = 0; c < iovcnt; c++) {
+    if ((size_t)n >= iov[c].iov_len) {
+      n -= iov[c].iov_len;
+      continue;
+    }
+    if (!k->len) {
+      stall(k, 1);
+    }
+    if (enqueue(k, (char*)iov[c].iov_base + n, iov[c].iov_len - n)) {
+      return fail(k, ENOMEM);
+    }
+    n = 0;
+  }
+  return 0;
+}
+
+/**
+ * Write what's queued, as much as the destination takes. Call when it's
+ * writable.
+ *
+ * @return  0 on success, -1 if the destination is broken (errno set)
+ */
+int
+sink_drain(struct sink *k)
+{
+  ssize_t n;
+
+  while (k->len) {
+    do {
+      n = write(k->fd, k->buf + k->start, k->len);
+      TRACE(write, k->fd, k->len, n);
+    } while (0 > n && errno == EINTR);
+    if (0 > n) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return 0;
+      }
+      return fail(k, errno);
+    }
+    k->start += n;
+    k->len -= n;
+    if (!k->len) {
+      k->start = 0;
+      stall(k, 0);
+    }
+  }
+  return 0;
+}
+
+/**
+ * Write everything that's queued, waiting as long as it takes.
+ *
+ * @return  0 on success, -1 if the destination is broken (errno set)
+ */
+int
+sink_finish(struct sink *k)
+{
+  struct pollfd pfd;
+
+  pfd.fd = k->fd;
+  pfd.events = POLLOUT;
+  while (k->len) {
+    if (sink_drain(k)) {
+      return -1;
+    }
+    if (k->len && 0 > poll(&pfd, 1, -1) && errno != EINTR) {
+      return fail(k, errno);
+    }
+  }
+  return k->failed ? -1 : 0;
+}
+
+/**
+ * How often, and for how long in total and at most (seconds), the
+ * destination made ind queue output.
+ */
+void
+sink_stalls(const struct sink *k, unsigned long *count,
+            double *total, double *max)
+{
+  *count = k->stalls;
+  *total = k->stall_total;
+  *max = k->stall_max;
+}
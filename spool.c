@@ -0,0 +1,428 @@
+/* ind/spool.c - bounded output buffer that spills to disk
+ *
+ * (BSD license without advertising clause below)
+ *
+ * Copyright (c) 2019 Thomas Habets <thomas@habets.se>. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+/*
+ * A spool holds output that can't be written yet, in order. Up to
+ * mem_max bytes are kept in memory, and when that's full it's appended to
+ * a spill file, an unlinked temporary file shared by all spools. A spool
+ * is then a list of extents of that file followed by what's in memory.
+ * A spool that has to wait can be parked: its memory moves to the file
+ * too, so only running writers hold memory however many are waiting.
+ *
+ * Emitting copies the extents with sendfile() where there is one, so the
+ * bulk of it never passes through ind, and then writes the memory part.
+ * Once nothing is held in the spill file it's closed, and a new one is
+ * made when needed. It can't be reused or have holes punched into it
+ * before that, because sendfile() to a pipe passes on the file's pages
+ * rather than copies of them.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#ifdef HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif
+
+#include "spool.h"
+
+struct spill {
+  int fd;         /* -1 until first needed */
+  off_t end;      /* where the next extent goes */
+  off_t held;     /* bytes not yet emitted */
+};
+
+struct extent {
+  off_t off;
+  off_t len;
+};
+
+struct spool {
+  struct spill *sf;
+  size_t mem_max;
+  char *buf;
+  size_t len;
+  struct extent *ext;
+  int next;
+  int next_size;
+};
+
+/**
+ * A spill file, opened when first needed
+ *
+ * @return  new spill file, or NULL if out of memory
+ */
+struct spill *
+spill_new(void)
+{
+  struct spill *sf;
+  if (!(sf = calloc(1, sizeof(*sf)))) {
+    return NULL;
+  }
+  sf->fd = -1;
+  return sf;
+}
+
+/**
+ *
+ */
+void
+spill_free(struct spill *sf)
+{
+  if (!sf) {
+    return;
+  }
+  if (0 <= sf->fd) {
+    close(sf->fd);
+  }
+  free(sf);
+}
+
+/**
+ * Create and unlink the file in $TMPDIR
+ *
+ * @return  0 on success, -1 on error (errno set)
+ */
+static int
+spill_open(struct spill *sf)
+{
+  const char *dir = getenv("TMPDIR");
+  char *fn;
+
+  if (0 <= sf->fd) {
+    return 0;
+  }
+  if (!dir || !*dir) {
+    dir = "/tmp";
+  }
+  if (!(fn = malloc(strlen(dir) + 32))) {
+    return -1;
+  }
+  sprintf(fn, "%s/ind-spool.XXXXXX", dir);
+  if (0 > (sf->fd = mkstemp(fn))) {
+    free(fn);
+    return -1;
+  }
+  unlink(fn);
+  free(fn);
+  fcntl(sf->fd, F_SETFD, FD_CLOEXEC);
+  return 0;
+}
+
+/**
+ * Append to the spill file as a new extent of sp
+ *
+ * @return  0 on success, -1 on error (errno set)
+ */
+static int
+spill_write(struct spool *sp, const char *buf, size_t len)
+{
+  struct spill *sf = sp->sf;
+  size_t done = 0;
+
+  if (!len) {
+    return 0;
+  }
+  if (spill_open(sf)) {
+    return -1;
+  }
+  while (done < len) {
+    ssize_t n = pwrite(sf->fd, buf + done, len - done, sf->end + done);
+    if (0 > n) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    done += n;
+  }
+
+  /* spools filling up at the same time take turns, so merging only
+   * happens when nobody else wrote in between */
+  if (sp->next && sp->ext[sp->next - 1].off + sp->ext[sp->next - 1].len
+      == sf->end) {
+    sp->ext[sp->next - 1].len += len;
+  } else {
+    if (sp->next == sp->next_size) {
+      int size = sp->next_size ? sp->next_size * 2 : 4;
+      struct extent *e = realloc(sp->ext, size * sizeof(*e));
+      if (!e) {
+        return -1;
+      }
+      sp->ext = e;
+      sp->next_size = size;
+    }
+    sp->ext[sp->next].off = sf->end;
+    sp->ext[sp->next].len = len;
+    sp->next++;
+  }
+  sf->end += len;
+  sf->held += len;
+  return 0;
+}
+
+/**
+ * A spool keeping at most mem_max bytes in memory
+ *
+ * @return  new spool, or NULL if out of memory
+ */
+struct spool *
+spool_new(struct spill *sf, size_t mem_max)
+{
+  struct spool *sp;
+  if (!(sp = calloc(1, sizeof(*sp)))) {
+    return NULL;
+  }
+  sp->sf = sf;
+  sp->mem_max = mem_max;
+  return sp;
+}
+
+/**
+ * Move what's in memory to the spill file
+ *
+ * @return  0 on success, -1 on error (errno set)
+ */
+static int
+spool_spill(struct spool *sp)
+{
+  if (spill_write(sp, sp->buf, sp->len)) {
+    return -1;
+  }
+  sp->len = 0;
+  return 0;
+}
+
+/**
+ * Append data
+ *
+ * @return  0 on success, -1 on error (errno set)
+ */
+int
+spool_writev(struct spool *sp, const struct iovec *iov, int iovcnt)
+{
+  int c;
+
+  for (c = 0; c < iovcnt; c++) {
+    const char *p = iov[c].iov_base;
+    size_t n = iov[c].iov_len;
+
+    if (sp->len + n > sp->mem_max) {
+      if (spool_spill(sp)) {
+        return -1;
+      }
+      if (n >= sp->mem_max) {
+        /* wouldn't fit anyway */
+        if (spill_write(sp, p, n)) {
+          return -1;
+        }
+        continue;
+      }
+    }
+    if (!sp->buf && !(sp->buf = malloc(sp->mem_max))) {
+      return -1;
+    }
+    memcpy(sp->buf + sp->len, p, n);
+    sp->len += n;
+  }
+  return 0;
+}
+
+/**
+ * Nothing more will be added for now, and the spool will have to wait:
+ * give back its memory.
+ *
+ * @return  0 on success, -1 on error (errno set)
+ */
+int
+spool_park(struct spool *sp)
+{
+  if (spool_spill(sp)) {
+    return -1;
+  }
+  free(sp->buf);
+  sp->buf = NULL;
+  return 0;
+}
+
+/**
+ * Wait until fd can be written to, if it's non-blocking
+ */
+static void
+wait_writable(int fd)
+{
+  struct pollfd pfd;
+  pfd.fd = fd;
+  pfd.events = POLLOUT;
+  poll(&pfd, 1, -1);
+}
+
+/**
+ * Write all of buf, even to a non-blocking fd
+ */
+static int
+write_all(int fd, const char *buf, size_t len)
+{
+  while (len) {
+    ssize_t n = write(fd, buf, len);
+    if (0 > n) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        wait_writable(fd);
+        continue;
+      }
+      return -1;
+    }
+    buf += n;
+    len -= n;
+  }
+  return 0;
+}
+
+/**
+ * Copy an extent of the spill file to fd
+ */
+static int
+copy_extent(int fd, int from, off_t off, off_t len)
+{
+#ifdef HAVE_SENDFILE
+  while (len) {
+    ssize_t n = sendfile(fd, from, &off, len);
+    if (0 > n) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        wait_writable(fd);
+        continue;
+      }
+      if (errno == EINVAL || errno == ENOSYS) {
+        /* not to this kind of fd */
+        break;
+      }
+      return -1;
+    }
+    if (!n) {
+      errno = EIO;
+      return -1;
+    }
+    len -= n;
+  }
+#endif
+  while (len) {
+    char buf[65536];
+    ssize_t n = pread(from, buf, len < (off_t)sizeof(buf)
+                      ? (size_t)len : sizeof(buf), off);
+    if (0 > n) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    if (!n) {
+      errno = EIO;
+      return -1;
+    }
+    if (write_all(fd, buf, n)) {
+      return -1;
+    }
+    off += n;
+    len -= n;
+  }
+  return 0;
+}
+
+/**
+ * Write everything in the spool to fd, waiting as long as it takes, and
+ * empty it.
+ *
+ * @return  0 on success, -1 on error (errno set)
+ */
+int
+spool_emit(struct spool *sp, int fd)
+{
+  int c;
+
+  for (c = 0; c < sp->next; c++) {
+    if (copy_extent(fd, sp->sf->fd, sp->ext[c].off, sp->ext[c].len)) {
+      return -1;
+    }
+    sp->sf->held -= sp->ext[c].len;
+  }
+  if (sp->next && !sp->sf->held) {
+    close(sp->sf->fd);
+    sp->sf->fd = -1;
+    sp->sf->end = 0;
+  }
+  sp->next = 0;
+  if (write_all(fd, sp->buf, sp->len)) {
+    return -1;
+  }
+  sp->len = 0;
+  return 0;
+}
+
+/**
+ * Bytes held
+ */
+off_t
+spool_size(const struct spool *sp)
+{
+  off_t size = sp->len;
+  int c;
+  for (c = 0; c < sp->next; c++) {
+    size += sp->ext[c].len;
+  }
+  return size;
+}
+
+/**
+ *
+ */
+void
+spool_free(struct spool *sp)
+{
+  if (!sp) {
+    return;
+  }
+  free(sp->buf);
+  free(sp->ext);
+  free(sp);
+}
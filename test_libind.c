@@ -0,0 +1,189 @@
+/* ind/test_libind.c - check specialized decoration against the generic one
+ *
+ * (BSD license without advertising clause below)
+ *
+ * Copyright (c) 2019 Thomas Habets <thomas@habets.se>. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+/*
+ * Usage: test_libind [ -n <rounds> ]
+ *
+ * Feeds the same random text, with LF, CR and CRLF line ends split at
+ * random places between calls, through two streams with the same
+ * templates: one with the kernel picked for them, one forced to use the
+ * generic kernel. The output must be the same.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include "libind.h"
+
+struct out {
+  char *buf;
+  size_t len;
+  size_t size;
+};
+
+/**
+ * Feed all of buf, appending the output to o
+ */
+static void
+feed(struct ind_stream *s, const char *buf, size_t len, struct out *o)
+{
+  struct iovec *iov;
+  int iovcnt;
+  int c;
+
+  while (len) {
+    size_t n = ind_stream_feed(s, buf, len, &iov, &iovcnt);
+    for (c = 0; c < iovcnt; c++) {
+      while (o->len + iov[c].iov_len > o->size) {
+        o->size = o->size ? o->size * 2 : 4096;
+        if (!(o->buf = realloc(o->buf, o->size))) {
+          fprintf(stderr, "test_libind: realloc() failed\n");
+          exit(1);
+        }
+      }
+      memcpy(o->buf + o->len, iov[c].iov_base, iov[c].iov_len);
+      o->len += iov[c].iov_len;
+    }
+    buf += n;
+    len -= n;
+  }
+}
+
+/**
+ * Random text of len bytes, mostly short lines
+ */
+static void
+gen(char *buf, size_t len)
+{
+  static const char ends[][3] = { "\n", "\n", "\n", "\r", "\r\n" };
+  size_t off = 0;
+
+  while (off < len) {
+    size_t ll = rand() % 3 ? rand() % 40 : rand() % 400;
+    const char *e = ends[rand() % 5];
+    for (; ll && off < len; ll--) {
+      buf[off++] = 'a' + rand() % 26;
+    }
+    for (; *e && off < len; e++) {
+      buf[off++] = *e;
+    }
+  }
+}
+
+/**
+ * @return  0 if the kernel for the templates does what the generic one
+ *          does, else 1
+ */
+static int
+check(const char *prefix, const char *postfix, const char *kernel,
+      int rounds)
+{
+  struct ind_stream *s[2];
+  struct out o[2];
+  char buf[8192];
+  int ret = 0;
+  int r, c;
+
+  memset(o, 0, sizeof(o));
+  for (c = 0; c < 2; c++) {
+    if (!(s[c] = ind_stream_new(prefix, postfix))) {
+      fprintf(stderr, "test_libind: ind_stream_new() failed\n");
+      exit(1);
+    }
+  }
+  ind_stream_generic(s[1]);
+  if (strcmp(ind_stream_kernel(s[0]), kernel)) {
+    printf("FAIL: '%s' '%s': kernel %s, expected %s\n",
+           prefix, postfix, ind_stream_kernel(s[0]), kernel);
+    ret = 1;
+  }
+  for (r = 0; r < rounds; r++) {
+    size_t len = 1 + rand() % sizeof(buf);
+    size_t off = 0;
+    gen(buf, len);
+    while (off < len) {
+      size_t n = 1 + rand() % (len - off);
+      if (!(rand() % 4)) {
+        n = 1;
+      }
+      for (c = 0; c < 2; c++) {
+        feed(s[c], buf + off, n, &o[c]);
+      }
+      off += n;
+    }
+  }
+  if (o[0].len != o[1].len || memcmp(o[0].buf, o[1].buf, o[0].len)) {
+    printf("FAIL: '%s' '%s': %s output differs from generic\n",
+           prefix, postfix, kernel);
+    ret = 1;
+  } else if (ind_stream_width(s[0]) != ind_stream_width(s[1])) {
+    printf("FAIL: '%s' '%s': %s width differs from generic\n",
+           prefix, postfix, kernel);
+    ret = 1;
+  } else {
+    printf("PASS: '%s' '%s': %s, %lu bytes\n",
+           prefix, postfix, kernel, (unsigned long)o[0].len);
+  }
+  for (c = 0; c < 2; c++) {
+    ind_stream_free(s[c]);
+    free(o[c].buf);
+  }
+  return ret;
+}
+
+int
+main(int argc, char **argv)
+{
+  int rounds = 200;
+  int ret = 0;
+  int c;
+
+  while (-1 != (c = getopt(argc, argv, "n:"))) {
+    switch (c) {
+    case 'n':
+      rounds = atoi(optarg);
+      break;
+    default:
+      fprintf(stderr, "usage: %s [ -n <rounds> ]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  srand(0);
+  ret |= check("", "", "passthrough", rounds);
+  ret |= check("  ", "", "prefix", rounds);
+  ret |= check("", " <<", "prefix+postfix", rounds);
+  ret |= check(">> ", " <<", "prefix+postfix", rounds);
+  ret |= check("%Y ", "", "time", rounds);
+  ret |= check("%Y ", " <<", "generic", rounds);
+  ret |= check("%{seq} ", "", "generic", rounds);
+  ret |= check("%{seq}: ", " (%{seq})", "generic", rounds);
+  return ret;
+}
@@ -0,0 +1,162 @@
+/* ind/test_logsink.c - Test --log against a stand-in log socket
+ *
+ * (BSD license without advertising clause below)
+ *
+ * Copyright (c) 2019 Thomas Habets <thomas@habets.se>. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+/*
+ * Usage: test_logsink [ <path to ind> ]
+ *
+ * Binds a temporary AF_UNIX datagram socket in place of journald or
+ * syslog, runs ind with --log and --log-socket pointing at it, and checks
+ * the framing and priority of each message it gets.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+struct expect {
+  const char *start;  /* message must start with this */
+  const char *end;    /* and end with this */
+};
+
+/**
+ * Run ind with --log <kind> on a child writing "out" to stdout and then
+ * "err" to stderr, and check the two messages that arrive on sock
+ *
+ * @return  0 if the messages are as expected, else 1
+ */
+static int
+check(const char *ind, const char *path, int sock, const char *kind,
+      const struct expect *want)
+{
+  char buf[1024];
+  pid_t pid;
+  int status;
+  int seen = 0;
+  int ret = 0;
+  int c;
+
+  if (0 > (pid = fork())) {
+    fprintf(stderr, "test_logsink: fork() failed: %s\n", strerror(errno));
+    exit(1);
+  }
+  if (!pid) {
+    int null = open("/dev/null", O_RDWR);
+    dup2(null, 0);
+    dup2(null, 1);
+    dup2(null, 2);
+    execl(ind, ind, "--log", kind, "--log-socket", path,
+          "sh", "-c", "echo out; echo err >&2", (char*)NULL);
+    _exit(127);
+  }
+  if (0 > waitpid(pid, &status, 0)
+      || !WIFEXITED(status) || WEXITSTATUS(status)) {
+    printf("FAIL: %s: %s did not exit cleanly\n", kind, ind);
+    return 1;
+  }
+  /* stdout and stderr are separate pipes, so either may be read first */
+  for (c = 0; c < 2; c++) {
+    ssize_t n = recv(sock, buf, sizeof(buf) - 1, MSG_DONTWAIT);
+    int m;
+    if (0 > n) {
+      printf("FAIL: %s: message %d missing: %s\n", kind, c, strerror(errno));
+      ret = 1;
+      break;
+    }
+    buf[n] = 0;
+    for (m = 0; m < 2; m++) {
+      size_t sl = strlen(want[m].start);
+      size_t el = strlen(want[m].end);
+      if ((size_t)n >= sl + el
+          && !memcmp(buf, want[m].start, sl)
+          && !memcmp(buf + n - el, want[m].end, el)) {
+        break;
+      }
+    }
+    if (m == 2 || (seen & (1 << m))) {
+      printf("FAIL: %s: unexpected message '%s'\n", kind, buf);
+      ret = 1;
+    } else {
+      seen |= 1 << m;
+    }
+  }
+  if (0 <= recv(sock, buf, sizeof(buf), MSG_DONTWAIT)) {
+    printf("FAIL: %s: more than two messages\n", kind);
+    ret = 1;
+  }
+  if (!ret) {
+    printf("PASS: %s\n", kind);
+  }
+  return ret;
+}
+
+int
+main(int argc, char **argv)
+{
+  static const struct expect journal[] = {
+    { "PRIORITY=6\nSYSLOG_IDENTIFIER=sh\n", "MESSAGE=out\n" },
+    { "PRIORITY=3\nSYSLOG_IDENTIFIER=sh\n", "MESSAGE=err\n" },
+  };
+  static const struct expect syslog[] = {
+    { "<14>1 ", " - - out" },
+    { "<11>1 ", " - - err" },
+  };
+  const char *ind = (argc > 1) ? argv[1] : "./ind";
+  char dir[] = "/tmp/test_logsink.XXXXXX";
+  struct sockaddr_un sa;
+  int sock;
+  int ret = 0;
+
+  if (!mkdtemp(dir)) {
+    fprintf(stderr, "test_logsink: mkdtemp() failed: %s\n", strerror(errno));
+    return 1;
+  }
+  memset(&sa, 0, sizeof(sa));
+  sa.sun_family = AF_UNIX;
+  snprintf(sa.sun_path, sizeof(sa.sun_path), "%s/log", dir);
+  if (0 > (sock = socket(AF_UNIX, SOCK_DGRAM, 0))
+      || 0 > bind(sock, (struct sockaddr*)&sa, sizeof(sa))) {
+    fprintf(stderr, "test_logsink: can't bind %s: %s\n",
+            sa.sun_path, strerror(errno));
+    rmdir(dir);
+    return 1;
+  }
+
+  ret |= check(ind, sa.sun_path, sock, "journal", journal);
+  ret |= check(ind, sa.sun_path, sock, "syslog", syslog);
+
+  close(sock);
+  unlink(sa.sun_path);
+  rmdir(dir);
+  return ret;
+}
@@ -0,0 +1,287 @@
+/* ind/trace.c - binary event trace and static probes
+ *
+ * (BSD license without advertising clause below)
+ *
+ * Copyright (c) 2019 Thomas Habets <thomas@habets.se>. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+/*
+ * Events are fixed size records in a ring in a shared mapping of the trace
+ * file, so the file is always up to date, even if ind is killed. Recording
+ * one is a clock read and a few stores.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "trace.h"
+
+static const char trace_magic[8] = { 'I','N','D','T','R','C','0','1' };
+
+struct trace_hdr {
+  char magic[8];
+  uint64_t size;     /* ring size, in records */
+  uint64_t head;     /* records written, ever */
+  int64_t  wall_ns;  /* CLOCK_REALTIME minus CLOCK_MONOTONIC, at start */
+};
+
+struct trace_rec {
+  uint64_t ns;       /* CLOCK_MONOTONIC */
+  uint32_t ev;
+  int32_t  fd;
+  int64_t  a;
+  int64_t  b;
+};
+
+int trace_on = 0;
+
+static struct trace_hdr *trace_map;
+static size_t trace_maplen;
+
+/**
+ *
+ */
+static int64_t
+ts_ns(const struct timespec *ts)
+{
+  return (int64_t)ts->tv_sec * 1000000000LL + ts->tv_nsec;
+}
+
+/**
+ * Start tracing into a file
+ *
+ * @param   fn    trace file, created or truncated
+ * @param   size  size of the ring in bytes
+ *
+ * @return  0 on success, -1 on error (errno set)
+ */
+int
+trace_open(const char *fn, size_t size)
+{
+  struct timespec mono, wall;
+  void *map;
+  int fd;
+
+  size /= sizeof(struct trace_rec);
+  if (!size) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (0 > (fd = open(fn, O_RDWR | O_CREAT | O_TRUNC, 0600))) {
+    return -1;
+  }
+  trace_maplen = sizeof(struct trace_hdr) + size * sizeof(struct trace_rec);
+  if (ftruncate(fd, trace_maplen)
+      || MAP_FAILED == (map = mmap(NULL, trace_maplen,
+                                   PROT_READ | PROT_WRITE, MAP_SHARED,
+                                   fd, 0))) {
+    int save = errno;
+    close(fd);
+    errno = save;
+    return -1;
+  }
+  close(fd);
+
+  trace_map = map;
+  clock_gettime(CLOCK_MONOTONIC, &mono);
+  clock_gettime(CLOCK_REALTIME, &wall);
+  memcpy(trace_map->magic, trace_magic, sizeof(trace_magic));
+  trace_map->size = size;
+  trace_map->wall_ns = ts_ns(&wall) - ts_ns(&mono);
+  trace_on = 1;
+  return 0;
+}
+
+/**
+ * Record one event. Use TRACE() instead, it also fires the static probe.
+ */
+void
+trace_event(int ev, int fd, int64_t a, int64_t b)
+{
+  struct trace_hdr *h = trace_map;
+  struct trace_rec *r;
+  struct timespec ts;
+
+  if (!h) {
+    return;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  r = (struct trace_rec*)(h + 1) + h->head % h->size;
+  r->ns = ts_ns(&ts);
+  r->ev = ev;
+  r->fd = fd;
+  r->a = a;
+  r->b = b;
+  h->head++;
+}
+
+/**
+ * Stop tracing. The file stays.
+ */
+void
+trace_close(void)
+{
+  if (trace_map) {
+    munmap(trace_map, trace_maplen);
+    trace_map = NULL;
+  }
+  trace_on = 0;
+}
+
+/**
+ *
+ */
+static const char*
+ev_name(uint32_t ev)
+{
+  switch (ev) {
+  case trace_ev_select: return "select";
+  case trace_ev_wake: return "wake";
+  case trace_ev_read: return "read";
+  case trace_ev_scan: return "scan";
+  case trace_ev_format: return "format";
+  case trace_ev_write: return "write";
+  case trace_ev_partial: return "partial";
+  case trace_ev_winch: return "winch";
+  }
+  return "unknown";
+}
+
+/**
+ * Write the arguments of an event the way they're best read
+ */
+static void
+ev_args(FILE *f, const struct trace_rec *r)
+{
+  long long a = r->a;
+  long long b = r->b;
+
+  switch (r->ev) {
+  case trace_ev_select:
+    fprintf(f, "nfds=%lld timeout=", a);
+    if (0 > b) {
+      fprintf(f, "none");
+    } else {
+      fprintf(f, "%lldms", b);
+    }
+    break;
+  case trace_ev_wake:
+    fprintf(f, "ready=%lld", a);
+    if (0 > a) {
+      fprintf(f, " (%s)", strerror(b));
+    }
+    break;
+  case trace_ev_read:
+    fprintf(f, "fd=%d n=%lld", r->fd, a);
+    if (0 > a) {
+      fprintf(f, " (%s)", strerror(b));
+    }
+    break;
+  case trace_ev_scan:
+    fprintf(f, "fd=%d in=%lld used=%lld", r->fd, a, b);
+    break;
+  case trace_ev_format:
+    fprintf(f, "fd=%d iovcnt=%lld bytes=%lld", r->fd, a, b);
+    break;
+  case trace_ev_write:
+  case trace_ev_partial:
+    fprintf(f, "fd=%d want=%lld wrote=%lld", r->fd, a, b);
+    break;
+  case trace_ev_winch:
+    fprintf(f, "fd=%d rows=%lld cols=%lld", r->fd, a, b);
+    break;
+  default:
+    fprintf(f, "ev=%u fd=%d a=%lld b=%lld", r->ev, r->fd, a, b);
+  }
+}
+
+/**
+ * Print a trace file as text, oldest event first: wall clock time, time
+ * since the previous event, event, arguments.
+ *
+ * @return  0 on success, -1 on error (printed)
+ */
+int
+trace_decode(const char *fn)
+{
+  struct trace_hdr h;
+  struct trace_rec r;
+  uint64_t first, c;
+  uint64_t last = 0;
+  FILE *f;
+
+  if (!(f = fopen(fn, "r"))) {
+    fprintf(stderr, "ind: can't open %s: %s\n", fn, strerror(errno));
+    return -1;
+  }
+  if (1 != fread(&h, sizeof(h), 1, f)
+      || memcmp(h.magic, trace_magic, sizeof(trace_magic))
+      || !h.size) {
+    fprintf(stderr, "ind: %s is not a trace file\n", fn);
+    fclose(f);
+    return -1;
+  }
+  first = (h.head > h.size) ? h.head - h.size : 0;
+  if (first) {
+    printf("(%llu older events overwritten)\n", (unsigned long long)first);
+  }
+  for (c = first; c < h.head; c++) {
+    time_t sec;
+    struct tm tm;
+    int64_t wall;
+    char tbuf[32];
+
+    if (fseeko(f, sizeof(h) + (c % h.size) * sizeof(r), SEEK_SET)
+        || 1 != fread(&r, sizeof(r), 1, f)) {
+      fprintf(stderr, "ind: %s is truncated\n", fn);
+      fclose(f);
+      return -1;
+    }
+    wall = r.ns + h.wall_ns;
+    sec = wall / 1000000000LL;
+    localtime_r(&sec, &tm);
+    strftime(tbuf, sizeof(tbuf), "%H:%M:%S", &tm);
+    printf("%s.%06lld %+10.6f %-8s ", tbuf,
+           (long long)(wall % 1000000000LL) / 1000,
+           (c == first) ? 0.0 : (double)(r.ns - last) / 1e9,
+           ev_name(r.ev));
+    ev_args(stdout, &r);
+    printf("\n");
+    last = r.ns;
+  }
+  fclose(f);
+  return 0;
+}
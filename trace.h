@@ -0,0 +1,72 @@
+/* ind/trace.h - binary event trace and static probes
+ *
+ * (BSD license without advertising clause below)
+ *
+ * Copyright (c) 2019 Thomas Habets <thomas@habets.se>. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef __INCLUDE_TRACE_H__
+#define __INCLUDE_TRACE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* events, also the names of the static probes (provider "ind") */
+enum trace_ev {
+  trace_ev_select = 1, /* about to wait. a: nfds, b: timeout in ms or -1 */
+  trace_ev_wake,       /* woke up. a: ready fds or -1, b: errno */
+  trace_ev_read,       /* a: bytes read or -1, b: errno */
+  trace_ev_scan,       /* a: bytes offered, b: bytes consumed */
+  trace_ev_format,     /* a: iovec entries, b: bytes */
+  trace_ev_write,      /* a: bytes wanted, b: bytes written or -1 */
+  trace_ev_partial,    /* a: bytes wanted, b: bytes written */
+  trace_ev_winch,      /* a: rows, b: columns */
+};
+
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#define TRACE_PROBE(name, fd, a, b) DTRACE_PROBE3(ind, name, fd, a, b)
+#else
+#define TRACE_PROBE(name, fd, a, b) do {} while (0)
+#endif
+
+/**
+ * Record an event. Costs a test of a global when tracing is off, and a
+ * nop when the probe is not enabled.
+ */
+#define TRACE(name, fd, a, b) do {                                      \
+    TRACE_PROBE(name, (int)(fd), (long long)(a), (long long)(b));      \
+    if (trace_on) {                                                     \
+      trace_event(trace_ev_##name, (fd), (a), (b));                     \
+    }                                                                   \
+  } while (0)
+
+extern int trace_on;
+
+int trace_open(const char *fn, size_t size);
+void trace_event(int ev, int fd, int64_t a, int64_t b);
+int trace_decode(const char *fn);
+void trace_close(void);
+
+#endif